@@ -2,6 +2,8 @@
 #include "include/IO.h"
 #include "include/Mathlib.h"
 
+#include <algorithm>
+
 #include "libs/include/assimp/Importer.hpp"
 #include "libs/include/assimp/scene.h"
 #include "libs/include/assimp/postprocess.h"
@@ -18,17 +20,18 @@
 
 namespace toy
 {
-	void AssetModel::SkeletalAnimation::NodeAnim::calcInterpolatedRotation(
-		double time, fquat* out)
+	/* index of the first key after time, 0 if time is before the first
+	   or after the last key, binary search so no state is kept between calls */
+	static inline uint findNextKey(const double* keyTimes, uint keyNum, double time)
 	{
-		uint frame = rotationKeyTimes[lastRotKey] < time ? ++lastRotKey : 0;
-		for (; frame < rotKeyNum; ++frame)
-		{
-			if (rotationKeyTimes[frame] > time)
-				break;
-		}
-		frame %= rotKeyNum;
+		return static_cast<uint>(
+			std::upper_bound(keyTimes, keyTimes + keyNum, time) - keyTimes) % keyNum;
+	}
 
+	void AssetModel::SkeletalAnimation::NodeAnim::calcInterpolatedRotation(
+		double time, fquat* out) const
+	{
+		uint frame = findNextKey(rotationKeyTimes, rotKeyNum, time);
 		if (0 != frame)
 		{
 			double deltaT = rotationKeyTimes[frame] - rotationKeyTimes[frame - 1];
@@ -36,69 +39,36 @@ namespace toy
 			assert(factor >= 0.0f && factor <= 1.0f);
 			*out = slerp(rotationKeys[frame - 1], rotationKeys[frame], factor);
 			out->normalize();
-			lastRotKey = --frame;
 		}
 		else
-		{
 			*out = rotationKeys[0];
-			lastRotKey = 0;
-		}
 	}
 
 	void AssetModel::SkeletalAnimation::NodeAnim::calcInterpolatedTranslation(
-		double time, fvec3 *out)
+		double time, fvec3 *out) const
 	{
-		uint frame = positionKeyTimes[lastTransKey] < time ? ++lastTransKey : 0;
-		for (; frame < posKeyNum; ++frame)
-		{
-			if (positionKeyTimes[frame] > time)
-				break;
-		}
-		frame %= posKeyNum;
+		uint frame = findNextKey(positionKeyTimes, posKeyNum, time);
 		if (0 != frame)
 		{
 			double deltaT = positionKeyTimes[frame] - positionKeyTimes[frame - 1];
 			float factor = (time - positionKeyTimes[frame - 1]) / deltaT;
 			assert(factor >= 0.0f && factor <= 1.0f);
-			*out = positionKeys[frame - 1] * factor + positionKeys[frame] * (1.0f - factor);
-			lastTransKey = --frame;
+			*out = positionKeys[frame - 1] * (1.0f - factor) + positionKeys[frame] * factor;
 		}
 		else
-		{
 			*out = positionKeys[0];
-			lastTransKey = 0;
-		}
 	}
 
 	void AssetModel::SkeletalAnimation::NodeAnim::calcInterpolatedScaling(
-		double time, fvec3 *out)
+		double time, fvec3 *out) const
 	{
-		uint frame = scaleKeyTimes[lastScaleKey] < time ? ++lastScaleKey : 0;
-		for (; frame < scaleKeyNum; ++frame)
-		{
-			if (scaleKeyTimes[frame] > time)
-				break;
-		}
-		frame %= scaleKeyNum;
-		if (0 != frame)
-		{
-			*out = scaleKeys[frame];
-			//double deltaT = scaleKeyTimes[scaleIdx] - scaleKeyTimes[scaleIdx - 1];
-			//float factor = (time - scaleKeyTimes[scaleIdx - 1]) / deltaT;
-			//assert(factor >= 0.0f && factor <= 1.0f);
-			//*out = scaleKeys[scaleIdx - 1] * factor + scaleKeys[scaleIdx] * (1.0f - factor);
-			lastScaleKey = --frame;
-		}
-		else
-		{
-			*out = scaleKeys[0];
-			lastScaleKey = 0;
-		}
+		uint frame = findNextKey(scaleKeyTimes, scaleKeyNum, time);
+		*out = scaleKeys[frame];
 	}
 
 	static aiTextureType aTexType[TEXTYPE_TYPEMAX] = {};
 
-	void AssetImporter::init(IRenderDriver* rdr)
+	void AssetImporter::init(IRenderDriver* rdr, JobSystem* jobs)
 	{
 		ilInit();
 		//iluInit();
@@ -116,6 +86,10 @@ namespace toy
 		m_aImporter = new Assimp::Importer;
 
 		m_rdr = rdr;
+		m_jobs = jobs;
+#if TOY_COROUTINES
+		m_modelLock.setJobSystem(jobs);
+#endif
 		
 		aTexType[TEXTYPE_UNKNOWN] = aiTextureType_NONE;
 		aTexType[TEXTYPE_DIFFUSE] = aiTextureType_DIFFUSE;
@@ -351,18 +325,27 @@ namespace toy
 		}
 	}
 
-	static bool loadMesh(
+	static size_t getMeshDataSize(const aiMesh* aMesh)
+	{
+		auto coordSize = aMesh->mNumVertices * sizeof(fvec2);
+		auto triSize = aMesh->mNumFaces * sizeof(uvec3);
+		auto boneIndicesSize = aMesh->mNumVertices * sizeof(uvec4);
+		auto boneWeightSize = aMesh->mNumVertices * sizeof(fvec4);
+		return coordSize + triSize + boneIndicesSize + boneWeightSize;
+	}
+
+	/* tempBuf is getMeshDataSize() bytes, touches nothing but mesh and tempBuf
+	   so meshes can be loaded in parallel */
+	static void loadMesh(
 		const aiMesh* aMesh,
 		AssetModel::Mesh* mesh,
-		DE_Allocator_NoLock* allocator)
+		c8* tempBuf)
 	{
 		auto coordSize = aMesh->mNumVertices * sizeof(fvec2);
 		auto triSize = aMesh->mNumFaces * sizeof(uvec3);
 		auto boneIndicesSize = aMesh->mNumVertices * sizeof(uvec4);
 		auto boneWeightSize = aMesh->mNumVertices * sizeof(fvec4);
-		auto meshSize = coordSize + triSize + boneIndicesSize + boneWeightSize;
 
-		NEW_R(c8, tempBuf, allocator, meshSize);
 		uint tempOffset = 0;
 
 		mesh->pos = reinterpret_cast<fvec3*>(aMesh->mVertices);
@@ -425,8 +408,6 @@ namespace toy
 		}
 
 		calcMeshAABBox(aMesh, mesh);
-
-		return true;
 	}
 
 	/* count node's children, node self included */
@@ -620,9 +601,6 @@ namespace toy
 			nodeAnim.scaleKeys[k].Z = val.z;
 			nodeAnim.scaleKeyTimes[k] = aNodeAnim->mScalingKeys[k].mTime;
 		}
-		nodeAnim.lastRotKey = 0;
-		nodeAnim.lastScaleKey = 0;
-		nodeAnim.lastTransKey = 0;
 	}
 
 	static bool constructAnimations(
@@ -705,11 +683,23 @@ namespace toy
 		if (aScene->HasMeshes())
 		{
 			ALLOC_R(m_model.meshes, allocator, AssetModel::Mesh, aScene->mNumMeshes);
+			c8** meshBufs = allocator->allocR<c8*>(aScene->mNumMeshes);
+			if (nullptr == meshBufs)
+				goto FAIL;
 			for (uint i = 0; i != aScene->mNumMeshes; ++i)
 			{
-				if (!loadMesh(aScene->mMeshes[i], &m_model.meshes[i], allocator))
+				meshBufs[i] = allocator->allocR<c8>(getMeshDataSize(aScene->mMeshes[i]));
+				if (nullptr == meshBufs[i])
 					goto FAIL;
 			}
+			auto loadMeshes = [&](uint first, uint last) {
+				for (uint i = first; i != last; ++i)
+					loadMesh(aScene->mMeshes[i], &m_model.meshes[i], meshBufs[i]);
+			};
+			if (m_jobs)
+				m_jobs->parallelFor(0, aScene->mNumMeshes, 1, loadMeshes);
+			else
+				loadMeshes(0, aScene->mNumMeshes);
 			m_model.meshNum = aScene->mNumMeshes;
 		}
 		else
@@ -76,7 +76,7 @@ namespace toy
 		assert(GL_NONE != glslType);
 
 		GLuint shader = loadShader(source, glslType);
-		return new rd::Shader(shader);
+		return newObject<rd::Shader>(shader);
 	}
 
 	void GLSLShaderProgram::freeShader(rd::Shader* &shader)
@@ -85,7 +85,7 @@ namespace toy
 		if (glIsShader(sdr))
 		{
 			glDeleteShader(sdr);
-			delete shader;
+			deleteObject(shader);
 			shader = nullptr;
 		}
 	}
@@ -227,7 +227,7 @@ namespace toy
 		assert(g_usedBindPointNum < 36 &&
 			g_usedBindPointNum < max_ubo_bindings - 1 &&
 			"Too much SBBO generated");
-		UniformBlock* ub = new UniformBlock;
+		UniformBlock* ub = newObject<UniformBlock>();
 		ub->m_bindPoint = g_usedBindPointNum++;
 		GLuint ubo;
 		glGenBuffers(1, &ubo);
@@ -342,7 +342,7 @@ namespace toy
 			by the same render driver, so it's safe to
 			use static_cast */
 			UniformBlock* ub = static_cast<UniformBlock*>(sbbo);
-			delete ub;
+			deleteObject(ub);
 		}
 	}
 	
@@ -408,6 +408,8 @@ namespace toy
 	void GLRenderDriver::endFrame()
 	{
 		glFinish();
+		if (m_frameAllocator)
+			m_frameAllocator->endFrame();
 	}
 	void GLRenderDriver::setWindowSize(int width, int height)
 	{
@@ -522,7 +524,7 @@ namespace toy
 	{
 		/* No need to call glIsTexture() because
 		   glDeleteTextures(1, &tbo) is safe when tbo == 0 */
-		if (512 < tboNum)
+		if (512 >= tboNum)
 		{
 			GLuint tboHdls[512];
 			for (uint i = 0; i != tboNum; ++i)
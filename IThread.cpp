@@ -0,0 +1,252 @@
+#include "include/IThread.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#ifndef _WIN32
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace toy
+{
+	namespace
+	{
+		struct ReleaseHooks
+		{
+			struct Hook
+			{
+				ThreadSlot::ReleaseFunc func;
+				void* user;
+			};
+			std::vector<Hook> hooks;
+			AdaptiveMutex lock;
+		};
+		ReleaseHooks& getReleaseHooks()
+		{
+			/* never deleted, threads may exit during static destruction */
+			static ReleaseHooks* hooks = new ReleaseHooks;
+			return *hooks;
+		}
+	}
+
+	void ThreadSlot::addReleaseHook(ReleaseFunc func, void* user)
+	{
+		auto& hooks = getReleaseHooks();
+		std::lock_guard<AdaptiveMutex> lock(hooks.lock);
+		hooks.hooks.push_back({ func, user });
+	}
+
+	void ThreadSlot::removeReleaseHook(void* user)
+	{
+		auto& hooks = getReleaseHooks();
+		std::lock_guard<AdaptiveMutex> lock(hooks.lock);
+		auto& list = hooks.hooks;
+		list.erase(std::remove_if(list.begin(), list.end(),
+			[user](const ReleaseHooks::Hook& hook) { return hook.user == user; }), list.end());
+	}
+
+	void ThreadSlot::runReleaseHooks(unsigned int index)
+	{
+		auto& hooks = getReleaseHooks();
+		std::lock_guard<AdaptiveMutex> lock(hooks.lock);
+		for (auto& hook : hooks.hooks)
+			hook.func(hook.user, index);
+	}
+
+	const CpuTopology& CpuTopology::get()
+	{
+		static CpuTopology topology;
+		return topology;
+	}
+
+	CpuTopology::CpuTopology()
+	{
+		m_detected = detect();
+		if (!m_detected)
+		{
+			uint num = std::thread::hardware_concurrency();
+			m_cpuNum = 0 == num ? 1 : num < maxCpuNum ? num : maxCpuNum;
+			m_coreNum = m_cpuNum;
+			for (uint i = 0; i != m_cpuNum; ++i)
+				m_cpus[i] = m_coreBegin[i] = static_cast<u16>(i);
+		}
+		m_coreBegin[m_coreNum] = static_cast<u16>(m_cpuNum);
+	}
+
+#ifdef _WIN32
+	bool CpuTopology::detect()
+	{
+		DWORD_PTR processMask, systemMask;
+		GROUP_AFFINITY groupAffinity;
+		DWORD len = 0;
+		GetLogicalProcessorInformationEx(RelationProcessorCore, nullptr, &len);
+		u8* buf = len ? new u8[len] : nullptr;
+		if (buf && GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask) &&
+			GetThreadGroupAffinity(GetCurrentThread(), &groupAffinity) &&
+			GetLogicalProcessorInformationEx(RelationProcessorCore,
+				reinterpret_cast<SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*>(buf), &len))
+		{
+			/* one record per physical core, its mask holds the SMT siblings */
+			for (DWORD offset = 0; offset < len && m_coreNum != maxCpuNum;)
+			{
+				auto info = reinterpret_cast<SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*>(buf + offset);
+				offset += info->Size;
+				const GROUP_AFFINITY& core = info->Processor.GroupMask[0];
+				if (core.Group != groupAffinity.Group)
+					continue;
+				KAFFINITY mask = core.Mask & processMask;
+				m_coreBegin[m_coreNum] = static_cast<u16>(m_cpuNum);
+				for (uint cpu = 0; mask && m_cpuNum != maxCpuNum; ++cpu, mask >>= 1)
+				{
+					if (mask & 1)
+						m_cpus[m_cpuNum++] = static_cast<u16>(cpu);
+				}
+				if (m_cpuNum != m_coreBegin[m_coreNum])
+					++m_coreNum;
+			}
+		}
+		delete[] buf;
+		return 0 != m_coreNum;
+	}
+
+	namespace thisThread
+	{
+		bool setName(const char* name)
+		{
+			/* Windows 10 1607 and later */
+			using SetThreadDescriptionFunc = HRESULT(WINAPI*)(HANDLE, PCWSTR);
+			static auto setDescription = reinterpret_cast<SetThreadDescriptionFunc>(
+				GetProcAddress(GetModuleHandleW(L"kernel32.dll"), "SetThreadDescription"));
+			if (nullptr == setDescription)
+				return false;
+			wchar_t wname[64];
+			if (0 == MultiByteToWideChar(CP_UTF8, 0, name, -1, wname, 64))
+				return false;
+			return SUCCEEDED(setDescription(GetCurrentThread(), wname));
+		}
+		bool pin(uint cpu)
+		{
+			if (cpu >= sizeof(DWORD_PTR) * 8)
+				return false;
+			return 0 != SetThreadAffinityMask(GetCurrentThread(), static_cast<DWORD_PTR>(1) << cpu);
+		}
+	}
+#else
+	/* read a number of /sys/devices/system/cpu/cpuN/topology */
+	static bool readCpuTopology(uint cpu, const char* item, uint& value)
+	{
+		char path[128];
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/%s", cpu, item);
+		FILE* file = fopen(path, "r");
+		if (nullptr == file)
+			return false;
+		bool ok = 1 == fscanf(file, "%u", &value);
+		fclose(file);
+		return ok;
+	}
+
+	bool CpuTopology::detect()
+	{
+		/* key is package, core and logical processor, sorted keys
+		   put the siblings of a core next to each other */
+		u64 keys[maxCpuNum];
+		uint cpuNum = 0;
+		cpu_set_t allowed;
+		CPU_ZERO(&allowed);
+		if (0 != sched_getaffinity(0, sizeof(allowed), &allowed))
+			return false;
+		for (uint cpu = 0; cpu != CPU_SETSIZE && cpuNum != maxCpuNum; ++cpu)
+		{
+			if (!CPU_ISSET(cpu, &allowed))
+				continue;
+			uint package, core;
+			if (!readCpuTopology(cpu, "physical_package_id", package) ||
+				!readCpuTopology(cpu, "core_id", core))
+				return false;
+			keys[cpuNum++] = (u64)(package & 0xffff) << 48 | (u64)(core & 0xffffff) << 24 | cpu;
+		}
+		if (0 == cpuNum)
+			return false;
+		std::sort(keys, keys + cpuNum);
+		for (uint i = 0; i != cpuNum; ++i)
+		{
+			if (0 == i || keys[i] >> 24 != keys[i - 1] >> 24)
+				m_coreBegin[m_coreNum++] = static_cast<u16>(i);
+			m_cpus[i] = static_cast<u16>(keys[i] & 0xffffff);
+		}
+		m_cpuNum = cpuNum;
+		return true;
+	}
+
+	namespace thisThread
+	{
+		bool setName(const char* name)
+		{
+#ifdef __linux__
+			char shortName[16];
+			strncpy(shortName, name, sizeof(shortName) - 1);
+			shortName[sizeof(shortName) - 1] = 0;
+			return 0 == pthread_setname_np(pthread_self(), shortName);
+#else
+			return false;
+#endif
+		}
+		bool pin(uint cpu)
+		{
+#ifdef __linux__
+			if (cpu >= CPU_SETSIZE)
+				return false;
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(cpu, &set);
+			return 0 == pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+			return false;
+#endif
+		}
+	}
+#endif //_WIN32
+
+	uint CpuTopology::layout(const ThreadConfig& cfg, s32& mainCpu, s32* workerCpus,
+		uint maxWorkerNum) const
+	{
+		bool pin = cfg.pin && m_detected;
+		uint firstCore = cfg.reserveMainCore && m_coreNum > 1 ? 1 : 0;
+		mainCpu = pin && firstCore ? m_cpus[m_coreBegin[0]] : -1;
+
+		/* the order workers take logical processors in, spread takes
+		   the first sibling of every core, then the second ones... */
+		u16 order[maxCpuNum];
+		uint orderNum = 0;
+		if (cfg.spreadCores)
+		{
+			for (uint sibling = 0, added = 1; added; ++sibling)
+			{
+				added = 0;
+				for (uint core = firstCore; core != m_coreNum; ++core)
+				{
+					if (m_coreBegin[core] + sibling < m_coreBegin[core + 1])
+					{
+						order[orderNum++] = m_cpus[m_coreBegin[core] + sibling];
+						++added;
+					}
+				}
+			}
+		}
+		else
+		{
+			for (uint i = m_coreBegin[firstCore]; i != m_cpuNum; ++i)
+				order[orderNum++] = m_cpus[i];
+		}
+
+		uint workerNum = cfg.workerNum;
+		if (0 == workerNum)
+			workerNum = cfg.spreadCores ? m_coreNum - firstCore : orderNum;
+		workerNum = std::min(std::max(workerNum, 1u), maxWorkerNum);
+		/* workers beyond the logical processors would share one, let the OS move them */
+		for (uint i = 0; i != workerNum; ++i)
+			workerCpus[i] = pin && i < orderNum ? order[i] : -1;
+		return workerNum;
+	}
+}
@@ -0,0 +1,559 @@
+#include "include/JobSystem.h"
+#include <algorithm>
+
+namespace toy
+{
+	/* worker the calling thread runs, nullptr out of job systems */
+	static thread_local const JobSystem* tl_jobSystem = nullptr;
+	static thread_local uint tl_workerIdx = 0;
+
+	static inline s64 nowNs()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	static inline u32 nextRandom(u32& state)
+	{
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return state;
+	}
+
+	void JobSystem::init(uint workerNum)
+	{
+		ThreadConfig cfg;
+		cfg.workerNum = workerNum;
+		init(cfg);
+	}
+
+	void JobSystem::init(const ThreadConfig& cfg)
+	{
+		assert(m_workers.empty() && "JobSystem is initialized twice");
+		const CpuTopology& topology = CpuTopology::get();
+		m_hwThreadNum = topology.getCpuNum();
+		m_mainThreadId = std::this_thread::get_id();
+		s32 mainCpu;
+		s32 workerCpus[CpuTopology::maxCpuNum];
+		uint workerNum = topology.layout(cfg, mainCpu, workerCpus, CpuTopology::maxCpuNum);
+		snprintf(m_threadName, sizeof(m_threadName), "%s", cfg.name);
+		if (mainCpu >= 0 && !thisThread::pin(mainCpu))
+			LOGWARNING("JobSystem fails to pin the main thread to cpu %d\n", mainCpu);
+
+		/* pool units start right after a 16 bytes aligned address,
+		   offset the buffer so the quests land on cache lines */
+		size_t bufSize = tPoolAllocator_LockFree<TaskQuest>::getBufferSize(questNum);
+		m_questBuffer = new u8[bufSize + CACHELINESIZE * 2];
+		size_t lineAddr = (reinterpret_cast<size_t>(m_questBuffer) + CACHELINESIZE * 2 - 1) &
+			~(size_t)(CACHELINESIZE - 1);
+		m_quests = new tPoolAllocator_LockFree<TaskQuest>(
+			reinterpret_cast<void*>(lineAddr - 16), questNum, "JobQuestPool");
+
+		m_running.store(true, std::memory_order_release);
+		resetStats();
+		for (uint i = 0; i != workerNum; ++i)
+		{
+			auto worker = new Worker;
+			worker->rndState = 0x9E3779B9u * (i + 1);
+			worker->cpu = workerCpus[i];
+			m_workers.push_back(worker);
+		}
+		for (uint i = 0; i != workerNum; ++i)
+			m_workers[i]->thread = IThread([this, i]() { workerLoop(i); });
+
+		io::Logger::log(io::Logger::LOG_INFO, "JobSystem starts %u workers, %u cores %u logical processors%s%s\n",
+			workerNum, topology.getCoreNum(), topology.getCpuNum(),
+			mainCpu >= 0 ? ", main core reserved" : "",
+			workerNum && workerCpus[0] >= 0 ? ", pinned" : "");
+	}
+
+	void JobSystem::destroy()
+	{
+		if (m_workers.empty())
+			return;
+		waitAll();
+
+		m_running.store(false, std::memory_order_seq_cst);
+		{
+			std::lock_guard<std::mutex> lock(m_parkMutex);
+			m_parkCond.notify_all();
+		}
+		for (auto worker : m_workers)
+		{
+			worker->thread.join();
+			delete worker;
+		}
+		m_workers.clear();
+
+		delete m_quests;
+		m_quests = nullptr;
+		delete[] m_questBuffer;
+		m_questBuffer = nullptr;
+	}
+
+	TaskQuest* JobSystem::createQuest()
+	{
+		assert(m_quests && "JobSystem is not initialized");
+		auto quest = reinterpret_cast<TaskQuest*>(m_quests->allocUnit());
+		if (quest)
+		{
+			quest->tc = quest->cb = nullptr;
+			quest->counter = nullptr;
+			quest->flags = QUEST_NONE;
+		}
+		return quest;
+	}
+
+	void JobSystem::push(TaskQuest* quest)
+	{
+		assert(quest);
+		m_pendingNum.fetch_add(1, std::memory_order_relaxed);
+		if (quest->counter)
+			quest->counter->add();
+
+		uint workerIdx = getWorkerIndex();
+		if (workerIdx == getWorkerNum() || !m_workers[workerIdx]->deque.push(quest))
+		{
+			if (!m_injected.tryPush(quest))
+			{
+				/* back pressure, the pusher does the work itself */
+				runQuest(quest, workerIdx != getWorkerNum() ? m_workers[workerIdx] : nullptr);
+				return;
+			}
+		}
+
+		/* pairs with the fence of a worker going to park */
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (m_sleeperNum.load(std::memory_order_relaxed))
+			wakeWorker();
+	}
+
+	void JobSystem::waitAll()
+	{
+		while (m_pendingNum.load(std::memory_order_acquire))
+		{
+			if (!helpOne())
+				std::this_thread::yield();
+		}
+	}
+
+	void JobSystem::wait(const JobCounter& counter)
+	{
+		for (uint idleNum = 0; !counter.isDone(); )
+		{
+			if (helpOne())
+				idleNum = 0;
+			else if (++idleNum < spinNum)
+				cpuRelax();
+			else
+				std::this_thread::yield();
+		}
+	}
+
+	bool JobSystem::helpOne()
+	{
+		uint selfIdx = getWorkerIndex();
+		Worker* self = selfIdx != getWorkerNum() ? m_workers[selfIdx] : nullptr;
+		TaskQuest* quest = self ? self->deque.pop() : nullptr;
+		if (nullptr == quest)
+			quest = popInjected();
+		if (nullptr == quest)
+		{
+			static thread_local u32 rndState = 0x2545F491u;
+			quest = stealFrom(selfIdx, self ? self->rndState : rndState);
+		}
+		if (quest)
+		{
+			runQuest(quest, self);
+			return true;
+		}
+		if (isMainThread() && m_mainQuests.tryPop(quest))
+		{
+			quest->cb(quest->padding);
+			finishQuest(quest);
+			return true;
+		}
+		return false;
+	}
+
+	uint JobSystem::drainMainThread(s64 budgetNs)
+	{
+		assert(isMainThread());
+		s64 end = nowNs() + budgetNs;
+		uint runNum = 0;
+		TaskQuest* quest;
+		while (m_mainQuests.tryPop(quest))
+		{
+			quest->cb(quest->padding);
+			finishQuest(quest);
+			++runNum;
+			if (nowNs() >= end)
+				break;
+		}
+		return runNum;
+	}
+
+	void JobSystem::postMain(TaskQuest* quest)
+	{
+		bool pushed = m_mainQuests.tryPush(quest);
+		assert(pushed);
+		(void)pushed;
+	}
+
+	void JobSystem::finishQuest(TaskQuest* quest)
+	{
+		auto counter = quest->counter;
+		m_quests->freeUnit(quest);
+		if (counter)
+			counter->done();
+		m_pendingNum.fetch_sub(1, std::memory_order_acq_rel);
+	}
+
+	bool JobSystem::isSplitDemanded() const
+	{
+		uint selfIdx = getWorkerIndex();
+		if (selfIdx != getWorkerNum())
+			return m_workers[selfIdx]->deque.empty();
+		return m_injected.empty();
+	}
+
+	uint JobSystem::getWorkerIndex() const
+	{
+		return this == tl_jobSystem ? tl_workerIdx : getWorkerNum();
+	}
+
+	void JobSystem::getWorkerStats(uint workerIdx, WorkerStats& stats) const
+	{
+		assert(workerIdx < getWorkerNum());
+		auto worker = m_workers[workerIdx];
+		stats.runNum = worker->runNum.load(std::memory_order_relaxed);
+		stats.stealNum = worker->stealNum.load(std::memory_order_relaxed);
+		stats.parkNum = worker->parkNum.load(std::memory_order_relaxed);
+		stats.busyNs = worker->busyNs.load(std::memory_order_relaxed);
+		stats.wallNs = nowNs() - m_statsBegin;
+		stats.cpu = worker->cpu;
+	}
+
+	void JobSystem::resetStats()
+	{
+		for (auto worker : m_workers)
+		{
+			worker->runNum.store(0, std::memory_order_relaxed);
+			worker->stealNum.store(0, std::memory_order_relaxed);
+			worker->parkNum.store(0, std::memory_order_relaxed);
+			worker->busyNs.store(0, std::memory_order_relaxed);
+		}
+		m_injected.resetFullCount();
+		m_statsBegin = nowNs();
+	}
+
+	void JobSystem::dumpStats(io::Logger::LogLevel level) const
+	{
+		io::Logger::log(level, "%u workers: cpu, runs, steals, parks, utilisation, "
+			"injection queue full %llu times\n",
+			getWorkerNum(), (unsigned long long)m_injected.getFullCount());
+		for (uint i = 0; i != getWorkerNum(); ++i)
+		{
+			WorkerStats stats;
+			getWorkerStats(i, stats);
+			io::Logger::log(level, "  worker %2u %4d %10llu %10llu %8llu %6.1f%%\n", i, stats.cpu,
+				(unsigned long long)stats.runNum, (unsigned long long)stats.stealNum,
+				(unsigned long long)stats.parkNum,
+				stats.wallNs ? 100.0 * stats.busyNs / stats.wallNs : 0.0);
+		}
+	}
+
+	void JobSystem::workerLoop(uint workerIdx)
+	{
+		tl_jobSystem = this;
+		tl_workerIdx = workerIdx;
+		auto worker = m_workers[workerIdx];
+		char name[32];
+		snprintf(name, sizeof(name), "%s%u", m_threadName, workerIdx);
+		thisThread::setName(name);
+		if (worker->cpu >= 0 && !thisThread::pin(worker->cpu))
+			LOGWARNING("%s fails to pin itself to cpu %d\n", name, worker->cpu);
+
+		uint idleNum = 0;
+		while (m_running.load(std::memory_order_acquire))
+		{
+			TaskQuest* quest = worker->deque.pop();
+			if (nullptr == quest)
+				quest = popInjected();
+			if (nullptr == quest)
+			{
+				quest = stealFrom(workerIdx, worker->rndState);
+				if (quest)
+					worker->stealNum.fetch_add(1, std::memory_order_relaxed);
+			}
+			if (quest)
+			{
+				runQuest(quest, worker);
+				idleNum = 0;
+				continue;
+			}
+
+			if (++idleNum < spinNum)
+			{
+				cpuRelax();
+				continue;
+			}
+
+			/* park, check for work again after the sleeper is counted
+			   so a push() either sees the sleeper or its quest is seen here */
+			std::unique_lock<std::mutex> lock(m_parkMutex);
+			m_sleeperNum.fetch_add(1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (!hasWork() && m_running.load(std::memory_order_relaxed))
+			{
+				worker->parkNum.fetch_add(1, std::memory_order_relaxed);
+				m_parkCond.wait(lock);
+			}
+			m_sleeperNum.fetch_sub(1, std::memory_order_relaxed);
+			idleNum = 0;
+		}
+
+		m_quests->flushThreadCache();
+		tl_jobSystem = nullptr;
+	}
+
+	void JobSystem::runQuest(TaskQuest* quest, Worker* worker)
+	{
+		s64 begin = worker ? nowNs() : 0;
+		bool done = true;
+		if (quest->tc)
+		{
+			if (TOY_OK == quest->tc(quest->padding) && quest->cb)
+			{
+				if ((quest->flags & QUEST_MAIN_THREAD_CB) && !isMainThread())
+				{
+					postMain(quest);
+					done = false;
+				}
+				else
+					quest->cb(quest->padding);
+			}
+		}
+		if (done)
+			finishQuest(quest);
+		if (worker)
+		{
+			worker->busyNs.fetch_add(nowNs() - begin, std::memory_order_relaxed);
+			worker->runNum.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	TaskQuest* JobSystem::popInjected()
+	{
+		TaskQuest* quest;
+		return m_injected.tryPop(quest) ? quest : nullptr;
+	}
+
+	TaskQuest* JobSystem::stealFrom(uint thiefIdx, u32& rndState)
+	{
+		uint workerNum = getWorkerNum();
+		uint victimIdx = nextRandom(rndState) % workerNum;
+		for (uint i = 0; i != workerNum; ++i, victimIdx = (victimIdx + 1) % workerNum)
+		{
+			if (victimIdx == thiefIdx)
+				continue;
+			if (auto quest = m_workers[victimIdx]->deque.steal())
+				return quest;
+		}
+		return nullptr;
+	}
+
+	bool JobSystem::hasWork() const
+	{
+		if (!m_injected.empty())
+			return true;
+		for (auto worker : m_workers)
+		{
+			if (!worker->deque.empty())
+				return true;
+		}
+		return false;
+	}
+
+	void JobSystem::wakeWorker()
+	{
+		std::lock_guard<std::mutex> lock(m_parkMutex);
+		m_parkCond.notify_one();
+	}
+
+	TaskGraph::NodeId TaskGraph::addNode(const char* name, NodeFunc func, void* arg,
+		uint index, u32 flags)
+	{
+		if (maxNodeNum == m_nodeNum)
+		{
+			LOGWARNING("TaskGraph is full, %u nodes\n", maxNodeNum);
+			return invalidNode;
+		}
+		auto &node = m_nodes[m_nodeNum];
+		node.name = name;
+		node.func = func;
+		node.arg = arg;
+		node.index = index;
+		node.flags = flags;
+		node.depNum = 0;
+		node.succNum = 0;
+		return static_cast<NodeId>(m_nodeNum++);
+	}
+
+	void TaskGraph::addDependency(NodeId before, NodeId after)
+	{
+		if (invalidNode == before || invalidNode == after)
+			return;//addNode() failed and warned
+		assert(before < m_nodeNum && after < m_nodeNum && before != after);
+		auto &node = m_nodes[before];
+		for (u32 i = 0; i != node.succNum; ++i)
+		{
+			if (after == node.succs[i])
+				return;
+		}
+		assert(node.succNum < maxSuccessorNum && "add a join node for more successors");
+		if (maxSuccessorNum == node.succNum)
+		{
+			LOGWARNING("TaskGraph node %s has more than %u successors\n", node.name, maxSuccessorNum);
+			return;
+		}
+		node.succs[node.succNum++] = after;
+		++m_nodes[after].depNum;
+	}
+
+	void TaskGraph::run(JobSystem& jobs)
+	{
+		m_jobs = &jobs;
+		m_mainThread = jobs.getWorkerIndex();
+		m_doneNum.store(0, std::memory_order_relaxed);
+		m_runBegin = nowNs();
+		for (uint i = 0; i != m_nodeNum; ++i)
+		{
+			auto &node = m_nodes[i];
+			node.waitNum.store(node.depNum, std::memory_order_relaxed);
+			node.trace.name = node.name;
+			node.trace.thread = m_mainThread;
+			node.trace.beginNs = node.trace.endNs = 0;
+			node.trace.releasedBy = invalidNode;
+		}
+		for (uint i = 0; i != m_nodeNum; ++i)
+		{
+			if (0 == m_nodes[i].depNum)
+				submit(static_cast<NodeId>(i));
+		}
+
+		/* a cycle never finishes, it hangs here */
+		uint idleNum = 0;
+		while (m_nodeNum != m_doneNum.load(std::memory_order_acquire))
+		{
+			NodeId node;
+			if (m_mainNodes.tryPop(node))
+			{
+				execute(node);
+				idleNum = 0;
+			}
+			else if (jobs.helpOne())
+				idleNum = 0;
+			else if (++idleNum < JobSystem::spinNum)
+				cpuRelax();
+			else
+				std::this_thread::yield();
+		}
+		m_runNs = nowNs() - m_runBegin;
+		m_jobs = nullptr;
+	}
+
+	uint TaskGraph::getCriticalPath(NodeId* path, uint maxNum) const
+	{
+		if (0 == m_nodeNum)
+			return 0;
+		NodeId last = 0;
+		for (uint i = 1; i != m_nodeNum; ++i)
+		{
+			if (m_nodes[i].trace.endNs > m_nodes[last].trace.endNs)
+				last = static_cast<NodeId>(i);
+		}
+		uint num = 0;
+		for (NodeId node = last; invalidNode != node; node = m_nodes[node].trace.releasedBy)
+			++num;
+		uint i = num;
+		for (NodeId node = last; invalidNode != node; node = m_nodes[node].trace.releasedBy)
+		{
+			if (--i < maxNum)
+				path[i] = node;
+		}
+		return num;
+	}
+
+	void TaskGraph::dumpTrace(io::Logger::LogLevel level) const
+	{
+		NodeId path[maxNodeNum];
+		bool critical[maxNodeNum] = {};
+		uint pathNum = getCriticalPath(path, maxNodeNum);
+		s64 pathNs = 0;
+		for (uint i = 0; i != pathNum; ++i)
+		{
+			critical[path[i]] = true;
+			pathNs += m_nodes[path[i]].trace.endNs - m_nodes[path[i]].trace.beginNs;
+		}
+
+		NodeId order[maxNodeNum];
+		for (uint i = 0; i != m_nodeNum; ++i)
+			order[i] = static_cast<NodeId>(i);
+		std::sort(order, order + m_nodeNum, [this](NodeId a, NodeId b) {
+			return m_nodes[a].trace.beginNs < m_nodes[b].trace.beginNs;
+		});
+
+		io::Logger::log(level, "task graph %u nodes in %.3f ms, "
+			"critical path %u nodes busy %.3f ms: thread, begin us, duration us\n",
+			m_nodeNum, m_runNs / 1e6, pathNum, pathNs / 1e6);
+		for (uint i = 0; i != m_nodeNum; ++i)
+		{
+			auto &trace = m_nodes[order[i]].trace;
+			if (m_mainThread == trace.thread)
+				io::Logger::log(level, "  %c %-24s   main %10.1f %10.1f\n",
+					critical[order[i]] ? '*' : ' ', trace.name,
+					trace.beginNs / 1e3, (trace.endNs - trace.beginNs) / 1e3);
+			else
+				io::Logger::log(level, "  %c %-24s worker %3u %10.1f %10.1f\n",
+					critical[order[i]] ? '*' : ' ', trace.name, trace.thread,
+					trace.beginNs / 1e3, (trace.endNs - trace.beginNs) / 1e3);
+		}
+	}
+
+	void TaskGraph::submit(NodeId node)
+	{
+		if (m_nodes[node].flags & NODE_MAIN_THREAD)
+		{
+			/* never full, a node is queued once a run */
+			bool pushed = m_mainNodes.tryPush(node);
+			assert(pushed);
+			(void)pushed;
+			return;
+		}
+		if (!m_jobs->pushTask([this, node]() { execute(node); }))
+			execute(node);
+	}
+
+	void TaskGraph::execute(NodeId id)
+	{
+		auto &node = m_nodes[id];
+		node.trace.thread = m_jobs->getWorkerIndex();
+		node.trace.beginNs = nowNs() - m_runBegin;
+		if (node.func)
+			node.func(node.arg, node.index);
+		node.trace.endNs = nowNs() - m_runBegin;
+
+		for (u32 i = 0; i != node.succNum; ++i)
+		{
+			auto &succ = m_nodes[node.succs[i]];
+			if (1 == succ.waitNum.fetch_sub(1, std::memory_order_acq_rel))
+			{
+				succ.trace.releasedBy = id;
+				submit(node.succs[i]);
+			}
+		}
+		m_doneNum.fetch_add(1, std::memory_order_release);
+	}
+}
@@ -0,0 +1,852 @@
+#include "include/Memory.h"
+#include <cstring>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace toy
+{
+	void AllocatorStats::warnOverBudget(size_t used, size_t limit)
+	{
+		if (!overBudget.exchange(true, std::memory_order_relaxed))
+			LOGWARNING("%s uses %zu bytes, over its budget of %zu bytes\n", name, used, limit);
+	}
+
+	void AllocatorRegistry::add(AllocatorStats* stats,
+		const char* name, const char* kind, size_t capacity)
+	{
+		stats->name = name;
+		stats->kind = kind;
+		stats->capacity.store(capacity, std::memory_order_relaxed);
+		if (0 == stats->committedSize.load(std::memory_order_relaxed))
+			stats->committedSize.store(capacity, std::memory_order_relaxed);
+		m_mutex.lock();
+		stats->budget.store(findBudget(name), std::memory_order_relaxed);
+		m_allocators.push_back(stats);
+		m_mutex.unlock();
+	}
+
+	void AllocatorRegistry::remove(AllocatorStats* stats)
+	{
+		m_mutex.lock();
+		for (auto& allocator : m_allocators)
+		{
+			if (allocator == stats)
+			{
+				allocator = m_allocators.back();
+				m_allocators.pop_back();
+				break;
+			}
+		}
+		m_mutex.unlock();
+	}
+
+	/* called with m_mutex locked */
+	size_t AllocatorRegistry::findBudget(const char* name) const
+	{
+		for (auto& budget : m_budgets)
+		{
+			if (0 == strcmp(budget.name, name))
+				return budget.budget;
+		}
+		return 0;
+	}
+
+	void AllocatorRegistry::setBudget(const char* name, size_t budget)
+	{
+		m_mutex.lock();
+		bool found = false;
+		for (auto& b : m_budgets)
+		{
+			if (0 == strcmp(b.name, name))
+			{
+				b.budget = budget;
+				found = true;
+				break;
+			}
+		}
+		if (!found)
+		{
+			Budget b;
+			str::strnCpy(b.name, sizeof(b.name), name, sizeof(b.name) - 1);
+			b.name[sizeof(b.name) - 1] = '\0';
+			b.budget = budget;
+			m_budgets.push_back(b);
+		}
+		for (auto& allocator : m_allocators)
+		{
+			if (0 == strcmp(allocator->name, name))
+			{
+				allocator->budget.store(budget, std::memory_order_relaxed);
+				allocator->overBudget.store(false, std::memory_order_relaxed);
+			}
+		}
+		m_mutex.unlock();
+	}
+
+	uint AllocatorRegistry::snapshot(Record* out, uint maxNum) const
+	{
+		m_mutex.lock();
+		uint num = static_cast<uint>(m_allocators.size());
+		for (uint i = 0; i != num && i != maxNum; ++i)
+		{
+			auto stats = m_allocators[i];
+			auto& r = out[i];
+			str::strnCpy(r.name, sizeof(r.name), stats->name, sizeof(r.name) - 1);
+			r.name[sizeof(r.name) - 1] = '\0';
+			r.kind = stats->kind;
+			r.capacity = stats->capacity.load(std::memory_order_relaxed);
+			r.committedSize = stats->committedSize.load(std::memory_order_relaxed);
+			r.usedSizeL = stats->usedSize[AllocatorStats::SIDE_L].load(std::memory_order_relaxed);
+			r.usedSizeR = stats->usedSize[AllocatorStats::SIDE_R].load(std::memory_order_relaxed);
+			r.highWater = stats->highWater.load(std::memory_order_relaxed);
+			r.budget = stats->budget.load(std::memory_order_relaxed);
+			r.allocNum = stats->allocNum.load(std::memory_order_relaxed);
+			r.freeNum = stats->freeNum.load(std::memory_order_relaxed);
+			r.failedNum = stats->failedNum.load(std::memory_order_relaxed);
+			r.lockContendedNum = stats->lock ? stats->lock->getContendedCount() : 0;
+			r.lockParkNum = stats->lock ? stats->lock->getParkCount() : 0;
+		}
+		m_mutex.unlock();
+		return num;
+	}
+
+	void AllocatorRegistry::dump(io::Logger::LogLevel level) const
+	{
+		Record records[128];
+		uint num = snapshot(records, ARRAYLENGTH(records));
+		io::Logger::log(level, "%u allocators: name, kind, capacity, committed, used (L/R), "
+			"peak, budget, allocs/frees/failed, lock contended/parked\n", num);
+		if (num > ARRAYLENGTH(records))
+			num = ARRAYLENGTH(records);
+		for (uint i = 0; i != num; ++i)
+		{
+			auto& r = records[i];
+			io::Logger::log(level,
+				"  %-31s %-12s %12zu %12zu %12zu (%zu/%zu) %12zu %12zu %llu/%llu/%llu %llu/%llu\n",
+				r.name, r.kind, r.capacity, r.committedSize, r.usedSizeL + r.usedSizeR,
+				r.usedSizeL, r.usedSizeR, r.highWater, r.budget,
+				(unsigned long long)r.allocNum, (unsigned long long)r.freeNum,
+				(unsigned long long)r.failedNum, (unsigned long long)r.lockContendedNum,
+				(unsigned long long)r.lockParkNum);
+		}
+	}
+
+	AllocatorRegistry& getAllocatorRegistry()
+	{
+		/* never deleted, allocators may be destroyed during static destruction */
+		static AllocatorRegistry* registry = new AllocatorRegistry;
+		return *registry;
+	}
+
+	static const char* scratchName(char* name, size_t size)
+	{
+		snprintf(name, size, "Scratch_%u", ThreadSlot::getIndex());
+		return name;
+	}
+
+	DE_Allocator_NoLock& getScratchStack()
+	{
+		/* built by the first call of each thread, released when the thread exits */
+		char name[32];
+		static thread_local DE_Allocator_NoLock scratch(SCRATCHSTACKSIZE,
+			scratchName(name, sizeof(name)), STACK_VIRTUAL);
+		return scratch;
+	}
+
+	namespace vm
+	{
+#ifdef _WIN32
+		size_t getPageSize()
+		{
+			SYSTEM_INFO info;
+			GetSystemInfo(&info);
+			return info.dwPageSize;
+		}
+		void* reserve(size_t size)
+		{
+			return VirtualAlloc(nullptr, size, MEM_RESERVE, PAGE_NOACCESS);
+		}
+		bool commit(void* addr, size_t size)
+		{
+			return nullptr != VirtualAlloc(addr, size, MEM_COMMIT, PAGE_READWRITE);
+		}
+		void decommit(void* addr, size_t size)
+		{
+			VirtualFree(addr, size, MEM_DECOMMIT);
+		}
+		void release(void* addr, size_t size)
+		{
+			VirtualFree(addr, 0, MEM_RELEASE);
+		}
+		static bool enableLockMemoryPrivilege()
+		{
+			HANDLE token;
+			if (!OpenProcessToken(GetCurrentProcess(),
+				TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+				return false;
+			TOKEN_PRIVILEGES tp;
+			tp.PrivilegeCount = 1;
+			tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+			bool ok = LookupPrivilegeValue(nullptr, SE_LOCK_MEMORY_NAME, &tp.Privileges[0].Luid) &&
+				AdjustTokenPrivileges(token, FALSE, &tp, 0, nullptr, nullptr) &&
+				ERROR_SUCCESS == GetLastError();
+			CloseHandle(token);
+			return ok;
+		}
+		void* reserveHuge(size_t size)
+		{
+			static bool privileged = enableLockMemoryPrivilege();
+			size_t largePageSize = GetLargePageMinimum();
+			if (!privileged || 0 == largePageSize || size % largePageSize)
+				return nullptr;
+			return VirtualAlloc(nullptr, size,
+				MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+		}
+		bool adviseHuge(void* addr, size_t size)
+		{
+			return false; //no transparent huge pages on Windows
+		}
+		size_t getHugePageBytes(void* addr, size_t size)
+		{
+			return 0; //only MEM_LARGE_PAGES ranges, known by the caller
+		}
+#else
+		size_t getPageSize()
+		{
+			return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+		}
+		void* reserve(size_t size)
+		{
+			void* r = mmap(nullptr, size, PROT_NONE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			return MAP_FAILED == r ? nullptr : r;
+		}
+		bool commit(void* addr, size_t size)
+		{
+			return 0 == mprotect(addr, size, PROT_READ | PROT_WRITE);
+		}
+		void decommit(void* addr, size_t size)
+		{
+			/* drop the pages first, they read back as zero if committed again */
+			madvise(addr, size, MADV_DONTNEED);
+			mprotect(addr, size, PROT_NONE);
+		}
+		void release(void* addr, size_t size)
+		{
+			munmap(addr, size);
+		}
+		void* reserveHuge(size_t size)
+		{
+#ifdef MAP_HUGETLB
+			void* r = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			return MAP_FAILED == r ? nullptr : r;
+#else
+			return nullptr;
+#endif
+		}
+		bool adviseHuge(void* addr, size_t size)
+		{
+#ifdef MADV_HUGEPAGE
+			return 0 == madvise(addr, size, MADV_HUGEPAGE);
+#else
+			return false;
+#endif
+		}
+		size_t getHugePageBytes(void* addr, size_t size)
+		{
+			/* sum AnonHugePages of the mappings overlapping the range */
+			FILE* smaps = fopen("/proc/self/smaps", "r");
+			if (nullptr == smaps)
+				return 0;
+			size_t begin = reinterpret_cast<size_t>(addr);
+			size_t end = begin + size;
+			size_t total = 0;
+			bool inRange = false;
+			char line[256];
+			while (fgets(line, sizeof(line), smaps))
+			{
+				unsigned long long mapBegin, mapEnd, kb;
+				if (2 == sscanf(line, "%llx-%llx ", &mapBegin, &mapEnd))
+					inRange = mapBegin < end && mapEnd > begin;
+				else if (inRange && 1 == sscanf(line, "AnonHugePages: %llu kB", &kb))
+					total += static_cast<size_t>(kb) * 1024;
+			}
+			fclose(smaps);
+			return total;
+		}
+#endif
+	}
+
+	static inline u8* roundUp(u8* addr, size_t granularity)
+	{
+		return reinterpret_cast<u8*>(
+			(reinterpret_cast<size_t>(addr) + granularity - 1) & ~(granularity - 1));
+	}
+	static inline u8* roundDown(u8* addr, size_t granularity)
+	{
+		return reinterpret_cast<u8*>(reinterpret_cast<size_t>(addr) & ~(granularity - 1));
+	}
+
+	void* VirtualRange::reserve(size_t size, AllocatorStats* stats, bool hugePages)
+	{
+		assert(nullptr == m_base);
+		assert(0 == commitGranularity % vm::getPageSize());
+		m_stats = stats;
+		m_granularity = hugePages ? hugePageSize : commitGranularity;
+		m_reservedSize = (size + m_granularity - 1) & ~(m_granularity - 1);
+
+		if (hugePages && m_reservedSize <= maxPinnedSize)
+		{
+			m_mapBase = vm::reserveHuge(m_reservedSize);
+			if (m_mapBase)
+			{
+				m_mapSize = m_reservedSize;
+				m_base = reinterpret_cast<u8*>(m_mapBase);
+				m_pinned = true;
+				setCommitted(m_base, m_reservedSize);
+				onCommitChanged();
+				return m_base;
+			}
+		}
+
+		/* the OS only aligns to pages, commits are granularity aligned
+		   (2MB for transparent huge pages), reserve one more to align */
+		m_mapSize = m_reservedSize + m_granularity;
+		m_mapBase = vm::reserve(m_mapSize);
+		if (nullptr == m_mapBase)
+		{
+			m_reservedSize = m_mapSize = 0;
+			return nullptr;
+		}
+		m_base = roundUp(reinterpret_cast<u8*>(m_mapBase), m_granularity);
+		if (hugePages && !vm::adviseHuge(m_base, m_reservedSize))
+			io::Logger::log(io::Logger::LOG_INFO,
+				"Transparent huge pages not supported, %zu bytes on normal pages\n", m_reservedSize);
+		m_holeBegin = m_base;
+		m_holeEnd = m_base + m_reservedSize;
+		onCommitChanged();
+		return m_base;
+	}
+
+	void VirtualRange::release()
+	{
+		if (m_mapBase)
+			vm::release(m_mapBase, m_mapSize);
+		m_mapBase = nullptr;
+		m_base = m_holeBegin = m_holeEnd = nullptr;
+		m_mapSize = m_reservedSize = 0;
+		m_pinned = false;
+	}
+
+	bool VirtualRange::commitL(void* newTopL)
+	{
+		assert(isReserved() && needCommitL(newTopL));
+		u8* end = roundUp(reinterpret_cast<u8*>(newTopL), m_granularity);
+		if (end > m_holeEnd)
+			end = m_holeEnd;
+		if (!vm::commit(m_holeBegin, end - m_holeBegin))
+			return false;
+		m_holeBegin = end;
+		onCommitChanged();
+		return true;
+	}
+
+	bool VirtualRange::commitR(void* newTopR)
+	{
+		assert(isReserved() && needCommitR(newTopR));
+		u8* begin = roundDown(reinterpret_cast<u8*>(newTopR), m_granularity);
+		if (begin < m_holeBegin)
+			begin = m_holeBegin;
+		if (!vm::commit(begin, m_holeEnd - begin))
+			return false;
+		m_holeEnd = begin;
+		onCommitChanged();
+		return true;
+	}
+
+	void VirtualRange::trimL(void* topL, void* topR, size_t slack)
+	{
+		u8* top = reinterpret_cast<u8*>(topL);
+		if (m_pinned || m_holeBegin <= top || (size_t)(m_holeBegin - top) <= slack * 2)
+			return;
+		u8* begin = roundUp(top + slack, m_granularity);
+		/* when the hole is closed, right end data may sit below m_holeBegin */
+		u8* end = roundDown(reinterpret_cast<u8*>(topR), m_granularity);
+		if (end > m_holeBegin)
+			end = m_holeBegin;
+		if (begin >= end)
+			return;
+		vm::decommit(begin, end - begin);
+		if (end != m_holeBegin)
+			m_holeEnd = end;
+		m_holeBegin = begin;
+		onCommitChanged();
+	}
+
+	void VirtualRange::trimR(void* topL, void* topR, size_t slack)
+	{
+		u8* top = reinterpret_cast<u8*>(topR);
+		if (m_pinned || m_holeEnd >= top || (size_t)(top - m_holeEnd) <= slack * 2)
+			return;
+		u8* end = roundDown(top - slack, m_granularity);
+		/* when the hole is closed, left end data may sit above m_holeEnd */
+		u8* begin = roundUp(reinterpret_cast<u8*>(topL), m_granularity);
+		if (begin < m_holeEnd)
+			begin = m_holeEnd;
+		if (begin >= end)
+			return;
+		vm::decommit(begin, end - begin);
+		if (begin != m_holeEnd)
+			m_holeBegin = begin;
+		m_holeEnd = end;
+		onCommitChanged();
+	}
+
+	size_t VirtualRange::getCommittedSize() const
+	{
+		if (m_holeBegin >= m_holeEnd)
+			return m_reservedSize;
+		return m_reservedSize - (m_holeEnd - m_holeBegin);
+	}
+
+	size_t VirtualRange::getHugePageBytes() const
+	{
+		if (m_pinned)
+			return m_reservedSize;
+		return m_granularity == hugePageSize ? vm::getHugePageBytes(m_base, m_reservedSize) : 0;
+	}
+
+	void VirtualRange::onCommitChanged()
+	{
+		if (m_stats)
+			m_stats->committedSize.store(getCommittedSize(), std::memory_order_relaxed);
+	}
+
+	HandleHeap::HandleHeap(size_t capacity, const char* name, StackBacking backing) :
+		m_capacity((capacity + blockAlign - 1) & ~(blockAlign - 1))
+	{
+		str::strnCpy(m_name, sizeof(m_name),
+			name ? name : "HandleHeap", sizeof(m_name) - 1);
+		m_name[sizeof(m_name) - 1] = '\0';
+		getAllocatorRegistry().add(&m_stats, m_name, "HandleHeap", m_capacity);
+
+		m_base = STACK_HEAP != backing ? reinterpret_cast<u8*>(
+			m_vm.reserve(m_capacity, &m_stats, STACK_HUGEPAGE == backing)) : nullptr;
+		if (nullptr == m_base)
+		{
+			if (STACK_HEAP != backing)
+				LOGWARNING("%s can't reserve address space, fall back to heap\n", m_name);
+			m_buffer = new u8[m_capacity + blockAlign];
+			m_base = reinterpret_cast<u8*>(
+				(reinterpret_cast<size_t>(m_buffer) + blockAlign - 1) & ~(blockAlign - 1));
+			m_vm.setCommitted(m_base, m_capacity);
+		}
+		m_top = m_base;
+		m_entries.push_back(Entry{ nullptr, nullptr, nullptr, invalidHandle });
+	}
+
+	HandleHeap::~HandleHeap()
+	{
+		io::Logger::log(io::Logger::LOG_INFO,
+			"%s destruct, %zu bytes in use, %zu bytes in holes\n",
+			m_name, m_usedSize, getHoleSize());
+		if (m_vm.isReserved())
+			m_vm.release();
+		else
+			delete[] m_buffer;
+		getAllocatorRegistry().remove(&m_stats);
+	}
+
+	HandleHeap::Handle HandleHeap::alloc(size_t size, RelocateFunc relocate, void* user)
+	{
+		size_t blockSize = (size + sizeof(BlockHeader) + blockAlign - 1) & ~(blockAlign - 1);
+		/* a pass in progress may have moved every live block already,
+		   it still has to finish to give back [m_dst, m_scan) */
+		if (blockSize > (size_t)(m_base + m_capacity - m_top) && getFreedSize())
+			compactAll();
+		if (blockSize > (size_t)(m_base + m_capacity - m_top))
+		{
+			m_stats.onFailed();
+			return invalidHandle;
+		}
+		u8* newTop = m_top + blockSize;
+		if (m_vm.isReserved() && m_vm.needCommitL(newTop) && !m_vm.commitL(newTop))
+		{
+			m_stats.onFailed();
+			return invalidHandle;
+		}
+
+		Handle handle = m_freeEntry;
+		if (invalidHandle != handle)
+			m_freeEntry = m_entries[handle].nextFree;
+		else
+		{
+			handle = static_cast<Handle>(m_entries.size());
+			m_entries.push_back(Entry());
+		}
+		auto header = reinterpret_cast<BlockHeader*>(m_top);
+		header->handle = handle;
+		header->size = blockSize;
+		m_entries[handle] = Entry{ m_top, relocate, user, invalidHandle };
+
+		m_top = newTop;
+		m_usedSize += blockSize;
+		m_stats.onAlloc(blockSize, AllocatorStats::SIDE_L);
+		return handle;
+	}
+
+	void HandleHeap::free(Handle handle)
+	{
+		if (invalidHandle == handle)
+			return;
+		assert(handle < m_entries.size() && m_entries[handle].block);
+		u8* block = m_entries[handle].block;
+		auto header = reinterpret_cast<BlockHeader*>(block);
+		size_t blockSize = header->size;
+		header->handle = invalidHandle;
+		m_entries[handle].block = nullptr;
+		m_entries[handle].nextFree = m_freeEntry;
+		m_freeEntry = handle;
+		m_usedSize -= blockSize;
+		m_stats.onFree(blockSize, AllocatorStats::SIDE_L);
+
+		if (nullptr == m_scan && block + blockSize == m_top)
+		{
+			m_top = block; //the last block, no hole
+			if (m_firstHole && m_firstHole >= m_top)
+				m_firstHole = nullptr;
+		}
+		/* blocks above m_dst are skipped by the pass in progress */
+		else if ((nullptr == m_scan || block < m_dst) &&
+			(nullptr == m_firstHole || block < m_firstHole))
+			m_firstHole = block;
+	}
+
+	bool HandleHeap::compact(size_t maxBytes)
+	{
+		if (nullptr == m_scan)
+		{
+			if (nullptr == m_firstHole)
+				return true;
+			m_scan = m_dst = m_firstHole;
+			m_firstHole = nullptr;
+		}
+
+		size_t movedSize = 0;
+		while (m_scan != m_top)
+		{
+			auto header = reinterpret_cast<BlockHeader*>(m_scan);
+			size_t blockSize = header->size;
+			if (invalidHandle == header->handle)
+			{
+				m_scan += blockSize;
+				continue;
+			}
+			if (movedSize >= maxBytes)
+				return false;
+
+			u8* src = m_scan;
+			m_scan += blockSize;
+			memmove(m_dst, src, blockSize);
+			auto& entry = m_entries[reinterpret_cast<BlockHeader*>(m_dst)->handle];
+			entry.block = m_dst;
+			if (entry.relocate)
+				entry.relocate(entry.user, src + sizeof(BlockHeader), m_dst + sizeof(BlockHeader));
+			m_dst += blockSize;
+			movedSize += blockSize;
+		}
+
+		/* the pass is done, blocks freed below m_dst meanwhile start the next one */
+		m_top = m_dst;
+		m_scan = m_dst = nullptr;
+		if (m_vm.isReserved())
+			m_vm.trimL(m_top, m_base + m_capacity);
+		return nullptr == m_firstHole;
+	}
+
+	void HandleHeap::clear()
+	{
+		m_top = m_base;
+		m_scan = m_dst = m_firstHole = nullptr;
+		m_usedSize = 0;
+		m_entries.resize(1);
+		m_freeEntry = invalidHandle;
+		m_stats.setUsedSize(0, AllocatorStats::SIDE_L);
+		if (m_vm.isReserved())
+			m_vm.trimL(m_top, m_base + m_capacity);
+	}
+
+	void HandleHeap::trim()
+	{
+		if (m_vm.isReserved())
+			m_vm.trimL(m_top, m_base + m_capacity, 0);
+	}
+
+	ChunkedPoolAllocator::ChunkedPoolAllocator(
+		size_t unitSize, size_t unitAlign,
+		const PoolGrowPolicy& policy,
+		const char* name) :
+		m_unitStride(((unitSize > sizeof(FreeUnit) ? unitSize : sizeof(FreeUnit))
+			+ unitAlign - 1) & ~(unitAlign - 1)),
+		m_unitAlign(unitAlign),
+		m_policy(policy)
+	{
+		assert(unitAlign && 0 == (unitAlign & (unitAlign - 1)));
+		assert(policy.chunkUnitNum);
+
+		str::strnCpy(m_name, sizeof(m_name),
+			name ? name : "ChunkedPoolAllocator", sizeof(m_name) - 1);
+		m_name[sizeof(m_name) - 1] = '\0';
+		m_stats.lock = &m_mutex;
+		getAllocatorRegistry().add(&m_stats, m_name, "ChunkedPool", 0);
+	}
+
+	ChunkedPoolAllocator::~ChunkedPoolAllocator()
+	{
+		io::Logger::log(io::Logger::LOG_INFO,
+			"%s destruct %li units in %li chunks, %li in use\n",
+			m_name, m_capacity, m_chunkNum, m_usedNum);
+		clear(true);
+		getAllocatorRegistry().remove(&m_stats);
+	}
+
+	void* ChunkedPoolAllocator::allocUnit()
+	{
+		m_mutex.lock();
+		void* r = m_freeList;
+		if (r)
+			m_freeList = m_freeList->next;
+		else
+		{
+			while (m_curChunk && m_curChunk->touchedNum == m_curChunk->unitNum)
+				m_curChunk = m_curChunk->next;
+			if (m_curChunk || grow())
+				r = m_curChunk->units + m_unitStride * m_curChunk->touchedNum++;
+		}
+		if (r)
+			++m_usedNum;
+		m_mutex.unlock();
+
+		if (r)
+			m_stats.onAlloc(m_unitStride);
+		else
+		{
+			m_stats.onFailed();
+			if (m_policy.throwOnExhausted)
+				throw std::bad_alloc();
+		}
+		return r;
+	}
+
+	void ChunkedPoolAllocator::freeUnit(void* unitPtr)
+	{
+		m_mutex.lock();
+		assert(owns(unitPtr));
+		auto unit = reinterpret_cast<FreeUnit*>(unitPtr);
+		unit->next = m_freeList;
+		m_freeList = unit;
+		--m_usedNum;
+		m_mutex.unlock();
+		m_stats.onFree(m_unitStride);
+	}
+
+	void ChunkedPoolAllocator::clear(bool releaseChunks)
+	{
+		m_mutex.lock();
+		m_freeList = nullptr;
+		m_usedNum = 0;
+		for (auto chunk = m_fstChunk; chunk;)
+		{
+			auto next = chunk->next;
+			chunk->touchedNum = 0;
+			if (releaseChunks)
+				delete[] reinterpret_cast<u8*>(chunk);
+			chunk = next;
+		}
+		if (releaseChunks)
+		{
+			m_fstChunk = m_lastChunk = nullptr;
+			m_capacity = 0;
+			m_chunkNum = 0;
+		}
+		m_curChunk = m_fstChunk;
+		m_mutex.unlock();
+		m_stats.setUsedSize(0);
+		if (releaseChunks)
+			m_stats.capacity.store(0, std::memory_order_relaxed);
+	}
+
+	size_t ChunkedPoolAllocator::getCapacity() const
+	{
+		m_mutex.lock();
+		auto ret = m_capacity;
+		m_mutex.unlock();
+		return ret;
+	}
+
+	size_t ChunkedPoolAllocator::getUsedNum() const
+	{
+		m_mutex.lock();
+		auto ret = m_usedNum;
+		m_mutex.unlock();
+		return ret;
+	}
+
+	size_t ChunkedPoolAllocator::getChunkNum() const
+	{
+		m_mutex.lock();
+		auto ret = m_chunkNum;
+		m_mutex.unlock();
+		return ret;
+	}
+
+	ChunkedPoolAllocator::Chunk* ChunkedPoolAllocator::newChunk(size_t unitNum)
+	{
+		/* chunk header, then units aligned to m_unitAlign */
+		size_t size = sizeof(Chunk) + m_unitAlign + m_unitStride * unitNum;
+		u8* raw = new (std::nothrow) u8[size];
+		if (nullptr == raw)
+			return nullptr;
+
+		auto chunk = reinterpret_cast<Chunk*>(raw);
+		size_t unitsAddr = reinterpret_cast<size_t>(raw + sizeof(Chunk));
+		unitsAddr = (unitsAddr + m_unitAlign - 1) & ~(m_unitAlign - 1);
+		chunk->next = nullptr;
+		chunk->units = reinterpret_cast<u8*>(unitsAddr);
+		chunk->unitNum = unitNum;
+		chunk->touchedNum = 0;
+		return chunk;
+	}
+
+	/* called with m_mutex locked */
+	bool ChunkedPoolAllocator::grow()
+	{
+		size_t unitNum = m_policy.chunkUnitNum;
+		if (m_fstChunk)
+		{
+			switch (m_policy.mode)
+			{
+			case PoolGrowPolicy::GROW_NONE: return false;
+			case PoolGrowPolicy::GROW_LINEAR: break;
+			case PoolGrowPolicy::GROW_DOUBLE: unitNum = m_capacity; break;
+			}
+		}
+		if (m_policy.maxUnitNum)
+		{
+			if (m_capacity >= m_policy.maxUnitNum)
+				return false;
+			if (unitNum > m_policy.maxUnitNum - m_capacity)
+				unitNum = m_policy.maxUnitNum - m_capacity;
+		}
+
+		auto chunk = newChunk(unitNum);
+		if (nullptr == chunk)
+			return false;
+		if (m_lastChunk)
+			m_lastChunk->next = chunk;
+		else
+			m_fstChunk = chunk;
+		m_lastChunk = m_curChunk = chunk;
+		m_capacity += unitNum;
+		++m_chunkNum;
+		m_stats.capacity.store(m_unitStride * m_capacity, std::memory_order_relaxed);
+
+		io::Logger::log(io::Logger::LOG_INFO,
+			"%s grows to %li units in %li chunks\n", m_name, m_capacity, m_chunkNum);
+		return true;
+	}
+
+	/* called with m_mutex locked */
+	bool ChunkedPoolAllocator::owns(void* unitPtr) const
+	{
+		size_t addr = reinterpret_cast<size_t>(unitPtr);
+		for (auto chunk = m_fstChunk; chunk; chunk = chunk->next)
+		{
+			size_t begin = reinterpret_cast<size_t>(chunk->units);
+			if (addr >= begin && addr < begin + m_unitStride * chunk->touchedNum)
+				return 0 == (addr - begin) % m_unitStride;
+		}
+		return false;
+	}
+
+	const size_t SmallObjectAllocator::sm_classSizes[classNum] =
+	{
+		16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024,
+	};
+
+	/* indexed by (size + 15) / 16 */
+	const u8 SmallObjectAllocator::sm_classOfSize[maxSmallSize / 16 + 1] =
+	{
+		0, 0, 1, 2, 3, 4, 4, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7,
+		8, 8, 8, 8, 8, 8, 8, 8, 9, 9, 9, 9, 9, 9, 9, 9,
+		10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10, 10,
+		11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11, 11,
+	};
+
+	SmallObjectAllocator::SmallObjectAllocator(const char* name)
+	{
+		if (nullptr == name)
+			name = "SmallObjectAllocator";
+		for (uint i = 0; i != classNum; ++i)
+		{
+			PoolGrowPolicy policy;
+			policy.mode = PoolGrowPolicy::GROW_LINEAR;
+			policy.chunkUnitNum = slabSize / sm_classSizes[i];
+
+			char poolName[32];
+			snprintf(poolName, sizeof(poolName), "%.20s_%d", name, (int)sm_classSizes[i]);
+			m_pools[i] = new ChunkedPoolAllocator(sm_classSizes[i], 16, policy, poolName);
+		}
+		snprintf(m_bigName, sizeof(m_bigName), "%.20s_big", name);
+		getAllocatorRegistry().add(&m_bigStats, m_bigName, "Heap", 0);
+	}
+
+	SmallObjectAllocator::~SmallObjectAllocator()
+	{
+		getAllocatorRegistry().remove(&m_bigStats);
+		for (auto& pool : m_pools)
+		{
+			delete pool;
+			pool = nullptr;
+		}
+	}
+
+	void* SmallObjectAllocator::alloc(size_t size)
+	{
+		uint classIdx = getSizeClass(size);
+		if (classNum == classIdx)
+		{
+			void* r = ::operator new(size, std::nothrow);
+			if (r)
+				m_bigStats.onAlloc(size);
+			else
+				m_bigStats.onFailed();
+			return r;
+		}
+		return m_pools[classIdx]->allocUnit();
+	}
+
+	void SmallObjectAllocator::free(void* ptr, size_t size)
+	{
+		if (nullptr == ptr)
+			return;
+		uint classIdx = getSizeClass(size);
+		if (classNum == classIdx)
+		{
+			::operator delete(ptr);
+			m_bigStats.onFree(size);
+		}
+		else
+			m_pools[classIdx]->freeUnit(ptr);
+	}
+
+	SmallObjectAllocator& getSmallObjectAllocator()
+	{
+		/* never deleted, blocks may be freed during static destruction */
+		static SmallObjectAllocator* allocator = new SmallObjectAllocator;
+		return *allocator;
+	}
+}
\ No newline at end of file
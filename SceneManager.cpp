@@ -1,6 +1,7 @@
 #include "include/SceneManager.h"
 #include "include/Mathlib.h"
 #include "GLSLShaderConfig.hpp"
+#include <algorithm>
 
 namespace toy
 {
@@ -51,12 +52,179 @@ namespace toy
 		m_up = q.rotate(m_up);
 	}
 
+	/* give the buffers back before the arena is cleared or destroyed */
+	template<typename Vec>
+	static inline void releaseVector(Vec& vec)
+	{
+		Vec(vec.get_allocator()).swap(vec);
+	}
+
+	SceneInstanceTable::SceneInstanceTable(DE_Allocator_NoLock* allocator) :
+		m_mmats(tStlAllocator<fmat4, DE_Allocator_NoLock>(allocator)),
+		m_flags(tStlAllocator<SceneObjectProperty, DE_Allocator_NoLock>(allocator)),
+		m_prefabs(tStlAllocator<ScenePrefab*, DE_Allocator_NoLock>(allocator)),
+		m_bones(tStlAllocator<fmat4*, DE_Allocator_NoLock>(allocator)),
+		m_boneNums(tStlAllocator<u32, DE_Allocator_NoLock>(allocator)),
+		m_rowSlots(tStlAllocator<u32, DE_Allocator_NoLock>(allocator)),
+		m_slotRows(tStlAllocator<u32, DE_Allocator_NoLock>(allocator)),
+		m_slotGens(tStlAllocator<u16, DE_Allocator_NoLock>(allocator)),
+		m_freeSlots(tStlAllocator<u32, DE_Allocator_NoLock>(allocator))
+	{
+	}
+
+	SceneInstanceTable::Handle SceneInstanceTable::add(ScenePrefab* prefab, SceneObjectProperty flag,
+		uint num, const fmat4* mmats, fmat4* const* bones, u32 boneNum, Handle* handles)
+	{
+		uint reused = num < m_freeSlots.size() ? num : static_cast<uint>(m_freeSlots.size());
+		if (0 == num || m_slotRows.size() + num - reused > maxSlotNum)
+			return invalidHandle;
+		uint firstRow = getNum();
+		/* every column grows once for the whole batch */
+		if (mmats)
+			m_mmats.insert(m_mmats.end(), mmats, mmats + num);
+		else
+			m_mmats.insert(m_mmats.end(), num, fmat4(1.0f));
+		m_flags.insert(m_flags.end(), num, flag);
+		m_prefabs.insert(m_prefabs.end(), num, prefab);
+		m_boneNums.insert(m_boneNums.end(), num, boneNum);
+		if (bones)
+			m_bones.insert(m_bones.end(), bones, bones + num);
+		else
+			m_bones.insert(m_bones.end(), num, nullptr);
+
+		/* freed slots first, then new ones */
+		m_rowSlots.resize(firstRow + num);
+		u32 newSlot = static_cast<u32>(m_slotRows.size());
+		m_slotRows.resize(m_slotRows.size() + num - reused);
+		m_slotGens.resize(m_slotRows.size(), 0);
+		for (uint i = 0; i != num; ++i)
+		{
+			u32 slot;
+			if (i < reused)
+			{
+				slot = m_freeSlots.back();
+				m_freeSlots.pop_back();
+			}
+			else
+				slot = newSlot++;
+			m_slotRows[slot] = firstRow + i;
+			m_rowSlots[firstRow + i] = slot;
+			if (handles)
+				handles[i] = makeHandle(slot);
+		}
+		return makeHandle(m_rowSlots[firstRow]);
+	}
+
+	void SceneInstanceTable::moveRow(uint dst, uint src)
+	{
+		m_mmats[dst] = m_mmats[src];
+		m_flags[dst] = m_flags[src];
+		m_prefabs[dst] = m_prefabs[src];
+		m_bones[dst] = m_bones[src];
+		m_boneNums[dst] = m_boneNums[src];
+		m_rowSlots[dst] = m_rowSlots[src];
+		m_slotRows[m_rowSlots[dst]] = dst;
+	}
+
+	/* free the slot of row and fill the row with the last one */
+	void SceneInstanceTable::popRow(uint row)
+	{
+		u32 slot = m_rowSlots[row];
+		m_slotRows[slot] = invalidRow;
+		m_slotGens[slot] = (m_slotGens[slot] + 1) & genMask;
+		m_freeSlots.push_back(slot);
+
+		uint last = getNum() - 1;
+		if (row != last)
+			moveRow(row, last);
+		m_mmats.pop_back();
+		m_flags.pop_back();
+		m_prefabs.pop_back();
+		m_bones.pop_back();
+		m_boneNums.pop_back();
+		m_rowSlots.pop_back();
+	}
+
+	bool SceneInstanceTable::remove(Handle ins)
+	{
+		if (!isValid(ins))
+			return false;
+		popRow(m_slotRows[ins & maxSlotNum]);
+		return true;
+	}
+
+	void SceneInstanceTable::removePrefab(const ScenePrefab* prefab)
+	{
+		/* backwards, the row moved into a hole has been checked already */
+		for (uint row = getNum(); row-- != 0;)
+		{
+			if (m_prefabs[row] == prefab)
+				popRow(row);
+		}
+	}
+
+	void SceneInstanceTable::reserve(uint num)
+	{
+		m_mmats.reserve(num);
+		m_flags.reserve(num);
+		m_prefabs.reserve(num);
+		m_bones.reserve(num);
+		m_boneNums.reserve(num);
+		m_rowSlots.reserve(num);
+		m_slotRows.reserve(num);
+		m_slotGens.reserve(num);
+	}
+
+	void SceneInstanceTable::release()
+	{
+		releaseVector(m_mmats);
+		releaseVector(m_flags);
+		releaseVector(m_prefabs);
+		releaseVector(m_bones);
+		releaseVector(m_boneNums);
+		releaseVector(m_rowSlots);
+		releaseVector(m_slotRows);
+		releaseVector(m_slotGens);
+		releaseVector(m_freeSlots);
+	}
+
 	Scene::Scene(const char* name,
 		DE_Allocator_NoLock* allocator,
+		size_t heapSize,
 		IRenderDriver* rdr,
 		AssetImporter* imp)
-		: m_allocator(allocator), m_rdr(rdr), m_name(name), m_imp(imp)
+		: m_pPrefs(ArenaAllocator(allocator)),
+		m_insts(allocator),
+		m_texs(ArenaAllocator(allocator)),
+		m_allocator(allocator),
+		m_heap(heapSize, "SceneHeap"),
+		m_prefabPool(PoolGrowPolicy(), "ScenePrefabPool"),
+		m_rdr(rdr), m_name(name), m_imp(imp)
+	{
+	}
+
+	Scene::~Scene()
 	{
+		releaseContainers();
+		//the allocator was constructed in place by the scene manager
+		m_allocator->~DE_Allocator_NoLock();
+	}
+
+	void Scene::releaseContainers()
+	{
+		releaseVector(m_pPrefs);
+		m_insts.release();
+		releaseVector(m_texs);
+	}
+
+	void Scene::reportMemory()
+	{
+		size_t used = m_allocator->getUsedSize();
+		size_t huge = m_allocator->getHugePageBytes();
+		LOGINFO("Scene %s uses %zu bytes, %zu bytes (%zu pages of 2MB) on huge pages\n",
+			m_name, used, huge, huge / VirtualRange::hugePageSize);
+		LOGINFO("Scene %s heap uses %zu bytes, %zu bytes in holes\n",
+			m_name, m_heap.getUsedSize(), m_heap.getHoleSize());
 	}
 
 	void Scene::freeScene()
@@ -70,26 +238,98 @@ namespace toy
 		{
 			m_rdr->freeTextures(&tex->tbo, 1);
 		}
+		releaseContainers();
+		m_heap.clear();
+		m_prefabPool.clear();
 		m_allocator->clear();
 	}
 
-	ScenePrefabInstance* Scene::newPrefabInstances(
-		ScenePrefab* prefab, uint instNum, SceneObjectProperty flag)
+	void Scene::freePrefab(ScenePrefab* prefab)
+	{
+		auto pref = std::find(m_pPrefs.begin(), m_pPrefs.end(), prefab);
+		if (m_pPrefs.end() == pref)
+			return;
+
+		m_insts.removePrefab(prefab);
+		m_drawData = nullptr;//rows of instances changed
+
+		for (uint i = 0; i != prefab->meshNum; ++i)
+			m_rdr->freeRenderMesh(prefab->rMeshes[i]);
+		m_heap.free(prefab->data);
+		m_prefabPool.deleteUnit(prefab);
+		m_pPrefs.erase(pref);
+	}
+
+	Scene::InstanceHandle Scene::newPrefabInstances(ScenePrefab* prefab, uint instNum,
+		SceneObjectProperty flag, const fmat4* mmats, InstanceHandle* handles)
 	{
-		auto ins = m_allocator->allocAlignedL<ScenePrefabInstance>(1);
-		ins->prefab = prefab;
-		ins->flag = flag;
-		ins->mmat = fmat4(1.0f);
-		if (flag.getProperty(SceneObjectProperty::SOF_ANIMATED))
+		assert(prefab);
+		if (0 == instNum)
+			return SceneInstanceTable::invalidHandle;
+		/* bone matrices only for prefabs that have animations to sample */
+		ScratchScope scratch;
+		fmat4** bones = nullptr;
+		u32 boneNum = 0;
+		if (flag.getProperty(SceneObjectProperty::SOF_ANIMATED) && prefab->skel && prefab->animNum)
 		{
-			ins->amats = m_allocator->allocAlignedL<fmat4>(prefab->skel->boneNum);
+			boneNum = prefab->skel->boneNum;
+			bones = scratch->allocL<fmat4*>(instNum);
+			uint i = 0;
+			for (; i != instNum && prefab->freeBones; ++i)
+			{
+				bones[i] = prefab->freeBones;
+				prefab->freeBones = *reinterpret_cast<fmat4**>(bones[i]);
+			}
+			fmat4* block = nullptr;
+			uint blockNum = boneNum * (instNum - i);
+			/* allocL() of the scene stack throws when it is full */
+			if (i != instNum && m_allocator->getAvailSize() >= sizeof(fmat4) * blockNum + alignof(fmat4))
+				block = m_allocator->allocAlignedL<fmat4>(blockNum);
+			if (i != instNum && nullptr == block)
+			{
+				LOGWARNING("Scene %s can't allocate bone matrices of %u instances\n", m_name, instNum - i);
+				/* give back the reused ones in their order */
+				while (i != 0)
+				{
+					--i;
+					*reinterpret_cast<fmat4**>(bones[i]) = prefab->freeBones;
+					prefab->freeBones = bones[i];
+				}
+				return SceneInstanceTable::invalidHandle;
+			}
+			for (uint j = 0; i != instNum; ++i, ++j)
+				bones[i] = block + j * boneNum;
 		}
-		else
+		auto first = m_insts.add(prefab, flag, instNum, mmats, bones, boneNum, handles);
+		if (SceneInstanceTable::invalidHandle == first)
+		{
+			LOGWARNING("Scene %s can't have %u more instances\n", m_name, instNum);
+			for (uint i = 0; bones && i != instNum; ++i)
+			{
+				*reinterpret_cast<fmat4**>(bones[i]) = prefab->freeBones;
+				prefab->freeBones = bones[i];
+			}
+			return first;
+		}
+		m_drawData = nullptr;//rows of instances changed
+		return first;
+	}
+
+	bool Scene::removeInstance(InstanceHandle ins)
+	{
+		if (!m_insts.isValid(ins))
+			return false;
+		uint row = m_insts.getRow(ins);
+		auto pref = m_insts.getPrefabs()[row];
+		auto bones = m_insts.getBoneMatrices()[row];
+		if (bones)
 		{
-			ins->amats = nullptr;
+			*reinterpret_cast<fmat4**>(bones) = pref->freeBones;
+			pref->freeBones = bones;
 		}
-		m_objs.push_back(ins);
-		return ins;
+		m_insts.remove(ins);
+		m_drawData = nullptr;//rows of instances changed
+		return true;
 	}
 
 	Scene::SceneTex* Scene::loadTexture(const char* path, u64 hash, uint slen)
@@ -133,20 +373,45 @@ namespace toy
 	{
 		auto stexs = m_allocator->allocL<SceneTex>(texNum);
 		assert(stexs);
+		struct TexFile
+		{
+			u8* data;
+			size_t size;
+		};
+		auto files = m_allocator->allocR<TexFile>(texNum);
+		assert(files);
+
+		/* files are read in parallel, images are decoded and uploaded
+		   on the calling thread, DevIL and GL are not thread-safe */
+		auto readFiles = [&](uint first, uint last) {
+			for (uint i = first; i != last; ++i)
+			{
+				io::WPath wp(filepath[i]);
+				files[i].data = io::readFile(wp, &files[i].size);
+			}
+		};
+		if (auto jobs = m_imp->getJobSystem())
+			jobs->parallelFor(0, texNum, 1, readFiles);
+		else
+			readFiles(0, texNum);
 
 		for (uint i = 0; i != texNum; ++i)
 		{
-			size_t fsize;
-			io::WPath wp(filepath[i]);
-			auto suffix = io::Path::getSuffix(filepath[i]);
-			auto fdata = io::readFile(wp, &fsize);
-			if (nullptr == fdata)
+			if (nullptr == files[i].data)
 			{
+				for (uint j = 0; j != texNum; ++j)
+					io::freeFile(files[j].data);
+				m_allocator->freeR(files);
 				m_allocator->freeL(stexs);
 				return nullptr;
 			}
-			stexs[i].tbo = m_imp->loadImage2D(fdata, fsize, suffix);
-			io::freeFile(fdata);
+		}
+
+		for (uint i = 0; i != texNum; ++i)
+		{
+			auto suffix = io::Path::getSuffix(filepath[i]);
+			stexs[i].tbo = m_imp->loadImage2D(files[i].data, files[i].size, suffix);
+			io::freeFile(files[i].data);
 			stexs[i].hash = str::BKDRHash(filepath[i]);
 
 			const char* path = filepath[i];
@@ -155,6 +420,7 @@ namespace toy
 				;
 			assert(name - stexs[i].name <= sizeof(stexs[i].name));
 		}
+		m_allocator->freeR(files);
 
 		for (uint i = 0; i != texNum; ++i)
 			m_texs.push_back(&stexs[i]);
@@ -162,51 +428,136 @@ namespace toy
 		return stexs;
 	}
 
-	void Scene::loadModelMaterials(ScenePrefab* prefab, const char* modelPath)
+	bool Scene::readModelMaterials(uint meshNum, ModelMaterials& out, DE_Allocator_NoLock* mem)
 	{
-		size_t bufSize = 1024 * 1024;//1M
-		auto buffer = m_allocator->allocR(bufSize);
-		if (nullptr == buffer)
-			return;
-		DE_Allocator_NoLock mem(buffer, bufSize);
-
-		uint pathNum, matNum;
-		AssetPath* paths;
-		AssetMaterial* mats;
-		u8* matIndices = mem.allocR<u8>(prefab->meshNum);
-		auto success = m_imp->getTexPathsAndMaterials(
-			pathNum, paths, matNum, mats, matIndices, &mem);
-		if (!success)
-			return;
+		out.matIndices = mem->allocR<u8>(meshNum);
+		if (nullptr == out.matIndices)
+			return false;
+		return m_imp->getTexPathsAndMaterials(
+			out.pathNum, out.paths, out.matNum, out.mats, out.matIndices, mem);
+	}
 
+	void Scene::applyModelMaterials(ScenePrefab* prefab, const char* modelPath,
+		const ModelMaterials& mats, DE_Allocator_NoLock* mem)
+	{
 		io::Path path(modelPath);
-		auto texs = mem.allocL<SceneTex*>(pathNum);
+		auto texs = mem->allocL<SceneTex*>(mats.pathNum);
 		assert(texs);
-		for (int i = 0; i != pathNum; ++i)
+		for (uint i = 0; i != mats.pathNum; ++i)
 		{
-			path.setFileName(paths[i].path);
-			texs[i] = loadTexture(path.c_str(), paths[i].hash, paths[i].strLen);
+			path.setFileName(mats.paths[i].path);
+			texs[i] = loadTexture(path.c_str(), mats.paths[i].hash, mats.paths[i].strLen);
 		}
 
-		auto sMats = m_allocator->allocL<rd::Material>(matNum);
-		sMats = ::new (sMats) rd::Material[matNum];
+		auto sMats = m_allocator->allocL<rd::Material>(mats.matNum);
+		sMats = ::new (sMats) rd::Material[mats.matNum];
 
-		for (int i = 0; i != matNum; ++i)
+		for (uint i = 0; i != mats.matNum; ++i)
 		{
-			for (int j = 0; j != mats[i].texNum; ++j)
-				sMats[i].tbos[j] = texs[mats[i].textures[j].texIndex]->tbo;
+			for (uint j = 0; j != mats.mats[i].texNum; ++j)
+				sMats[i].tbos[j] = texs[mats.mats[i].textures[j].texIndex]->tbo;
 		}
 
 		for (uint i = 0; i != prefab->meshNum; ++i)
-			prefab->rMeshes[i].mat = &sMats[matIndices[i]];
+			prefab->rMeshes[i].mat = &sMats[mats.matIndices[i]];
+	}
+
+	void Scene::loadModelMaterials(ScenePrefab* prefab, const char* modelPath)
+	{
+		ScratchScope scratch;
+		ModelMaterials mats;
+		if (readModelMaterials(prefab->meshNum, mats, &scratch.get()))
+			applyModelMaterials(prefab, modelPath, mats, &scratch.get());
+	}
+
+	template<typename T>
+	static inline void movePointer(T*& ptr, ptrdiff_t delta)
+	{
+		if (ptr)
+			ptr = reinterpret_cast<T*>(reinterpret_cast<u8*>(ptr) + delta);
+	}
+	/* patch the pointers to the data block of a prefab and the ones inside it,
+	   the block is already at its new place */
+	static void relocatePrefab(ScenePrefab* pref, ptrdiff_t delta)
+	{
+		movePointer(pref->rMeshes, delta);
+		movePointer(pref->skel, delta);
+		movePointer(pref->skelAnims, delta);
+		if (pref->skel)
+		{
+			movePointer(pref->skel->nodes, delta);
+			movePointer(pref->skel->boneOffsets, delta);
+		}
+		for (uint i = 0; i != pref->animNum; ++i)
+		{
+			auto& anim = pref->skelAnims[i];
+			movePointer(anim.nodeAnims, delta);
+			for (u32 j = 0; j != anim.nodeAnimNum; ++j)
+			{
+				auto& nodeAnim = anim.nodeAnims[j];
+				movePointer(nodeAnim.positionKeyTimes, delta);
+				movePointer(nodeAnim.positionKeys, delta);
+				movePointer(nodeAnim.rotationKeyTimes, delta);
+				movePointer(nodeAnim.rotationKeys, delta);
+				movePointer(nodeAnim.scaleKeyTimes, delta);
+				movePointer(nodeAnim.scaleKeys, delta);
+			}
+		}
+	}
+	static void onPrefabDataMoved(void* user, void* oldPtr, void* newPtr)
+	{
+		relocatePrefab(reinterpret_cast<ScenePrefab*>(user),
+			reinterpret_cast<u8*>(newPtr) - reinterpret_cast<u8*>(oldPtr));
+	}
+
+	ScenePrefab* Scene::keepModel(const AssetModel& model, rd::RenderMesh* rMeshes,
+		void* begin, void* end, const char* filepath)
+	{
+		for (toy::u32 i = 0; i != model.meshNum; ++i)
+		{
+			auto &mesh = model.meshes[i];
+			m_rdr->loadRenderMesh(
+				mesh.vertNum,
+				mesh.pos, mesh.normal, mesh.coord,
+				mesh.boneIndices, mesh.boneWeights,
+				mesh.triNum, mesh.triIndices,
+				rMeshes[i]);
+		}
+
+		auto spref = m_prefabPool.newUnit();
+		assert(spref);
+		size_t keptSize = (size_t)end - (size_t)begin;
+		spref->data = m_heap.alloc(keptSize, onPrefabDataMoved, spref);
+		if (HandleHeap::invalidHandle == spref->data)
+		{
+			LOGWARNING("Scene %s heap is full, can't keep %s\n", m_name, filepath);
+			for (uint i = 0; i != model.meshNum; ++i)
+				m_rdr->freeRenderMesh(rMeshes[i]);
+			m_prefabPool.deleteUnit(spref);
+			return nullptr;
+		}
+		auto kept = m_heap.get(spref->data);
+		memcpy(kept, begin, keptSize);
+
+		spref->skel = model.skeleton;
+		spref->skelAnims = model.skelAnims;
+		spref->rMeshes = rMeshes;
+		spref->meshNum = model.meshNum;
+		spref->animNum = model.animNum;
+		spref->prog = nullptr;
+		spref->freeBones = nullptr;
+		relocatePrefab(spref, reinterpret_cast<u8*>(kept) - reinterpret_cast<u8*>(begin));
 
-		m_allocator->freeR(buffer);
-		return;
+		m_pPrefs.push_back(spref);
+		return spref;
 	}
 
 	ScenePrefab* Scene::loadModel(const char* filepath, bool loadMats)
 	{
 		assert(filepath && m_imp);
+#if TOY_COROUTINES
+		assert(!m_imp->getModelLock().isLocked() && "loadModelAsync() is using the importer");
+#endif
 		auto suffix = io::Path::getSuffix(filepath);
 		io::WPath wp(filepath);
 		size_t fsize, msize;
@@ -216,44 +567,82 @@ namespace toy
 		auto meshNum = m_imp->openModel3D(fdata, fsize, suffix, &msize);
 		io::freeFile(fdata);
 
-		auto rMeshes = m_allocator->allocL<rd::RenderMesh>(meshNum);
+		/* load in the scratch stack of the thread, render meshes and skeletal
+		   data on its left are kept and copied to the heap, mesh data is dropped */
+		size_t bufSize = msize + sizeof(rd::RenderMesh) * meshNum + HandleHeap::blockAlign * 2;
+		ScratchScope scratch;
+		if (scratch->getAvailSize() < bufSize)
+		{
+			LOGWARNING("Scratch stack is too small to load %s, %zu bytes\n", filepath, bufSize);
+			return nullptr;
+		}
+		auto& mem = scratch.get();
+		void* begin = mem.allocAlignedL(0, HandleHeap::blockAlign);
+
+		auto rMeshes = mem.allocAlignedL<rd::RenderMesh>(meshNum);
 		assert(rMeshes);
 		rMeshes = ::new (rMeshes) rd::RenderMesh[meshNum];
 
-		void* buffer = m_allocator->allocL(msize);
-		DE_Allocator_NoLock mem(buffer, msize);
 		auto model = m_imp->loadModel(&mem);
 		assert(model);
 
-		for (toy::u32 i = 0; i != model->meshNum; ++i)
-		{
-			auto &mesh = model->meshes[i];
-			m_rdr->loadRenderMesh(
-				mesh.vertNum,
-				mesh.pos, mesh.normal, mesh.coord,
-				mesh.boneIndices, mesh.boneWeights,
-				mesh.triNum, mesh.triIndices,
-				rMeshes[i]);
-		}
+		auto spref = keepModel(*model, rMeshes, begin, mem.getTopL(), filepath);
 
-		auto lBottom = mem.allocL(0);
-		m_allocator->freeL(lBottom);
-
-		auto spref = m_allocator->allocAlignedL<ScenePrefab>(1);
-		spref->skel = model->skeleton;
-		spref->skelAnims = model->skelAnims;
-		spref->rMeshes = rMeshes;
-		spref->meshNum = meshNum;
-		spref->prog = nullptr;
-
-		m_pPrefs.push_back(spref);
-
-		if (loadMats)
+		if (spref && loadMats)
 			loadModelMaterials(spref, filepath);
 		
 		return spref;
 	}
 
+#if TOY_COROUTINES
+	CoTask<ScenePrefab*> Scene::loadModelAsync(JobSystem& jobs, const char* filepath, bool loadMats)
+	{
+		assert(filepath && m_imp);
+		co_await toWorker(jobs);
+		io::WPath wp(filepath);
+		size_t fsize, msize;
+		auto fdata = io::readFile(wp, &fsize);
+		if (nullptr == fdata)
+			co_return nullptr;
+
+		/* decoded on a worker while no other model is open in the importer,
+		   the stacks belong to this load, not to the scratch stack of the
+		   worker, as the main thread reads them after the switch */
+		auto importLock = co_await m_imp->getModelLock().lock();
+		auto meshNum = m_imp->openModel3D(fdata, fsize, io::Path::getSuffix(filepath), &msize);
+		io::freeFile(fdata);
+		if (0 == meshNum)
+			co_return nullptr;
+
+		size_t bufSize = msize + sizeof(rd::RenderMesh) * meshNum + HandleHeap::blockAlign;
+		DE_Allocator_NoLock mem(bufSize, "ModelLoad", STACK_VIRTUAL);
+		void* begin = mem.allocL(0);
+		auto rMeshes = mem.allocAlignedL<rd::RenderMesh>(meshNum);
+		assert(rMeshes);
+		rMeshes = ::new (rMeshes) rd::RenderMesh[meshNum];
+
+		auto loaded = m_imp->loadModel(&mem);
+		if (nullptr == loaded)
+			co_return nullptr;
+		AssetModel model = *loaded;//the importer keeps one, the next load overwrites it
+
+		DE_Allocator_NoLock matMem(1024 * 1024, "ModelLoadMaterials", STACK_VIRTUAL);
+		ModelMaterials mats;
+		bool hasMats = loadMats && readModelMaterials(meshNum, mats, &matMem);
+
+		/* GL is on the main thread, the main mailbox runs before the update
+		   nodes of the frame touch the scene stack and the heap */
+		co_await toMainThread(jobs);
+		/* positions and normals of model are still in the scene of the importer,
+		   the next load may open a model once they are uploaded */
+		auto spref = keepModel(model, rMeshes, begin, mem.allocL(0), filepath);
+		importLock.unlock();
+		if (spref && hasMats)
+			applyModelMaterials(spref, filepath, mats, &matMem);
+		co_return spref;
+	}
+#endif
+
 	void sortMeshByMaterial(rd::RenderMesh* meshes, uint num)
 	{
 		//Todo: use a quicker algorithm
@@ -297,66 +686,134 @@ namespace toy
 		}
 	}
 
-	static fmat4 nodemats[512];
-	struct
+	struct CameraMatrices
+	{
+		fmat4 pvmat;
+		fmat4 pmat;
+		fmat4 vmat;
+	};
+	struct InstanceDrawData
 	{
 		fmat4 mmat;
 		fmat4 *bonemats;
 		uint bonenum;
-	}data[2];
-	struct
+	};
+	static inline bool isAnimated(fmat4* bones, SceneObjectProperty flag)
 	{
-		fmat4 pvmat;
-		fmat4 pmat;
-		fmat4 vmat;
-	}camm;
-	void Scene::update(Camera* cam, double time)
+		return bones && flag.getProperty(SceneObjectProperty::SOF_ANIMATED);
+	}
+
+	void Scene::animate(double time, JobSystem* jobs)
 	{
-		assert(cam);
-		camm.pmat = cam->getProjMatrix();
-		camm.vmat = cam->getViewMatrix();
-		camm.pvmat = camm.pmat * camm.vmat;
+		auto frameAllocator = m_rdr->getFrameAllocator();
+		assert(frameAllocator && "scene update needs a frame allocator");
 
-		setCameraMatrices(m_rdr->getShaderProgram(0), &camm);
+		//node matrices are only temp space, share one in every batch
+		u32 maxNodeNum = 0;
+		for (auto& pref : m_pPrefs)
+		{
+			if (pref->skel && pref->skel->nodeNum > maxNodeNum)
+				maxNodeNum = pref->skel->nodeNum;
+		}
+		if (0 == maxNodeNum)
+			return;
+
+		auto animateBatch = [&](uint first, uint last) {
+			auto nodemats = frameAllocator->alloc<fmat4>(maxNodeNum);
+			if (nodemats)
+				animateInstances(first, last - first, time, nodemats);
+		};
+		uint objNum = m_insts.getNum();
+		if (jobs)
+			jobs->parallelFor(0, objNum, animateBatchNum, animateBatch);
+		else
+			animateBatch(0, objNum);
+	}
 
-		for (uint i = 0; i != m_objs.size(); ++i)
+	void Scene::animateInstances(uint first, uint num, double time, fmat4* nodemats)
+	{
+		auto bones = m_insts.getBoneMatrices();
+		auto flags = m_insts.getFlags();
+		auto prefs = m_insts.getPrefabs();
+		for (uint i = first; i != first + num; ++i)
 		{
-			auto &obj = m_objs[i];
-			if (obj->flag.getProperty(SceneObjectProperty::SOF_ANIMATED))
-			{
-				auto &pref = obj->prefab;
-				m_imp->calcSkelAnimMatrices(
-					pref->skel,
-					pref->skelAnims,
-					0,
-					true,
-					time / 1000.0,
-					nodemats,
-					obj->amats);
-				//transpose(obj->amats, pref->skel->boneNum);
-
-				data[i].bonemats = obj->amats;
-				data[i].bonenum = obj->prefab->skel->boneNum;
-			}
-			else
-			{
-				data[i].bonemats = nullptr;
-				data[i].bonenum = 0;
-			}
+			if (!isAnimated(bones[i], flags[i]))
+				continue;
+			auto pref = prefs[i];
+			m_imp->calcSkelAnimMatrices(
+				pref->skel,
+				pref->skelAnims,
+				0,
+				true,
+				time / 1000.0,
+				nodemats,
+				bones[i]);
+			//transpose(bones[i], pref->skel->boneNum);
+		}
+	}
+
+	void Scene::prepareDraw()
+	{
+		auto frameAllocator = m_rdr->getFrameAllocator();
+		assert(frameAllocator && "scene update needs a frame allocator");
+
+		uint objNum = m_insts.getNum();
+		m_drawData = frameAllocator->alloc<InstanceDrawData>(objNum);
+		m_drawFrame = frameAllocator->getFrameIndex();
+		if (nullptr == m_drawData)
+			return;
 
-			data[i].mmat = obj->mmat;
+		auto data = reinterpret_cast<InstanceDrawData*>(m_drawData);
+		auto mmats = m_insts.getModelMatrices();
+		auto bones = m_insts.getBoneMatrices();
+		auto boneNums = m_insts.getBoneNums();
+		auto flags = m_insts.getFlags();
+		for (uint i = 0; i != objNum; ++i)
+		{
+			bool animated = isAnimated(bones[i], flags[i]);
+			data[i].mmat = mmats[i];
+			data[i].bonemats = animated ? bones[i] : nullptr;
+			data[i].bonenum = animated ? boneNums[i] : 0;
 		}
 	}
 
-	void Scene::drawAll(Camera* cam)
+	void Scene::updateCamera(uint camIdx, const Camera* cam)
 	{
-		//Todo
 		assert(cam);
-		auto pvmat = cam->getPVMatrix();
+		assert(camIdx < maxCameraNum && "too many cameras");
+		if (camIdx >= maxCameraNum)
+			return;
+		auto frameAllocator = m_rdr->getFrameAllocator();
+		assert(frameAllocator && "scene update needs a frame allocator");
+
+		auto camm = frameAllocator->alloc<CameraMatrices>(1);
+		m_camData[camIdx] = camm;
+		m_camFrame[camIdx] = frameAllocator->getFrameIndex();
+		if (nullptr == camm)
+			return;
+		camm->pmat = cam->getProjMatrix();
+		camm->vmat = cam->getViewMatrix();
+		camm->pvmat = camm->pmat * camm->vmat;
+	}
+
+	void Scene::drawAll(uint camIdx)
+	{
+		//Todo
+		auto frameAllocator = m_rdr->getFrameAllocator();
+		auto frameIdx = frameAllocator->getFrameIndex();
+		if (nullptr == m_drawData || m_drawFrame != frameIdx)
+			return;//update failed or not called in this frame
+		if (camIdx >= maxCameraNum || nullptr == m_camData[camIdx] || m_camFrame[camIdx] != frameIdx)
+			return;
+
+		setCameraMatrices(m_rdr->getShaderProgram(0), m_camData[camIdx]);
+
+		auto data = reinterpret_cast<InstanceDrawData*>(m_drawData);
+		auto prefs = m_insts.getPrefabs();
 		IShaderProgram* curProg = nullptr;
-		for (uint i = 0; i != m_objs.size(); ++i)
+		for (uint i = 0; i != m_insts.getNum(); ++i)
 		{
-			auto& pref = m_objs[i]->prefab;
+			auto pref = prefs[i];
 			if (curProg != pref->prog)
 			{
 				curProg = pref->prog;
@@ -372,12 +829,14 @@ namespace toy
 		}
 	}
 
-	void SceneManager::init(size_t spaceSize, IRenderDriver* rdr)
+	void SceneManager::init(size_t spaceSize, IRenderDriver* rdr, StackBacking backing, JobSystem* jobs)
 	{
 		delete m_allocator;
-		m_allocator = new DE_Allocator(spaceSize, "SceneManagerAllocator");
+		m_allocator = new DE_Allocator(1024 * 1024, "SceneManagerAllocator", STACK_VIRTUAL);
+		m_sceneSpaceSize = spaceSize;
+		m_sceneBacking = backing;
 		m_rdr = rdr;
-		m_imp.init(rdr);
+		m_imp.init(rdr, jobs);
 		loadDefaultShaders(rdr);
 	}
 
@@ -389,13 +848,13 @@ namespace toy
 		recycled by os, no need to do extra process */
 		for (auto& scene : m_scenes)
 		{
-			delete scene;
+			deleteObject(scene);
 			scene = nullptr;
 		}
-		delete m_loadingScene;
-		delete m_prevScene;
-		delete m_curScene;
-		delete m_sharedScene;
+		deleteObject(m_loadingScene);
+		deleteObject(m_prevScene);
+		deleteObject(m_curScene);
+		deleteObject(m_sharedScene);
 
 		delete m_allocator;
 
@@ -412,13 +871,12 @@ namespace toy
 		str::strnCpy(sceneName, strSize, name, strSize - 1);
 		sceneName[strSize - 1] = '\0';
 
-		auto allocator = m_allocator->allocL<DE_Allocator_NoLock>(1);
-		auto spaceSize = m_allocator->getAvailSize();
-		auto space = m_allocator->allocL(spaceSize);
-		allocator = ::new (allocator) 
-			DE_Allocator_NoLock(space, spaceSize, "SceneAllocator");
+		/* every scene reserves its own space, pages are committed on demand */
+		auto allocator = m_allocator->allocAlignedL<DE_Allocator_NoLock>(1);
+		allocator = ::new (allocator)
+			DE_Allocator_NoLock(m_sceneSpaceSize, "SceneAllocator", m_sceneBacking);
 
-		auto scene = new Scene(sceneName, allocator, m_rdr, &m_imp);
+		auto scene = newObject<Scene>(sceneName, allocator, m_sceneSpaceSize / 4, m_rdr, &m_imp);
 
 		m_loadingScene = scene;
 		return scene;
@@ -437,35 +895,82 @@ namespace toy
 			assert(m_curScene == scene);
 			auto stackptr = scene->getSceneName();
 			scene->freeScene();
+			deleteObject(scene);
 			m_allocator->freeL(const_cast<char*>(stackptr));
-			delete scene;
 			scene = nullptr;
 		}
 	}
 
 	void SceneManager::endLoadScene(Scene* scene)
 	{
-		m_allocator->freeL(scene->getTopL());
+		scene->trimMemory();
+		scene->reportMemory();
 		m_imp.closeModel3D();
 	}
 
 	void SceneManager::update(double time)
 	{
 		assert(m_curScene);
-		for (auto& cam : m_cams)
+		m_curScene->compactMemory(SCENECOMPACTBYTES);
+		m_curScene->animate(time);
+		m_curScene->prepareDraw();
+		for (uint i = 0; i != m_cams.size(); ++i)
+			m_curScene->updateCamera(i, &m_cams[i]);
+	}
+
+	TaskGraph::NodeId SceneManager::addUpdateNodes(
+		TaskGraph& graph, JobSystem* jobs, double time, TaskGraph::NodeId after)
+	{
+		assert(m_curScene);
+		m_updateJobs = jobs;
+		m_updateTime = time;
+
+		/* moving prefab data must not overlap reading it */
+		auto compact = graph.addNode("scene compact", compactNode, m_curScene);
+		auto animate = graph.addNode("scene animate", animateNode, this);
+		auto drawData = graph.addNode("scene draw data", drawDataNode, m_curScene);
+		auto done = graph.addNode("scene update", nullptr, nullptr);
+		graph.addDependency(after, compact);
+		graph.addDependency(compact, animate);
+		graph.addDependency(animate, drawData);
+		graph.addDependency(drawData, done);
+
+		for (uint i = 0; i != m_cams.size(); ++i)
 		{
-			m_curScene->update(&cam, time);
+			auto camera = graph.addNode("camera", cameraNode, this, i);
+			graph.addDependency(after, camera);
+			graph.addDependency(camera, done);
 		}
+		return done;
 	}
 
 	void SceneManager::drawAll()
 	{
 		assert(m_curScene);
-		for (auto& cam : m_cams)
+		for (uint i = 0; i != m_cams.size(); ++i)
 		{
-			m_curScene->drawAll(&cam);
+			m_curScene->drawAll(i);
 		}
 	}
+
+	void SceneManager::compactNode(void* arg, uint)
+	{
+		reinterpret_cast<Scene*>(arg)->compactMemory(SCENECOMPACTBYTES);
+	}
+	void SceneManager::animateNode(void* arg, uint)
+	{
+		auto smgr = reinterpret_cast<SceneManager*>(arg);
+		smgr->m_curScene->animate(smgr->m_updateTime, smgr->m_updateJobs);
+	}
+	void SceneManager::drawDataNode(void* arg, uint)
+	{
+		reinterpret_cast<Scene*>(arg)->prepareDraw();
+	}
+	void SceneManager::cameraNode(void* arg, uint camIdx)
+	{
+		auto smgr = reinterpret_cast<SceneManager*>(arg);
+		smgr->m_curScene->updateCamera(camIdx, &smgr->m_cams[camIdx]);
+	}
 	
 	void SceneManager::switchScene(Scene* scene)
 	{
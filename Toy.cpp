@@ -67,8 +67,16 @@ namespace toy
 		Timer::initTimerEnv();
 		m_mainTimer.init();
 
-		size_t spaceSize = 1024 * 1024 * 128;//128M
-		m_smgr.init(spaceSize, m_wnd.getRenderDriver());
+		m_jobs.init();
+
+		size_t frameSpaceSize = 1024 * 1024 * 4;//4M per frame
+		m_frameAllocator = new FrameAllocator(frameSpaceSize, 2, "FrameAllocator");
+		m_wnd.getRenderDriver()->setFrameAllocator(m_frameAllocator);
+
+		//reserved for every scene, committed as it grows
+		size_t spaceSize = (size_t)1 << (sizeof(void*) == 8 ? 32 : 28);//4G or 256M
+		m_smgr.init(spaceSize, m_wnd.getRenderDriver(),
+			SCENEHUGEPAGES ? STACK_HUGEPAGE : STACK_VIRTUAL, &m_jobs);
 
 		//Todo: put lua to other thread
 		m_lua.init(nullptr, nullptr);
@@ -80,9 +88,13 @@ namespace toy
 
 	void ToyEngine::destroy()
 	{
+		m_jobs.dumpStats();
+		m_jobs.destroy();
 		m_lua.destroy();
 		m_smgr.destroy();
 		m_wnd.destroy();
+		delete m_frameAllocator;
+		m_frameAllocator = nullptr;
 	}
 
 	//Timer MUST be initilized before call this function
@@ -119,26 +131,54 @@ namespace toy
 		assert(rdr);
 
 		m_mainTimer.reset();
+		u64 frameNum = 0;
 		
 		while (1)
 		{
 			auto frameTime = m_mainTimer.getTime();
 			if (!m_wnd.checkOSMsg())
 				break;
-			m_hidFun(this, frameTime);
-			m_hid.synchronizeStates();
-
-			m_smgr.update(frameTime);
-
-			rdr->beginFrame();
-			rdr->clearFramebuffer();
-
-			m_smgr.drawAll();
-
-			rdr->endFrame();
+			m_frameTime = frameTime;
+
+			/* hid -> main mailbox -> camera x N ---------------------------------> scene update -> draw
+			                       \ scene compact -> scene animate -> scene draw data /               /
+			   clear ----------------------------------------------------------------------------------
+			   the mailbox (uploads of background loading) adds and frees prefabs and
+			   instances, the scene update nodes on workers must not overlap it */
+			m_frameGraph.clear();
+			auto hid = m_frameGraph.addNode("hid", [](void* arg, uint) {
+				auto eng = reinterpret_cast<ToyEngine*>(arg);
+				eng->m_hidFun(eng, eng->m_frameTime);
+				eng->m_hid.synchronizeStates();
+			}, this, 0, TaskGraph::NODE_MAIN_THREAD);
+			auto mailbox = m_frameGraph.addNode("main mailbox", [](void* arg, uint) {
+				auto eng = reinterpret_cast<ToyEngine*>(arg);
+				eng->m_jobs.drainMainThread(eng->m_mainBudgetNs);
+			}, this, 0, TaskGraph::NODE_MAIN_THREAD);
+			m_frameGraph.addDependency(hid, mailbox);
+			auto update = m_smgr.addUpdateNodes(m_frameGraph, &m_jobs, frameTime, mailbox);
+			auto clear = m_frameGraph.addNode("clear", [](void* arg, uint) {
+				auto rdr = reinterpret_cast<IRenderDriver*>(arg);
+				rdr->beginFrame();
+				rdr->clearFramebuffer();
+			}, rdr, 0, TaskGraph::NODE_MAIN_THREAD);
+			auto draw = m_frameGraph.addNode("draw", [](void* arg, uint) {
+				auto eng = reinterpret_cast<ToyEngine*>(arg);
+				eng->m_smgr.drawAll();
+				eng->getRenderDriver()->endFrame();
+			}, this, 0, TaskGraph::NODE_MAIN_THREAD);
+			m_frameGraph.addDependency(update, draw);
+			m_frameGraph.addDependency(clear, draw);
+			m_frameGraph.run(m_jobs);
 
 			m_wnd.swapBuffers();
 
+			++frameNum;
+			if (m_memDumpInterval && 0 == frameNum % m_memDumpInterval)
+				getAllocatorRegistry().dump();
+			if (m_traceDumpInterval && 0 == frameNum % m_traceDumpInterval)
+				m_frameGraph.dumpTrace();
+
 			calcFPS(&m_wnd, m_mainTimer);
 		}
 		return 0;
@@ -263,6 +263,81 @@ static luaL_Reg toy_iolib[] =
 	{ NULL, NULL },
 };
 
+// table[] stats(), every allocator is a table of its counters
+static int toy_mem_stats(lua_State* L)
+{
+	toy::AllocatorRegistry::Record records[128];
+	uint num = toy::getAllocatorRegistry().snapshot(records, ARRAYLENGTH(records));
+	if (num > ARRAYLENGTH(records))
+		num = ARRAYLENGTH(records);
+
+	lua_createtable(L, num, 0);
+	for (uint i = 0; i != num; ++i)
+	{
+		auto& r = records[i];
+		lua_createtable(L, 0, 12);
+		lua_pushstring(L, r.name);
+		lua_setfield(L, -2, "name");
+		lua_pushstring(L, r.kind);
+		lua_setfield(L, -2, "kind");
+		lua_pushinteger(L, r.capacity);
+		lua_setfield(L, -2, "capacity");
+		lua_pushinteger(L, r.committedSize);
+		lua_setfield(L, -2, "committed");
+		lua_pushinteger(L, r.usedSizeL + r.usedSizeR);
+		lua_setfield(L, -2, "used");
+		lua_pushinteger(L, r.usedSizeL);
+		lua_setfield(L, -2, "used_l");
+		lua_pushinteger(L, r.usedSizeR);
+		lua_setfield(L, -2, "used_r");
+		lua_pushinteger(L, r.highWater);
+		lua_setfield(L, -2, "high_water");
+		lua_pushinteger(L, r.budget);
+		lua_setfield(L, -2, "budget");
+		lua_pushinteger(L, r.allocNum);
+		lua_setfield(L, -2, "allocs");
+		lua_pushinteger(L, r.freeNum);
+		lua_setfield(L, -2, "frees");
+		lua_pushinteger(L, r.failedNum);
+		lua_setfield(L, -2, "failed");
+		lua_rawseti(L, -2, i + 1);
+	}
+	return 1;
+}
+// set_budget(string name, int bytes), 0 bytes removes the budget
+static int toy_mem_set_budget(lua_State* L)
+{
+	const char* name = luaL_checkstring(L, 1);
+	auto budget = luaL_checkinteger(L, 2);
+	if (budget < 0)
+		luaL_error(L, "Budget can't be negative");
+	toy::getAllocatorRegistry().setBudget(name, static_cast<size_t>(budget));
+	return 0;
+}
+static int toy_mem_dump(lua_State* L)
+{
+	toy::getAllocatorRegistry().dump();
+	return 0;
+}
+// set_dump_interval(int frames), 0 stops the per-frame dump
+static int toy_mem_set_dump_interval(lua_State* L)
+{
+	auto frameNum = luaL_checkinteger(L, 1);
+	if (frameNum < 0)
+		luaL_error(L, "Interval can't be negative");
+	getEngine(L)->setMemoryDumpInterval(static_cast<uint>(frameNum));
+	return 0;
+}
+
+static luaL_Reg toy_memlib[] =
+{
+	{ "stats", toy_mem_stats },
+	{ "set_budget", toy_mem_set_budget },
+	{ "dump", toy_mem_dump },
+	{ "set_dump_interval", toy_mem_set_dump_interval },
+	{ NULL, NULL },
+};
+
 static int open_toylib(lua_State* L)
 {
 	lua_newtable(L);
@@ -273,6 +348,9 @@ static int open_toylib(lua_State* L)
 	luaL_newlib(L, toy_iolib);
 	lua_setfield(L, -2, "io");
 
+	luaL_newlib(L, toy_memlib);
+	lua_setfield(L, -2, "mem");
+
 	return 1;
 }
 
@@ -0,0 +1,500 @@
+/* Allocator benchmarks, build it as a console program together with
+   Memory.cpp and IO.cpp.
+   usage: MemoryBench [maxThreadNum] [roundNum]
+
+   Every thread runs roundNum rounds, a round allocates burstNum blocks,
+   writes them and frees them again (LIFO unless told otherwise).
+   ns/op is thread time per allocation + free pair,
+   p99 is the 99th percentile of sampled single allocations (clock included),
+   RSS is the growth of the resident set during the run */
+#include "../include/Memory.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#ifdef _WIN32
+#include <Psapi.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "psapi.lib")
+#endif
+#endif
+
+namespace
+{
+	using namespace toy;
+	using Clock = std::chrono::steady_clock;
+
+	constexpr int burstNum = 64; //blocks held by a thread at the same time
+	constexpr int sizeTableLen = 4096;
+	constexpr int sampleMask = 7; //time one allocation of every 8
+
+	int roundNum = 2000;
+
+	size_t getRSS()
+	{
+#ifdef _WIN32
+		PROCESS_MEMORY_COUNTERS pmc;
+		if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+			return pmc.WorkingSetSize;
+		return 0;
+#else
+		FILE* statm = fopen("/proc/self/statm", "r");
+		if (nullptr == statm)
+			return 0;
+		unsigned long long pageNum = 0, residentNum = 0;
+		if (2 != fscanf(statm, "%llu %llu", &pageNum, &residentNum))
+			residentNum = 0;
+		fclose(statm);
+		return static_cast<size_t>(residentNum) * vm::getPageSize();
+#endif
+	}
+
+	/* Size distributions, tables are filled once per thread so no
+	   random numbers are drawn inside the timed loops */
+	enum SizeDist
+	{
+		SIZE_FIXED64,
+		SIZE_UNIFORM_16_1K,
+		SIZE_LOG_16_64K, //uniform over powers of two, then within the power
+		SIZE_MIXED, //90% in [16, 256], 10% in (256, 16K]
+		SIZE_DIST_NUM,
+	};
+	const char* sizeDistNames[SIZE_DIST_NUM] =
+	{
+		"fixed 64", "uniform 16-1K", "log 16-64K", "mixed 90% <=256",
+	};
+
+	struct Random
+	{
+		u64 state;
+		explicit Random(u64 seed) : state(seed * 0x9E3779B97F4A7C15ull + 1) {}
+		u32 next()
+		{
+			state ^= state << 13;
+			state ^= state >> 7;
+			state ^= state << 17;
+			return static_cast<u32>(state >> 16);
+		}
+		u32 range(u32 low, u32 high) { return low + next() % (high - low + 1); }
+	};
+
+	void fillSizes(size_t* sizes, SizeDist dist, int threadIdx)
+	{
+		Random rnd(threadIdx + 1);
+		for (int i = 0; i != sizeTableLen; ++i)
+		{
+			switch (dist)
+			{
+			case SIZE_FIXED64: sizes[i] = 64; break;
+			case SIZE_UNIFORM_16_1K: sizes[i] = rnd.range(16, 1024); break;
+			case SIZE_LOG_16_64K:
+			{
+				u32 shift = rnd.range(4, 15);
+				sizes[i] = rnd.range(1u << shift, (2u << shift) - 1);
+				break;
+			}
+			case SIZE_MIXED:
+				sizes[i] = rnd.range(0, 9) ? rnd.range(16, 256) : rnd.range(257, 16 * 1024);
+				break;
+			default: sizes[i] = 64; break;
+			}
+		}
+	}
+
+	struct Result
+	{
+		double nsPerOp;
+		double p99Ns;
+		long long rssDelta;
+	};
+
+	/* Run worker(threadIdx, samples) on threadNum threads at the same time,
+	   the worker returns how many allocation + free pairs it did */
+	template<typename Worker>
+	Result runThreads(int threadNum, Worker&& worker)
+	{
+		size_t rssBefore = getRSS();
+		std::atomic<int> ready{ 0 };
+		std::atomic<bool> go{ false };
+		std::vector<std::vector<float>> samples(threadNum);
+		std::vector<size_t> opNums(threadNum, 0);
+		std::vector<IThread> threads;
+		for (int t = 0; t != threadNum; ++t)
+		{
+			samples[t].reserve(static_cast<size_t>(roundNum) * burstNum / (sampleMask + 1) + 1);
+			threads.emplace_back([t, &worker, &samples, &opNums, &ready, &go]()
+			{
+				ready.fetch_add(1);
+				while (!go.load(std::memory_order_acquire))
+					;
+				opNums[t] = worker(t, samples[t]);
+			});
+		}
+		while (ready.load() != threadNum)
+			;
+		auto begin = Clock::now();
+		go.store(true, std::memory_order_release);
+		for (auto& thread : threads)
+			thread.join();
+		double ns = std::chrono::duration<double, std::nano>(Clock::now() - begin).count();
+		size_t rssAfter = getRSS();
+
+		size_t opNum = 0;
+		std::vector<float> all;
+		for (int t = 0; t != threadNum; ++t)
+		{
+			opNum += opNums[t];
+			all.insert(all.end(), samples[t].begin(), samples[t].end());
+		}
+		Result r;
+		r.nsPerOp = opNum ? ns * threadNum / opNum : 0.0;
+		r.p99Ns = 0.0;
+		if (!all.empty())
+		{
+			size_t idx = all.size() * 99 / 100;
+			std::nth_element(all.begin(), all.begin() + idx, all.end());
+			r.p99Ns = all[idx];
+		}
+		r.rssDelta = static_cast<long long>(rssAfter) - static_cast<long long>(rssBefore);
+		return r;
+	}
+
+	/* One thread's loop over any allocator, alloc(size) and free(ptr, size).
+	   lifo frees the burst in reverse order, otherwise in allocation order */
+	template<typename Alloc, typename Free>
+	size_t burstLoop(const size_t* sizes, std::vector<float>& samples,
+		bool lifo, Alloc&& alloc, Free&& free)
+	{
+		void* blocks[burstNum];
+		size_t blockSizes[burstNum];
+		int k = 0;
+		for (int r = 0; r != roundNum; ++r)
+		{
+			for (int i = 0; i != burstNum; ++i)
+			{
+				size_t size = sizes[k++ & (sizeTableLen - 1)];
+				void* p;
+				if (0 == (i & sampleMask))
+				{
+					auto t0 = Clock::now();
+					p = alloc(size);
+					auto t1 = Clock::now();
+					samples.push_back(std::chrono::duration<float, std::nano>(t1 - t0).count());
+				}
+				else
+					p = alloc(size);
+				if (nullptr == p)
+				{
+					fprintf(stderr, "allocation failed, size %zu\n", size);
+					std::exit(1);
+				}
+				*reinterpret_cast<volatile u8*>(p) = static_cast<u8>(r);
+				blocks[i] = p;
+				blockSizes[i] = size;
+			}
+			if (lifo)
+			{
+				for (int i = burstNum; i != 0; --i)
+					free(blocks[i - 1], blockSizes[i - 1]);
+			}
+			else
+			{
+				for (int i = 0; i != burstNum; ++i)
+					free(blocks[i], blockSizes[i]);
+			}
+		}
+		return static_cast<size_t>(roundNum) * burstNum;
+	}
+
+	void printHeader(const char* title)
+	{
+		printf("\n== %s, %d rounds of %d blocks per thread ==\n", title, roundNum, burstNum);
+		printf("%-34s %-16s %8s %10s %10s %10s\n",
+			"allocator", "sizes", "threads", "ns/op", "p99 ns", "RSS KB");
+	}
+	void printResult(const char* name, const char* dist, int threadNum, const Result& r)
+	{
+		printf("%-34s %-16s %8d %10.2f %10.1f %10lld\n",
+			name, dist, threadNum, r.nsPerOp, r.p99Ns, r.rssDelta / 1024);
+	}
+
+	/* the largest block of every distribution times the burst, plus headers and padding */
+	constexpr size_t stackSizePerThread = burstNum * (64 * 1024 + 128);
+
+	/* One stack per thread, kept alive until the RSS is read */
+	struct ThreadStacks
+	{
+		std::vector<std::unique_ptr<DE_Allocator_NoLock>> stacks;
+
+		explicit ThreadStacks(int threadNum)
+		{
+			for (int t = 0; t != threadNum; ++t)
+				stacks.emplace_back(new DE_Allocator_NoLock(stackSizePerThread, "BenchStack", STACK_VIRTUAL));
+		}
+		DE_Allocator_NoLock& operator[](int t) { return *stacks[t]; }
+	};
+
+	/* General purpose and stack allocators over every size distribution */
+	void benchSizeDistributions(int maxThreadNum)
+	{
+		printHeader("Size distributions, LIFO free");
+		std::vector<std::vector<size_t>> sizes(maxThreadNum, std::vector<size_t>(sizeTableLen));
+		for (int d = 0; d != SIZE_DIST_NUM; ++d)
+		{
+			auto dist = static_cast<SizeDist>(d);
+			for (int t = 0; t != maxThreadNum; ++t)
+				fillSizes(sizes[t].data(), dist, t);
+			const char* distName = sizeDistNames[d];
+
+			for (int threadNum = 1; threadNum <= maxThreadNum; threadNum *= 2)
+			{
+				printResult("malloc/free", distName, threadNum,
+					runThreads(threadNum, [&](int t, std::vector<float>& s)
+				{
+					return burstLoop(sizes[t].data(), s, true,
+						[](size_t size) { return std::malloc(size); },
+						[](void* p, size_t) { std::free(p); });
+				}));
+				printResult("operator new/delete", distName, threadNum,
+					runThreads(threadNum, [&](int t, std::vector<float>& s)
+				{
+					return burstLoop(sizes[t].data(), s, true,
+						[](size_t size) { return ::operator new(size); },
+						[](void* p, size_t) { ::operator delete(p); });
+				}));
+				printResult("toy::alloc/free", distName, threadNum,
+					runThreads(threadNum, [&](int t, std::vector<float>& s)
+				{
+					return burstLoop(sizes[t].data(), s, true,
+						[](size_t size) { return toy::alloc(size); },
+						[](void* p, size_t size) { toy::free(p, size); });
+				}));
+				/* freeL() rewinds to the mark, the left side has one owner */
+				if (1 == threadNum)
+				{
+					DE_Allocator stack(stackSizePerThread, "BenchStack", STACK_VIRTUAL);
+					printResult("DE_Allocator L", distName, threadNum,
+						runThreads(threadNum, [&](int t, std::vector<float>& s)
+					{
+						return burstLoop(sizes[t].data(), s, true,
+							[&](size_t size) { return stack.allocL(size); },
+							[&](void* p, size_t) { stack.freeL(p); });
+					}));
+				}
+				{
+					DE_Allocator stack(stackSizePerThread * threadNum, "BenchStack", STACK_VIRTUAL);
+					printResult("DE_Allocator R (shared)", distName, threadNum,
+						runThreads(threadNum, [&](int t, std::vector<float>& s)
+					{
+						return burstLoop(sizes[t].data(), s, true,
+							[&](size_t size) { return stack.allocR(size); },
+							[&](void* p, size_t) { stack.freeR(p); });
+					}));
+				}
+				{
+					ThreadStacks own(threadNum);
+					printResult("DE_Allocator_NoLock L (own)", distName, threadNum,
+						runThreads(threadNum, [&](int t, std::vector<float>& s)
+					{
+						DE_Allocator_NoLock& stack = own[t];
+						return burstLoop(sizes[t].data(), s, true,
+							[&](size_t size) { return stack.allocL(size); },
+							[&](void* p, size_t) { stack.freeL(p); });
+					}));
+				}
+				{
+					ThreadStacks own(threadNum);
+					printResult("DE_Allocator_NoLock R (own)", distName, threadNum,
+						runThreads(threadNum, [&](int t, std::vector<float>& s)
+					{
+						DE_Allocator_NoLock& stack = own[t];
+						return burstLoop(sizes[t].data(), s, true,
+							[&](size_t size) { return stack.allocR(size); },
+							[&](void* p, size_t) { stack.freeR(p); });
+					}));
+				}
+			}
+		}
+	}
+
+	struct Unit64 { u8 bytes[64]; };
+	constexpr size_t poolUnitNum = 1 << 20;
+
+	/* Fixed size units, pools against the general purpose allocators */
+	void benchPools(int maxThreadNum)
+	{
+		printHeader("Pools, 64 bytes units, LIFO free");
+		size_t bufSize = tPoolAllocator<Unit64>::getBufferSize(poolUnitNum);
+		if (bufSize < tPoolAllocator_LockFree<Unit64>::getBufferSize(poolUnitNum))
+			bufSize = tPoolAllocator_LockFree<Unit64>::getBufferSize(poolUnitNum);
+		u8* buffer = new u8[bufSize];
+		std::vector<size_t> sizes(sizeTableLen, 64);
+		const char* distName = sizeDistNames[SIZE_FIXED64];
+
+		for (int threadNum = 1; threadNum <= maxThreadNum; threadNum *= 2)
+		{
+			printResult("malloc/free", distName, threadNum,
+				runThreads(threadNum, [&](int, std::vector<float>& s)
+			{
+				return burstLoop(sizes.data(), s, true,
+					[](size_t size) { return std::malloc(size); },
+					[](void* p, size_t) { std::free(p); });
+			}));
+			{
+				tPoolAllocator<Unit64> pool(buffer, poolUnitNum, "BenchMutexPool");
+				printResult("tPoolAllocator", distName, threadNum,
+					runThreads(threadNum, [&](int, std::vector<float>& s)
+				{
+					return burstLoop(sizes.data(), s, true,
+						[&](size_t) { return pool.allocUnit(); },
+						[&](void* p, size_t) { pool.freeUnit(p); });
+				}));
+			}
+			{
+				tPoolAllocator_LockFree<Unit64> pool(buffer, poolUnitNum, "BenchLockFreePool");
+				printResult("tPoolAllocator_LockFree", distName, threadNum,
+					runThreads(threadNum, [&](int, std::vector<float>& s)
+				{
+					return burstLoop(sizes.data(), s, true,
+						[&](size_t) { return pool.allocUnit(); },
+						[&](void* p, size_t) { pool.freeUnit(p); });
+				}));
+			}
+			{
+				ChunkedPoolAllocator pool(sizeof(Unit64), 16, PoolGrowPolicy(), "BenchChunkedPool");
+				printResult("ChunkedPoolAllocator", distName, threadNum,
+					runThreads(threadNum, [&](int, std::vector<float>& s)
+				{
+					return burstLoop(sizes.data(), s, true,
+						[&](size_t) { return pool.allocUnit(); },
+						[&](void* p, size_t) { pool.freeUnit(p); });
+				}));
+			}
+		}
+		delete[] buffer;
+	}
+
+	/* Aligned blocks from both ends of the stacks */
+	void benchAligned(int maxThreadNum)
+	{
+		printHeader("Aligned stack blocks, LIFO free");
+		std::vector<std::vector<size_t>> sizes(maxThreadNum, std::vector<size_t>(sizeTableLen));
+		for (int t = 0; t != maxThreadNum; ++t)
+			fillSizes(sizes[t].data(), SIZE_UNIFORM_16_1K, t);
+		const char* distName = sizeDistNames[SIZE_UNIFORM_16_1K];
+
+		for (u8 alignment : { 16, 64 })
+		{
+			char name[64];
+			for (int threadNum = 1; threadNum <= maxThreadNum; threadNum *= 2)
+			{
+				if (1 == threadNum)
+				{
+					DE_Allocator stack(stackSizePerThread, "BenchStack", STACK_VIRTUAL);
+					snprintf(name, sizeof(name), "DE_Allocator AlignedL %d", alignment);
+					printResult(name, distName, threadNum,
+						runThreads(threadNum, [&](int t, std::vector<float>& s)
+					{
+						return burstLoop(sizes[t].data(), s, true,
+							[&](size_t size) { return stack.allocAlignedL(size, alignment); },
+							[&](void* p, size_t) { stack.freeAlignedL(p); });
+					}));
+				}
+				{
+					DE_Allocator stack(stackSizePerThread * threadNum, "BenchStack", STACK_VIRTUAL);
+					snprintf(name, sizeof(name), "DE_Allocator AlignedR %d (shared)", alignment);
+					printResult(name, distName, threadNum,
+						runThreads(threadNum, [&](int t, std::vector<float>& s)
+					{
+						return burstLoop(sizes[t].data(), s, true,
+							[&](size_t size) { return stack.allocAlignedR(size, alignment); },
+							[&](void* p, size_t) { stack.freeAlignedR(p); });
+					}));
+				}
+				snprintf(name, sizeof(name), "DE_NoLock AlignedL %d (own)", alignment);
+				{
+					ThreadStacks own(threadNum);
+					printResult(name, distName, threadNum,
+						runThreads(threadNum, [&](int t, std::vector<float>& s)
+					{
+						DE_Allocator_NoLock& stack = own[t];
+						return burstLoop(sizes[t].data(), s, true,
+							[&](size_t size) { return stack.allocAlignedL(size, alignment); },
+							[&](void* p, size_t) { stack.freeAlignedL(p); });
+					}));
+				}
+				snprintf(name, sizeof(name), "DE_NoLock AlignedR %d (own)", alignment);
+				{
+					ThreadStacks own(threadNum);
+					printResult(name, distName, threadNum,
+						runThreads(threadNum, [&](int t, std::vector<float>& s)
+					{
+						DE_Allocator_NoLock& stack = own[t];
+						return burstLoop(sizes[t].data(), s, true,
+							[&](size_t size) { return stack.allocAlignedR(size, alignment); },
+							[&](void* p, size_t) { stack.freeAlignedR(p); });
+					}));
+				}
+			}
+		}
+	}
+
+	/* DE_Allocator::freeR() only marks a block freed out of order,
+	   the right top moves back when the block at the top is freed */
+	void benchOutOfOrderFreeR(int maxThreadNum)
+	{
+		printHeader("Out of order free, oldest block first");
+		std::vector<std::vector<size_t>> sizes(maxThreadNum, std::vector<size_t>(sizeTableLen));
+		for (int t = 0; t != maxThreadNum; ++t)
+			fillSizes(sizes[t].data(), SIZE_MIXED, t);
+		const char* distName = sizeDistNames[SIZE_MIXED];
+
+		for (int threadNum = 1; threadNum <= maxThreadNum; threadNum *= 2)
+		{
+			printResult("malloc/free", distName, threadNum,
+				runThreads(threadNum, [&](int t, std::vector<float>& s)
+			{
+				return burstLoop(sizes[t].data(), s, false,
+					[](size_t size) { return std::malloc(size); },
+					[](void* p, size_t) { std::free(p); });
+			}));
+			DE_Allocator stack(stackSizePerThread * threadNum, "BenchStack", STACK_VIRTUAL);
+			printResult("DE_Allocator R (shared)", distName, threadNum,
+				runThreads(threadNum, [&](int t, std::vector<float>& s)
+			{
+				return burstLoop(sizes[t].data(), s, false,
+					[&](size_t size) { return stack.allocR(size); },
+					[&](void* p, size_t) { stack.freeR(p); });
+			}));
+			/* blocks freed while other threads were in allocR() are released too */
+			if (stack.getAvailSize() != stackSizePerThread * threadNum)
+			{
+				fprintf(stderr, "%zu bytes not released\n",
+					stackSizePerThread * threadNum - stack.getAvailSize());
+				std::exit(1);
+			}
+		}
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	int maxThreadNum = argc > 1 ? std::atoi(argv[1]) : 16;
+	if (maxThreadNum < 1)
+		maxThreadNum = 1;
+	if (argc > 2 && std::atoi(argv[2]) > 0)
+		roundNum = std::atoi(argv[2]);
+
+	io::Logger::setLogLevel(io::Logger::LOG_WARNING);
+
+	benchPools(maxThreadNum);
+	benchSizeDistributions(maxThreadNum);
+	benchAligned(maxThreadNum);
+	benchOutOfOrderFreeR(maxThreadNum);
+	return 0;
+}
@@ -0,0 +1,439 @@
+/* Task queue benchmarks, build it as a console program together with
+   JobSystem.cpp, IThread.cpp, Memory.cpp and IO.cpp.
+   usage: TaskQueueBench [maxProducerNum] [taskNum] [consumerNum]
+
+   Every producer pushes taskNum tasks to the queue under test while
+   consumerNum threads run them, producers go 1, 2, 4... maxProducerNum.
+   Loads are steady (one task every steadyGapNs per producer),
+   burst (burstLen tasks back to back, then idle for burstIdleNs)
+   and flood (as fast as the queue takes them).
+   Mtask/s is tasks run per second from the first push to the last run,
+   latency is from push to the start of the task body,
+   lost and dup count tasks that never ran or ran more than once,
+   full is the times a push found the queue full.
+   A queue is benched through an adapter with start(), push(), stop()
+   and getFullCount(), see TaskQueueAdapter */
+#include "../include/JobSystem.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+namespace
+{
+	using namespace toy;
+	using Clock = std::chrono::steady_clock;
+
+	constexpr s64 steadyGapNs = 2000;
+	constexpr int burstLen = 512;
+	constexpr s64 burstIdleNs = 1000 * 1000;
+	constexpr s64 stallNs = 2000ll * 1000 * 1000; //no task run for that long, the rest is lost
+
+	int taskNum = 20000;
+
+	inline s64 nowNs()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			Clock::now().time_since_epoch()).count();
+	}
+
+	enum LoadKind
+	{
+		LOAD_STEADY,
+		LOAD_BURST,
+		LOAD_FLOOD,
+		LOAD_KIND_NUM,
+	};
+	const char* loadNames[LOAD_KIND_NUM] = { "steady", "burst", "flood" };
+
+	enum BodyKind
+	{
+		BODY_EMPTY,
+		BODY_WORK, //a few hundred ns of integer math and a 256 bytes buffer
+		BODY_KIND_NUM,
+	};
+	const char* bodyNames[BODY_KIND_NUM] = { "empty", "work" };
+
+	struct BenchItem
+	{
+		u32 id; //producer * taskNum + index
+		u32 body; //BodyKind
+		s64 pushNs;
+	};
+
+	/* What the tasks of one run report to, every task writes its own slots */
+	struct Sink
+	{
+		std::unique_ptr<std::atomic<u32>[]> runNums;
+		std::unique_ptr<float[]> latencyNs;
+		std::atomic<u32> doneNum{ 0 };
+		u32 total;
+
+		explicit Sink(u32 taskTotal)
+			: runNums(new std::atomic<u32>[taskTotal]), latencyNs(new float[taskTotal]), total(taskTotal)
+		{
+			for (u32 i = 0; i != total; ++i)
+			{
+				runNums[i].store(0, std::memory_order_relaxed);
+				latencyNs[i] = 0.0f;
+			}
+		}
+	};
+
+	void runItem(Sink& sink, const BenchItem& item)
+	{
+		s64 begin = nowNs();
+		if (BODY_WORK == item.body)
+		{
+			u8 buf[256];
+			u32 state = item.id * 0x9E3779B9u + 1;
+			for (int i = 0; i != 256; ++i)
+			{
+				state ^= state << 13;
+				state ^= state >> 17;
+				state ^= state << 5;
+				buf[i] = static_cast<u8>(state);
+			}
+			u32 sum = 0;
+			for (int i = 0; i != 256; ++i)
+				sum = sum * 31 + buf[(i * 7) & 255];
+			*reinterpret_cast<volatile u32*>(buf) = sum;
+		}
+		if (item.id < sink.total)
+		{
+			sink.latencyNs[item.id] = static_cast<float>(begin - item.pushNs);
+			sink.runNums[item.id].fetch_add(1, std::memory_order_relaxed);
+		}
+		sink.doneNum.fetch_add(1, std::memory_order_release);
+	}
+
+	/* Consumer threads looping on runOne() until stopped */
+	class ConsumerThreads
+	{
+	public:
+		template<typename RunOne>
+		void start(uint consumerNum, RunOne runOne)
+		{
+			m_stop.store(false, std::memory_order_relaxed);
+			for (uint i = 0; i != consumerNum; ++i)
+			{
+				m_threads.emplace_back([this, runOne]()
+				{
+					uint idleNum = 0;
+					while (!m_stop.load(std::memory_order_acquire))
+					{
+						if (runOne())
+							idleNum = 0;
+						else if (++idleNum < 64)
+							cpuRelax();
+						else
+							std::this_thread::yield();
+					}
+				});
+			}
+		}
+		void stop()
+		{
+			m_stop.store(true, std::memory_order_release);
+			for (auto& thread : m_threads)
+				thread.join();
+			m_threads.clear();
+		}
+
+	private:
+		std::vector<IThread> m_threads;
+		std::atomic<bool> m_stop{ false };
+	};
+
+	/* tTaskQueue, the item rides in the quest padding */
+	class TaskQueueAdapter
+	{
+	public:
+		static const char* getName() { return "tTaskQueue<4096>"; }
+
+		void start(uint consumerNum)
+		{
+			m_queue.reset(new tTaskQueue<4096>);
+			m_queue->init();
+			m_consumers.start(consumerNum, [this]() { return m_queue->runOne(); });
+		}
+		void push(Sink& sink, const BenchItem& item)
+		{
+			TaskQuest* quest = m_queue->createQuestWait();
+			quest->tc = [](void* arg) -> ErrNo {
+				auto task = reinterpret_cast<Task*>(arg);
+				runItem(*task->sink, task->item);
+				return TOY_OK;
+			};
+			quest->cb = nullptr;
+			Task* task = reinterpret_cast<Task*>(quest->padding);
+			task->sink = &sink;
+			task->item = item;
+			m_queue->push(quest);
+		}
+		void stop() { m_consumers.stop(); }
+		u64 getFullCount() { return m_queue->getFullCount(); }
+
+	private:
+		struct Task
+		{
+			Sink* sink;
+			BenchItem item;
+		};
+		static_assert(sizeof(Task) <= sizeof(TaskQuest::padding), "task does not fit a quest");
+
+		std::unique_ptr<tTaskQueue<4096>> m_queue;
+		ConsumerThreads m_consumers;
+	};
+
+	/* the bare ring under tTaskQueue, items are copied in and out */
+	class MPMCQueueAdapter
+	{
+	public:
+		static const char* getName() { return "tMPMCQueue<4096>"; }
+
+		void start(uint consumerNum)
+		{
+			m_queue.reset(new tMPMCQueue<Task, 4096>);
+			m_consumers.start(consumerNum, [this]()
+			{
+				Task task;
+				if (!m_queue->tryPop(task))
+					return false;
+				runItem(*task.sink, task.item);
+				return true;
+			});
+		}
+		void push(Sink& sink, const BenchItem& item) { m_queue->pushWait(Task{ &sink, item }); }
+		void stop() { m_consumers.stop(); }
+		u64 getFullCount() { return m_queue->getFullCount(); }
+
+	private:
+		struct Task
+		{
+			Sink* sink;
+			BenchItem item;
+		};
+		std::unique_ptr<tMPMCQueue<Task, 4096>> m_queue;
+		ConsumerThreads m_consumers;
+	};
+
+	/* JobSystem, producers are not workers so tasks go through the injection queue */
+	class JobSystemAdapter
+	{
+	public:
+		static const char* getName() { return "JobSystem"; }
+
+		void start(uint consumerNum)
+		{
+			m_jobs.reset(new JobSystem);
+			ThreadConfig cfg;
+			cfg.workerNum = consumerNum;
+			cfg.reserveMainCore = false;
+			m_jobs->init(cfg);
+			m_fullNum.store(0, std::memory_order_relaxed);
+		}
+		void push(Sink& sink, const BenchItem& item)
+		{
+			Sink* to = &sink;
+			if (m_jobs->pushTask([to, item]() { runItem(*to, item); }))
+				return;
+			m_fullNum.fetch_add(1, std::memory_order_relaxed);
+			while (!m_jobs->pushTask([to, item]() { runItem(*to, item); }))
+				std::this_thread::yield();
+		}
+		void stop()
+		{
+			m_jobs->destroy();
+			m_jobs.reset();
+		}
+		u64 getFullCount() { return m_fullNum.load(std::memory_order_relaxed); }
+
+	private:
+		std::unique_ptr<JobSystem> m_jobs;
+		std::atomic<u64> m_fullNum{ 0 };
+	};
+
+	struct Result
+	{
+		double mtaskPerSec;
+		double p50Us, p99Us, p999Us, maxUs;
+		u32 lostNum;
+		u32 dupNum;
+		u64 fullNum;
+	};
+
+	template<typename Push>
+	void producerLoop(int producerIdx, LoadKind load, BodyKind body, Push&& push)
+	{
+		BenchItem item;
+		item.body = body;
+		s64 next = nowNs();
+		for (int i = 0; i != taskNum; ++i)
+		{
+			if (LOAD_STEADY == load)
+			{
+				next += steadyGapNs;
+				while (nowNs() < next)
+					cpuRelax();
+			}
+			else if (LOAD_BURST == load && i && 0 == i % burstLen)
+			{
+				next = nowNs() + burstIdleNs;
+				while (nowNs() < next)
+					std::this_thread::yield();
+			}
+			item.id = static_cast<u32>(producerIdx * taskNum + i);
+			item.pushNs = nowNs();
+			push(item);
+		}
+	}
+
+	float percentile(std::vector<float>& values, double p)
+	{
+		if (values.empty())
+			return 0.0f;
+		size_t idx = std::min(values.size() - 1, static_cast<size_t>(values.size() * p));
+		std::nth_element(values.begin(), values.begin() + idx, values.end());
+		return values[idx];
+	}
+
+	template<typename Adapter>
+	Result runBench(Adapter& queue, uint consumerNum, int producerNum, LoadKind load, BodyKind body)
+	{
+		Sink sink(static_cast<u32>(producerNum * taskNum));
+		queue.start(consumerNum);
+
+		std::atomic<int> ready{ 0 };
+		std::atomic<bool> go{ false };
+		std::vector<IThread> producers;
+		for (int p = 0; p != producerNum; ++p)
+		{
+			producers.emplace_back([&, p]()
+			{
+				ready.fetch_add(1);
+				while (!go.load(std::memory_order_acquire))
+					;
+				producerLoop(p, load, body, [&](const BenchItem& item) { queue.push(sink, item); });
+			});
+		}
+		while (ready.load() != producerNum)
+			;
+		s64 begin = nowNs();
+		go.store(true, std::memory_order_release);
+
+		/* wait for every task, give up when none runs for stallNs */
+		u32 lastDone = 0;
+		s64 lastProgress = begin;
+		s64 end = begin;
+		for (;;)
+		{
+			u32 done = sink.doneNum.load(std::memory_order_acquire);
+			s64 now = nowNs();
+			if (done >= sink.total)
+			{
+				end = now;
+				break;
+			}
+			if (done != lastDone)
+			{
+				lastDone = done;
+				lastProgress = now;
+			}
+			else if (now - lastProgress > stallNs)
+			{
+				end = lastProgress;
+				break;
+			}
+			std::this_thread::yield();
+		}
+		for (auto& producer : producers)
+			producer.join();
+		queue.stop();
+
+		Result r;
+		r.lostNum = 0;
+		r.dupNum = 0;
+		std::vector<float> latencies;
+		latencies.reserve(sink.total);
+		for (u32 i = 0; i != sink.total; ++i)
+		{
+			u32 runNum = sink.runNums[i].load(std::memory_order_relaxed);
+			if (0 == runNum)
+				++r.lostNum;
+			else
+			{
+				if (runNum > 1)
+					++r.dupNum;
+				latencies.push_back(sink.latencyNs[i]);
+			}
+		}
+		double sec = (end - begin) * 1e-9;
+		r.mtaskPerSec = sec > 0.0 ? (sink.total - r.lostNum) / sec * 1e-6 : 0.0;
+		r.p50Us = percentile(latencies, 0.5) * 1e-3;
+		r.p99Us = percentile(latencies, 0.99) * 1e-3;
+		r.p999Us = percentile(latencies, 0.999) * 1e-3;
+		r.maxUs = latencies.empty() ? 0.0 : *std::max_element(latencies.begin(), latencies.end()) * 1e-3;
+		r.fullNum = queue.getFullCount();
+		return r;
+	}
+
+	void printHeader(const char* title, uint consumerNum)
+	{
+		printf("\n== %s, %d tasks per producer, %u consumers ==\n", title, taskNum, consumerNum);
+		printf("%-7s %-6s %5s %9s %9s %9s %9s %9s %7s %5s %9s\n",
+			"load", "body", "prod", "Mtask/s", "p50 us", "p99 us", "p99.9 us", "max us",
+			"lost", "dup", "full");
+	}
+	void printResult(LoadKind load, BodyKind body, int producerNum, const Result& r)
+	{
+		printf("%-7s %-6s %5d %9.3f %9.2f %9.2f %9.2f %9.1f %7u %5u %9llu\n",
+			loadNames[load], bodyNames[body], producerNum, r.mtaskPerSec,
+			r.p50Us, r.p99Us, r.p999Us, r.maxUs, r.lostNum, r.dupNum,
+			(unsigned long long)r.fullNum);
+	}
+
+	template<typename Adapter>
+	bool benchQueue(int maxProducerNum, uint consumerNum)
+	{
+		printHeader(Adapter::getName(), consumerNum);
+		bool ok = true;
+		Adapter queue;
+		for (int l = 0; l != LOAD_KIND_NUM; ++l)
+		{
+			for (int b = 0; b != BODY_KIND_NUM; ++b)
+			{
+				for (int producerNum = 1; producerNum <= maxProducerNum; producerNum *= 2)
+				{
+					Result r = runBench(queue, consumerNum, producerNum,
+						static_cast<LoadKind>(l), static_cast<BodyKind>(b));
+					printResult(static_cast<LoadKind>(l), static_cast<BodyKind>(b), producerNum, r);
+					ok = ok && 0 == r.lostNum && 0 == r.dupNum;
+				}
+			}
+		}
+		return ok;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	int maxProducerNum = argc > 1 ? std::atoi(argv[1]) : 32;
+	if (maxProducerNum < 1)
+		maxProducerNum = 1;
+	if (argc > 2 && std::atoi(argv[2]) > 0)
+		taskNum = std::atoi(argv[2]);
+	uint consumerNum = argc > 3 && std::atoi(argv[3]) > 0 ? std::atoi(argv[3]) : 4;
+
+	io::Logger::setLogLevel(io::Logger::LOG_WARNING);
+
+	bool ok = benchQueue<TaskQueueAdapter>(maxProducerNum, consumerNum);
+	ok = benchQueue<MPMCQueueAdapter>(maxProducerNum, consumerNum) && ok;
+	ok = benchQueue<JobSystemAdapter>(maxProducerNum, consumerNum) && ok;
+	if (!ok)
+		printf("\ntasks were lost or run twice\n");
+	return ok ? 0 : 1;
+}
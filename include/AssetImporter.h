@@ -2,6 +2,7 @@
 #include "Types.h"
 #include "IRenderDriver.h"
 #include "Memory.h"
+#include "Coroutine.h"
 
 namespace Assimp
 {
@@ -106,10 +107,6 @@ namespace toy
 				u32 rotKeyNum = 0;
 				u32 scaleKeyNum = 0;
 
-				u32 lastTransKey = 0;
-				u32 lastScaleKey = 0;
-				u32 lastRotKey = 0;
-
 				/* pointers to keyData */
 				double *positionKeyTimes = nullptr;//time points, not always begin with 0
 				fvec3 *positionKeys = nullptr;
@@ -122,9 +119,9 @@ namespace toy
 
 				u16 nodeIndex;//index of skeleton.skeletonNodes
 
-				void calcInterpolatedRotation(double time, fquat* out);
-				void calcInterpolatedTranslation(double time, fvec3 *out);
-				void calcInterpolatedScaling(double time, fvec3 *out);
+				void calcInterpolatedRotation(double time, fquat* out) const;
+				void calcInterpolatedTranslation(double time, fvec3 *out) const;
+				void calcInterpolatedScaling(double time, fvec3 *out) const;
 			};
 			double ticksPerSecond = 0.0;
 			double duration = 0.0;//duration of this animation in ticks
@@ -145,9 +142,18 @@ namespace toy
 	class AssetImporter
 	{
 	public:
-		void init(IRenderDriver* rdr);
+		/* meshes are converted on jobs if it is not nullptr */
+		void init(IRenderDriver* rdr, JobSystem* jobs = nullptr);
 		void destroy();
 
+		JobSystem* getJobSystem() { return m_jobs; }
+#if TOY_COROUTINES
+		/* the importer holds one model at a time, a coroutine loading a model
+		   holds it from openModel3D() until its meshes are uploaded, as
+		   positions and normals of the loaded model point into that model */
+		AsyncMutex& getModelLock() { return m_modelLock; }
+#endif
+
 		rd::TBO loadImage2D(const void* fileData, size_t fileSize, const char* suffix);
 
 		//return number of meshes, dataSize is a rough size of model data
@@ -168,6 +174,8 @@ namespace toy
 		//release space allocated for this model, only need to call for last model
 		void closeModel3D();
 
+		/* keeps no state, instances of the same prefab may be animated
+		   by several threads at once */
 		void calcSkelAnimMatrices(
 			AssetModel::Skeleton* skel,//skaleton related to anims
 			AssetModel::SkeletalAnimation* anims,//animation related to skel
@@ -180,6 +188,10 @@ namespace toy
 	private:
 		AssetModel m_model;
 		IRenderDriver* m_rdr;
+		JobSystem* m_jobs = nullptr;
 		Assimp::Importer* m_aImporter;
+#if TOY_COROUTINES
+		AsyncMutex m_modelLock;
+#endif
 	};
 }
\ No newline at end of file
@@ -0,0 +1,331 @@
+#pragma once
+#include "Types.h"
+#include "IThread.h"
+#include "JobSystem.h"
+
+#include <deque>
+#include <exception>
+#include <utility>
+
+/* C++20 coroutines, or the coroutine TS of VS2017 (/await),
+   TOY_COROUTINES is 0 and nothing below is declared without them */
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#include <coroutine>
+#define TOY_COROUTINES 1
+namespace toy { namespace coro = std; }
+#elif defined(_RESUMABLE_FUNCTIONS_SUPPORTED)
+#include <experimental/coroutine>
+#define TOY_COROUTINES 1
+namespace toy { namespace coro = std::experimental; }
+#else
+#define TOY_COROUTINES 0
+#endif
+
+#if TOY_COROUTINES
+namespace toy
+{
+	template<typename T>
+	class CoTask;
+
+	class CoPromiseBase
+	{
+	public:
+		/* the frame stays until the CoTask is dropped, whoever awaits
+		   the task goes on on the thread that finished it */
+		struct FinalAwaiter
+		{
+			bool await_ready() noexcept { return false; }
+			template<typename Promise>
+			void await_suspend(coro::coroutine_handle<Promise> h) noexcept
+			{
+				CoPromiseBase& promise = h.promise();
+				auto next = promise.m_continuation;
+				promise.m_done.done();
+				/* the frame may be gone from here */
+				if (next)
+					next.resume();
+			}
+			void await_resume() noexcept {}
+		};
+
+		CoPromiseBase() { m_done.add(); }
+
+		coro::suspend_always initial_suspend() noexcept { return {}; }
+		FinalAwaiter final_suspend() noexcept { return {}; }
+		void unhandled_exception() { m_exception = std::current_exception(); }
+
+		bool isDone() const { return m_done.isDone(); }
+		const JobCounter& getDoneCounter() const { return m_done; }
+		void setContinuation(coro::coroutine_handle<> next) { m_continuation = next; }
+
+	protected:
+		void rethrow()
+		{
+			if (m_exception)
+				std::rethrow_exception(m_exception);
+		}
+
+	private:
+		JobCounter m_done;
+		coro::coroutine_handle<> m_continuation;
+		std::exception_ptr m_exception;
+	};
+
+	template<typename T>
+	class CoPromise : public CoPromiseBase
+	{
+	public:
+		CoTask<T> get_return_object();
+		template<typename U>
+		void return_value(U&& value) { m_value = std::forward<U>(value); }
+
+		T& getValue() { rethrow(); return m_value; }
+		T takeValue() { rethrow(); return std::move(m_value); }
+
+	private:
+		T m_value{};
+	};
+
+	template<>
+	class CoPromise<void> : public CoPromiseBase
+	{
+	public:
+		CoTask<void> get_return_object();
+		void return_void() {}
+
+		void getValue() { rethrow(); }
+		void takeValue() { rethrow(); }
+	};
+
+	/* Coroutine returning T, move only. It starts suspended and runs when
+	   it is awaited by another coroutine, or by start() or wait().
+	   Inside, co_await toWorker(jobs) and co_await toMainThread(jobs)
+	   move it between workers and the main thread, so a pipeline of file
+	   reads, decoding and GL uploads reads top to bottom.
+	   Any number of them may be in flight, the frame is freed with the CoTask */
+	template<typename T>
+	class CoTask
+	{
+	public:
+		using promise_type = CoPromise<T>;
+		using Handle = coro::coroutine_handle<promise_type>;
+
+		struct Awaiter
+		{
+			Handle handle;
+
+			bool await_ready() const { return false; }
+			void await_suspend(coro::coroutine_handle<> awaiting)
+			{
+				handle.promise().setContinuation(awaiting);
+				handle.resume();
+			}
+			T await_resume() { return handle.promise().takeValue(); }
+		};
+
+		CoTask() = default;
+		explicit CoTask(Handle handle) : m_handle(handle) {}
+		CoTask(CoTask&& v) : m_handle(v.m_handle), m_started(v.m_started) { v.m_handle = nullptr; }
+		CoTask& operator=(CoTask&& v)
+		{
+			if (this != &v)
+			{
+				reset();
+				m_handle = v.m_handle;
+				m_started = v.m_started;
+				v.m_handle = nullptr;
+			}
+			return *this;
+		}
+		CoTask(const CoTask&) = delete;
+		~CoTask() { reset(); }
+
+		bool isValid() const { return static_cast<bool>(m_handle); }
+		bool isDone() const { assert(m_handle); return m_handle.promise().isDone(); }
+
+		/* run on the calling thread until the first suspension */
+		void start()
+		{
+			assert(m_handle && !m_started);
+			m_started = true;
+			m_handle.resume();
+		}
+		/* start if needed, then help jobs, and the main thread mailbox
+		   on the main thread, until the coroutine is done */
+		void wait(JobSystem& jobs)
+		{
+			if (!m_started)
+				start();
+			jobs.wait(m_handle.promise().getDoneCounter());
+		}
+		/* valid while the task lives, rethrow what the coroutine threw */
+		template<typename U = T>
+		typename std::enable_if<!std::is_void<U>::value, U&>::type get()
+		{
+			assert(isDone());
+			return m_handle.promise().getValue();
+		}
+
+		Awaiter operator co_await()
+		{
+			assert(m_handle && !m_started && "a task is awaited once, not after start()");
+			m_started = true;
+			return Awaiter{ m_handle };
+		}
+
+		/* a started task must be done before it is dropped */
+		void reset()
+		{
+			if (m_handle)
+			{
+				assert((!m_started || m_handle.promise().isDone()) && "coroutine still running");
+				m_handle.destroy();
+				m_handle = nullptr;
+			}
+		}
+
+	private:
+		Handle m_handle = nullptr;
+		bool m_started = false;
+	};
+
+	template<typename T>
+	inline CoTask<T> CoPromise<T>::get_return_object()
+	{
+		return CoTask<T>(CoTask<T>::Handle::from_promise(*this));
+	}
+	inline CoTask<void> CoPromise<void>::get_return_object()
+	{
+		return CoTask<void>(CoTask<void>::Handle::from_promise(*this));
+	}
+
+	/* co_await it to go on as a quest of jobs, on the calling thread if no quest is free */
+	class WorkerAwaiter
+	{
+	public:
+		explicit WorkerAwaiter(JobSystem& jobs) : m_jobs(jobs) {}
+
+		bool await_ready() const { return false; }
+		bool await_suspend(coro::coroutine_handle<> h)
+		{
+			return m_jobs.pushTask([h]() { h.resume(); });
+		}
+		void await_resume() const {}
+
+	private:
+		JobSystem& m_jobs;
+	};
+	inline WorkerAwaiter toWorker(JobSystem& jobs) { return WorkerAwaiter(jobs); }
+
+	/* co_await it to go on in the main thread mailbox, see JobSystem::drainMainThread() */
+	class MainThreadAwaiter
+	{
+	public:
+		explicit MainThreadAwaiter(JobSystem& jobs) : m_jobs(jobs) {}
+
+		bool await_ready() const { return m_jobs.isMainThread(); }
+		void await_suspend(coro::coroutine_handle<> h)
+		{
+			m_jobs.postToMainThread([h]() { h.resume(); });
+		}
+		void await_resume() const {}
+
+	private:
+		JobSystem& m_jobs;
+	};
+	inline MainThreadAwaiter toMainThread(JobSystem& jobs) { return MainThreadAwaiter(jobs); }
+
+	/* Lock of coroutines, a coroutine that finds it held is suspended
+	   instead of blocking its thread, unlock() hands the lock to the
+	   first one waiting and resumes it as a quest of jobs.
+	   auto guard = co_await mutex.lock(); */
+	class AsyncMutex
+	{
+	public:
+		/* unlocks when dropped, move only */
+		class Guard
+		{
+		public:
+			explicit Guard(AsyncMutex* mutex) : m_mutex(mutex) {}
+			Guard(Guard&& v) : m_mutex(v.m_mutex) { v.m_mutex = nullptr; }
+			Guard(const Guard&) = delete;
+			~Guard() { unlock(); }
+			void unlock()
+			{
+				if (m_mutex)
+				{
+					m_mutex->unlock();
+					m_mutex = nullptr;
+				}
+			}
+		private:
+			AsyncMutex* m_mutex;
+		};
+
+		class LockAwaiter
+		{
+		public:
+			explicit LockAwaiter(AsyncMutex& mutex) : m_mutex(mutex) {}
+			bool await_ready() { return m_mutex.tryLock(); }
+			bool await_suspend(coro::coroutine_handle<> h) { return m_mutex.lockOrQueue(h); }
+			Guard await_resume() { return Guard(&m_mutex); }
+		private:
+			AsyncMutex& m_mutex;
+		};
+
+		/* waiters are resumed on the unlocking thread if jobs is nullptr */
+		explicit AsyncMutex(JobSystem* jobs = nullptr) : m_jobs(jobs) {}
+		AsyncMutex(const AsyncMutex&) = delete;
+
+		void setJobSystem(JobSystem* jobs) { m_jobs = jobs; }
+		LockAwaiter lock() { return LockAwaiter(*this); }
+		bool tryLock()
+		{
+			std::lock_guard<IMutex> lock(m_mutex);
+			if (m_locked.load(std::memory_order_relaxed))
+				return false;
+			m_locked.store(true, std::memory_order_relaxed);
+			return true;
+		}
+		void unlock()
+		{
+			coro::coroutine_handle<> next;
+			{
+				std::lock_guard<IMutex> lock(m_mutex);
+				assert(m_locked.load(std::memory_order_relaxed));
+				if (m_waiters.empty())
+				{
+					m_locked.store(false, std::memory_order_relaxed);
+					return;
+				}
+				next = m_waiters.front();
+				m_waiters.pop_front();
+			}
+			/* the lock stays held, it is handed to next */
+			if (nullptr == m_jobs || !m_jobs->pushTask([next]() { next.resume(); }))
+				next.resume();
+		}
+		/* only a hint while coroutines lock it */
+		bool isLocked() const { return m_locked.load(std::memory_order_relaxed); }
+
+	private:
+		/* return false if the lock was taken */
+		bool lockOrQueue(coro::coroutine_handle<> h)
+		{
+			std::lock_guard<IMutex> lock(m_mutex);
+			if (!m_locked.load(std::memory_order_relaxed))
+			{
+				m_locked.store(true, std::memory_order_relaxed);
+				return false;
+			}
+			m_waiters.push_back(h);
+			return true;
+		}
+
+		IMutex m_mutex;
+		std::atomic<bool> m_locked{ false };
+		std::deque<coro::coroutine_handle<>> m_waiters;
+		JobSystem* m_jobs;
+	};
+}
+#endif //TOY_COROUTINES
@@ -21,4 +21,18 @@
 #define CACHELINESIZE 32 //32 bytes
 #else
 #error("Platform not supported yet")
-#endif
\ No newline at end of file
+#endif
+
+#define MAXTHREADNUM 32 //threads owning a private slot in per-thread caches, 64 max
+#define ALLOCATORSTATS 1 //0 to compile out the usage counters of allocators
+/* 1 to put scene stacks on 2MB pages, see STACK_HUGEPAGE. Scene stacks reserve
+   4GB, more than VirtualRange::maxPinnedSize, so they use transparent huge pages
+   committed in 2MB steps, a stack then holds up to 2MB more than it uses
+   at each end and the OS may split or not give the huge pages */
+#define SCENEHUGEPAGES 0
+/* address space of the scratch stack of every thread, see getScratchStack(),
+   256MB or 16MB on 32 bits, where every worker reserving 256MB runs out of it */
+#define SCRATCHSTACKSIZE ((size_t)1 << (sizeof(void*) == 8 ? 28 : 24))
+#define SCENECOMPACTBYTES (256 * 1024) //bytes of prefab data a scene moves per frame at most
+#define MAINTHREADBUDGETUS 2000 //microseconds a frame gives to callbacks posted to the main thread
+#define THREADPINNING 1 //0 to let the OS place the main and worker threads, see ThreadConfig
@@ -227,8 +227,13 @@ namespace toy
 
 		virtual void clearFramebuffer() = 0;
 
+		/* Scratch memory for one frame, rotated by endFrame() */
+		void setFrameAllocator(FrameAllocator* frameAllocator) { m_frameAllocator = frameAllocator; }
+		FrameAllocator* getFrameAllocator() { return m_frameAllocator; }
+
 	protected:
 		IShaderProgram* (m_shaderProgs)[20] = { nullptr };
+		FrameAllocator* m_frameAllocator = nullptr;
 	};
 }
 
@@ -1,49 +1,262 @@
 #pragma once
 #include "EngineConfig.h"
+#include "Types.h"
 
-#if defined(_MSC_VER) && _MSC_VER >= 1900
 #include <mutex>
 #include <thread>
-#endif
-
 #include <atomic>
 #include <condition_variable>
 #include <chrono>
 
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TOY_CPU_X86
+#endif
+
+#ifdef _WIN32
+#pragma comment(lib, "Synchronization.lib") //WaitOnAddress
+#elif defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 namespace toy
 {
 	using ThreadFunc = unsigned long(*)(void*);
 
-	//DO NOT use this, it's just a toy
-	class ToySpinLock
+	/* tell the core the thread is in a busy wait loop */
+	inline void cpuRelax()
+	{
+#ifdef TOY_CPU_X86
+		_mm_pause();
+#else
+		std::this_thread::yield();
+#endif
+	}
+
+	/* sleep on a 32 bits word of the address space, the OS only parks
+	   the thread if the word still holds the expected value */
+	namespace futex
+	{
+		/* may return without a wake */
+		inline void wait(std::atomic<u32>* addr, u32 expected)
+		{
+#ifdef _WIN32
+			WaitOnAddress(reinterpret_cast<volatile void*>(addr), &expected, sizeof(u32), INFINITE);
+#elif defined(__linux__)
+			syscall(SYS_futex, reinterpret_cast<u32*>(addr), FUTEX_WAIT_PRIVATE, expected,
+				nullptr, nullptr, 0);
+#else
+			if (addr->load(std::memory_order_relaxed) == expected)
+				std::this_thread::yield();
+#endif
+		}
+		inline void wakeOne(std::atomic<u32>* addr)
+		{
+#ifdef _WIN32
+			WakeByAddressSingle(reinterpret_cast<void*>(addr));
+#elif defined(__linux__)
+			syscall(SYS_futex, reinterpret_cast<u32*>(addr), FUTEX_WAKE_PRIVATE, 1,
+				nullptr, nullptr, 0);
+#else
+			(void)addr;
+#endif
+		}
+	}
+
+	/* The engine lock. An uncontended lock() is one CAS, a contended one
+	   spins with exponential backoff of pause instructions, which is
+	   enough for the short sections of allocators and queues, then parks
+	   on a futex so long waits do not burn cores.
+	   State is 0 unlocked, 1 locked, 2 locked and a thread may be parked,
+	   unlock() only calls the OS in state 2.
+	   Times the lock was found held and times a thread parked are counted */
+	class AdaptiveMutex
 	{
 	public:
-		ToySpinLock() : m_lock{ATOMIC_FLAG_INIT} {}
-		void lock() { while (m_lock.test_and_set(std::memory_order_acquire)); }
-		bool try_lock() { return m_lock.test_and_set(std::memory_order_acquire); }
-		void unlock() { m_lock.clear(std::memory_order_release); }
+		static constexpr uint maxBackoff = 64; //pauses of the last spin round
+
+		AdaptiveMutex() = default;
+		AdaptiveMutex(const AdaptiveMutex&) = delete;
+
+		void lock()
+		{
+			u32 state = 0;
+			if (!m_state.compare_exchange_strong(state, 1,
+				std::memory_order_acquire, std::memory_order_relaxed))
+				lockContended();
+		}
+		bool try_lock()
+		{
+			u32 state = 0;
+			return m_state.compare_exchange_strong(state, 1,
+				std::memory_order_acquire, std::memory_order_relaxed);
+		}
+		void unlock()
+		{
+			if (2 == m_state.exchange(0, std::memory_order_release))
+				futex::wakeOne(&m_state);
+		}
+
+		u64 getContendedCount() const { return m_contendedNum.load(std::memory_order_relaxed); }
+		u64 getParkCount() const { return m_parkNum.load(std::memory_order_relaxed); }
+		void resetCounts()
+		{
+			m_contendedNum.store(0, std::memory_order_relaxed);
+			m_parkNum.store(0, std::memory_order_relaxed);
+		}
+
 	private:
-		std::atomic_flag m_lock;
+		void lockContended()
+		{
+			m_contendedNum.fetch_add(1, std::memory_order_relaxed);
+			/* spinning only helps when the holder runs on another core */
+			static const bool spin = std::thread::hardware_concurrency() != 1;
+			for (uint backoff = 1; spin && backoff <= maxBackoff; backoff <<= 1)
+			{
+				for (uint i = 0; i != backoff; ++i)
+					cpuRelax();
+				u32 state = m_state.load(std::memory_order_relaxed);
+				if (0 == state && m_state.compare_exchange_weak(state, 1,
+					std::memory_order_acquire, std::memory_order_relaxed))
+					return;
+			}
+			/* from here the state stays 2 while the lock is held,
+			   whoever gets the lock this way also wakes the next */
+			if (0 == m_state.exchange(2, std::memory_order_acquire))
+				return;
+			m_parkNum.fetch_add(1, std::memory_order_relaxed);
+			do
+			{
+				futex::wait(&m_state, 2);
+			} while (0 != m_state.exchange(2, std::memory_order_acquire));
+		}
+
+		std::atomic<u32> m_state{ 0 };
+		std::atomic<u64> m_contendedNum{ 0 };
+		std::atomic<u64> m_parkNum{ 0 };
 	};
-#ifdef _WIN32
 
-#if _MSC_VER >= 1900
-	using IMutex = std::mutex;
-	using IThread = std::thread;
-#else
-	class IMutex
+	/* Dense index of the calling thread in [0, MAXTHREADNUM),
+	   the index is given back when the thread exits so it can be reused.
+	   Threads beyond MAXTHREADNUM get MAXTHREADNUM, callers must
+	   take a shared slow path for them.
+	   Whoever caches data per index adds a release hook, it runs on the
+	   exiting thread before the index can be taken by another thread */
+	class ThreadSlot
 	{
 	public:
-		IMutex(){ InitializeCriticalSection(&m_mutex); }
-		~IMutex() { DeleteCriticalSection(&m_mutex); }
-		void lock() { EnterCriticalSection(&m_mutex); }
-		bool try_lock() { return TryEnterCriticalSection(&m_mutex); }
-		void unlock() { LeaveCriticalSection(&m_mutex); }
+		static_assert(MAXTHREADNUM <= 64, "ThreadSlot uses a 64 bits mask");
+		using ReleaseFunc = void(*)(void* user, unsigned int index);
+
+		static unsigned int getIndex()
+		{
+			thread_local ThreadSlot slot;
+			return slot.m_index;
+		}
+		static void addReleaseHook(ReleaseFunc func, void* user);
+		/* once it returns the hook of user is not running and won't run */
+		static void removeReleaseHook(void* user);
 
 	private:
-		CRITICAL_SECTION m_mutex;
+		ThreadSlot()
+		{
+			auto& mask = usedMask();
+			u64 used = mask.load(std::memory_order_relaxed);
+			do
+			{
+				m_index = 0;
+				while (m_index != MAXTHREADNUM && (used & (1ULL << m_index)))
+					++m_index;
+				if (MAXTHREADNUM == m_index)
+					return;
+			} while (!mask.compare_exchange_weak(used, used | (1ULL << m_index),
+				std::memory_order_acquire, std::memory_order_relaxed));
+		}
+		~ThreadSlot()
+		{
+			if (MAXTHREADNUM != m_index)
+			{
+				runReleaseHooks(m_index);
+				usedMask().fetch_and(~(1ULL << m_index), std::memory_order_release);
+			}
+		}
+		static void runReleaseHooks(unsigned int index);
+		static std::atomic<u64>& usedMask()
+		{
+			static std::atomic<u64> mask{ 0 };
+			return mask;
+		}
+		unsigned int m_index;
 	};
-	
+	using IMutex = AdaptiveMutex;
+
+	/* Where the main thread and the workers of a JobSystem run */
+	struct ThreadConfig
+	{
+		uint workerNum = 0; //0 means one per physical core (spreadCores) or logical processor left
+		bool pin = THREADPINNING != 0; //bind every thread to one logical processor
+		bool reserveMainCore = true; //no worker on the physical core of the main thread
+		bool spreadCores = true; //one worker per physical core before SMT siblings get one
+		const char* name = "ToyWorker"; //workers are named name0, name1...
+	};
+
+	/* Logical processors the process may run on, grouped by physical core.
+	   Detected once, from the affinity mask of the process and
+	   GetLogicalProcessorInformationEx or /sys/devices/system/cpu.
+	   On Windows only the processor group of the process is seen.
+	   When detection fails every logical processor is its own core
+	   and isDetected() is false, threads are not pinned then */
+	class CpuTopology
+	{
+	public:
+		static constexpr uint maxCpuNum = 256;
+
+		static const CpuTopology& get();
+
+		bool isDetected() const { return m_detected; }
+		uint getCpuNum() const { return m_cpuNum; }
+		uint getCoreNum() const { return m_coreNum; }
+		/* logical processor ids of a core, SMT siblings */
+		const u16* getCoreCpus(uint core, uint& num) const
+		{
+			assert(core < m_coreNum);
+			num = m_coreBegin[core + 1] - m_coreBegin[core];
+			return m_cpus + m_coreBegin[core];
+		}
+
+		/* choose the logical processors of the main thread and workers,
+		   -1 leaves a thread to the OS, return the number of workers */
+		uint layout(const ThreadConfig& cfg, s32& mainCpu, s32* workerCpus, uint maxWorkerNum) const;
+
+	private:
+		CpuTopology();
+		CpuTopology(const CpuTopology&) = delete;
+		/* fill the cores from the OS, false if it can't tell */
+		bool detect();
+
+		u16 m_cpus[maxCpuNum]; //logical processor ids, core by core
+		u16 m_coreBegin[maxCpuNum + 1]; //cpus of core i are m_cpus[m_coreBegin[i], m_coreBegin[i+1])
+		uint m_cpuNum = 0;
+		uint m_coreNum = 0;
+		bool m_detected = false;
+	};
+
+	/* settings of the calling thread */
+	namespace thisThread
+	{
+		/* shown by debuggers and profilers, 15 characters are kept on Linux */
+		bool setName(const char* name);
+		/* run only on logical processor cpu */
+		bool pin(uint cpu);
+	}
+
+#ifdef _WIN32
+
+#if _MSC_VER >= 1900
+	using IThread = std::thread;
+#else
 	class IThread
 	{
 	public:
@@ -67,10 +280,6 @@ namespace toy
 #endif //_MSC_VER >= 1900
 	
 #else //_WIN32
-#pragma message("Unsupported os, using std namespace.")
-#include <mutex>
-#include <thread>
-	using IMutex = std::mutex;
 	using IThread = std::thread;
 #endif //_WIN32
 }
\ No newline at end of file
@@ -0,0 +1,643 @@
+#pragma once
+#include "Types.h"
+#include "IThread.h"
+#include "TaskQueue.h"
+#include "Memory.h"
+
+#include <vector>
+#include <type_traits>
+
+namespace toy
+{
+	/* Chase-Lev work-stealing deque of a fixed length.
+	   push() and pop() work on the bottom and are called by the owner only,
+	   steal() takes from the top and may be called by any thread.
+	!! len MUST be power of 2 */
+	template<int len = 4096>
+	class tWorkStealingDeque
+	{
+	public:
+		static_assert(len > 0 && 0 == (len & (len - 1)), "len MUST be power of 2");
+
+		/* return false if the deque is full */
+		bool push(TaskQuest* quest)
+		{
+			s64 b = m_bottom.load(std::memory_order_relaxed);
+			s64 t = m_top.load(std::memory_order_acquire);
+			if (b - t >= len)
+				return false;
+			m_buf[b & (len - 1)].store(quest, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+			m_bottom.store(b + 1, std::memory_order_relaxed);
+			return true;
+		}
+		TaskQuest* pop()
+		{
+			s64 b = m_bottom.load(std::memory_order_relaxed) - 1;
+			m_bottom.store(b, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			s64 t = m_top.load(std::memory_order_relaxed);
+			if (t > b)
+			{
+				m_bottom.store(b + 1, std::memory_order_relaxed);
+				return nullptr; //empty
+			}
+			TaskQuest* quest = m_buf[b & (len - 1)].load(std::memory_order_relaxed);
+			if (t == b)
+			{
+				/* the last one, race against thieves */
+				if (!m_top.compare_exchange_strong(t, t + 1,
+					std::memory_order_seq_cst, std::memory_order_relaxed))
+					quest = nullptr;
+				m_bottom.store(b + 1, std::memory_order_relaxed);
+			}
+			return quest;
+		}
+		/* return nullptr if empty or another thread won the race */
+		TaskQuest* steal()
+		{
+			s64 t = m_top.load(std::memory_order_acquire);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			s64 b = m_bottom.load(std::memory_order_acquire);
+			if (t >= b)
+				return nullptr;
+			TaskQuest* quest = m_buf[t & (len - 1)].load(std::memory_order_relaxed);
+			if (!m_top.compare_exchange_strong(t, t + 1,
+				std::memory_order_seq_cst, std::memory_order_relaxed))
+				return nullptr;
+			return quest;
+		}
+		bool empty() const
+		{
+			return m_top.load(std::memory_order_acquire) >=
+				m_bottom.load(std::memory_order_acquire);
+		}
+
+	private:
+		alignas(CACHELINESIZE) std::atomic<s64> m_top{ 0 };
+		alignas(CACHELINESIZE) std::atomic<s64> m_bottom{ 0 };
+		alignas(CACHELINESIZE) std::atomic<TaskQuest*> m_buf[len];
+	};
+
+	class JobSystem;
+
+	/* State shared by a task of JobSystem::submit() and its TaskFuture,
+	   from the small object pool, freed when both have let it go */
+	class TaskStateBase
+	{
+	public:
+		explicit TaskStateBase(JobSystem* jobs) : m_jobs(jobs) { m_done.add(); }
+		TaskStateBase(const TaskStateBase&) = delete;
+
+		JobSystem* getJobSystem() const { return m_jobs; }
+		bool isDone() const { return m_done.isDone(); }
+		/* the calling thread helps until the task has run */
+		void wait() const;
+
+		void addRef() { m_refNum.fetch_add(1, std::memory_order_relaxed); }
+		void release()
+		{
+			if (1 == m_refNum.fetch_sub(1, std::memory_order_acq_rel))
+				m_destroy(this);
+		}
+		/* quest pushed when the task has run, return false if it has run already */
+		bool setNext(TaskQuest* quest)
+		{
+			TaskQuest* expected = nullptr;
+			if (m_next.compare_exchange_strong(expected, quest, std::memory_order_acq_rel))
+				return true;
+			assert(getDoneMark() == expected && "only one continuation a task");
+			return false;
+		}
+
+	protected:
+		using DestroyFunc = void(*)(TaskStateBase* state);
+		static TaskQuest* getDoneMark() { return reinterpret_cast<TaskQuest*>(alignof(TaskQuest)); }
+		/* after the result is stored */
+		void finish();
+
+		DestroyFunc m_destroy = nullptr;
+
+	private:
+		JobSystem* m_jobs;
+		JobCounter m_done;
+		std::atomic<u32> m_refNum{ 1 };
+		std::atomic<TaskQuest*> m_next{ nullptr };//continuation, getDoneMark() once done
+	};
+
+	/* result type of a continuation of a task returning T */
+	template<typename T, typename Func>
+	struct tThenResult { using type = decltype(std::declval<Func&>()(std::declval<T&>())); };
+	template<typename Func>
+	struct tThenResult<void, Func> { using type = decltype(std::declval<Func&>()()); };
+
+	template<typename T>
+	class tTaskState : public TaskStateBase
+	{
+	public:
+		static tTaskState* create(JobSystem* jobs)
+		{
+			static_assert(sizeof(tTaskState) <= SmallObjectAllocator::maxSmallSize,
+				"return big results by pointer");
+			return newObject<tTaskState>(jobs);
+		}
+		explicit tTaskState(JobSystem* jobs) : TaskStateBase(jobs)
+		{
+			m_destroy = [](TaskStateBase* state) { deleteObject(static_cast<tTaskState*>(state)); };
+		}
+		~tTaskState()
+		{
+			if (isDone())
+				getValue().~T();
+		}
+
+		template<typename Func>
+		void run(Func&& fn)
+		{
+			::new (m_value) T(fn());
+			finish();
+		}
+		template<typename Func>
+		typename tThenResult<T, Func>::type apply(Func& fn) { return fn(getValue()); }
+		T& getValue() { return *reinterpret_cast<T*>(m_value); }
+
+	private:
+		alignas(T) u8 m_value[sizeof(T)];
+	};
+
+	template<>
+	class tTaskState<void> : public TaskStateBase
+	{
+	public:
+		static tTaskState* create(JobSystem* jobs) { return newObject<tTaskState>(jobs); }
+		explicit tTaskState(JobSystem* jobs) : TaskStateBase(jobs)
+		{
+			m_destroy = [](TaskStateBase* state) { deleteObject(static_cast<tTaskState*>(state)); };
+		}
+
+		template<typename Func>
+		void run(Func&& fn)
+		{
+			fn();
+			finish();
+		}
+		template<typename Func>
+		typename tThenResult<void, Func>::type apply(Func& fn) { return fn(); }
+	};
+
+	/* Handle of the result of JobSystem::submit(), move only.
+	   get() and wait() help with other jobs until the task has run,
+	   then() chains a task on the result without blocking */
+	template<typename T>
+	class TaskFuture
+	{
+	public:
+		TaskFuture() = default;
+		explicit TaskFuture(tTaskState<T>* state) : m_state(state) {}
+		TaskFuture(TaskFuture&& v) : m_state(v.m_state) { v.m_state = nullptr; }
+		TaskFuture& operator=(TaskFuture&& v)
+		{
+			if (this != &v)
+			{
+				reset();
+				m_state = v.m_state;
+				v.m_state = nullptr;
+			}
+			return *this;
+		}
+		TaskFuture(const TaskFuture&) = delete;
+		~TaskFuture() { reset(); }
+
+		bool isValid() const { return nullptr != m_state; }
+		bool isReady() const { assert(m_state); return m_state->isDone(); }
+		void wait() const { assert(m_state); m_state->wait(); }
+		/* valid while the future lives */
+		template<typename U = T>
+		typename std::enable_if<!std::is_void<U>::value, U&>::type get()
+		{
+			wait();
+			return m_state->getValue();
+		}
+		/* push fn(result), fn() for void tasks, when this task has run,
+		   a task takes one continuation */
+		template<typename Func>
+		TaskFuture<typename tThenResult<T, Func>::type> then(Func&& fn);
+
+		/* drop the result, the task runs anyway */
+		void reset()
+		{
+			if (m_state)
+			{
+				m_state->release();
+				m_state = nullptr;
+			}
+		}
+
+	private:
+		tTaskState<T>* m_state = nullptr;
+	};
+
+	/* Work-stealing job system. Every worker thread owns a deque,
+	   quests pushed by a worker go to its own deque, quests pushed by
+	   other threads (or from a worker whose deque is full) go to the bounded
+	   injection queue, when that is full too the quest runs in place.
+	   An idle worker takes from
+	   its deque, then the injection queue, then steals from random victims.
+	   It spins a while before it parks on a condition variable.
+	   Quests are submitted like tTaskQueue ones:
+	   createQuest(), fill tc/cb/padding, push(),
+	   set counter before push() to wait for a group of quests with wait().
+	   Callables are submitted with pushTask() or submit(), they are stored
+	   in the quest when they fit, in the small object pool otherwise.
+	   The thread calling init() is the main thread, cb of quests flagged
+	   QUEST_MAIN_THREAD_CB and tasks of postToMainThread() wait in a mailbox
+	   until it calls drainMainThread(), so GL uploads follow work done by workers */
+	class JobSystem
+	{
+	public:
+		static constexpr uint questNum = 16384;
+		static constexpr int injectLen = 4096;
+		static constexpr uint spinNum = 256; //rounds an idle worker looks for work before parking
+
+		struct WorkerStats
+		{
+			u64 runNum; //quests run
+			u64 stealNum; //quests stolen from other workers
+			u64 parkNum; //times the worker went to sleep
+			u64 busyNs; //time spent in quests
+			u64 wallNs; //time since the stats were reset
+			s32 cpu; //logical processor the worker is pinned to, -1 if none
+		};
+
+		JobSystem() = default;
+		JobSystem(const JobSystem&) = delete;
+		~JobSystem() { destroy(); }
+
+		/* workerNum 0 lets the topology choose, see ThreadConfig */
+		void init(uint workerNum = 0);
+		/* the calling thread becomes the main thread, it is pinned and its
+		   core left to it when cfg asks for that */
+		void init(const ThreadConfig& cfg);
+		void destroy();
+
+		/* return nullptr if all quests are in use */
+		TaskQuest* createQuest();
+		void push(TaskQuest* quest);
+		/* the calling thread helps until every pushed quest had run */
+		void waitAll();
+		/* the calling thread helps until counter drops to 0 */
+		void wait(const JobCounter& counter);
+		/* run one pushed quest on the calling thread, return false if none was found,
+		   the main thread takes from the mailbox too when there is nothing else */
+		bool helpOne();
+
+		/* run fn() on the main thread in drainMainThread(), may be called by any thread */
+		template<typename Func>
+		void postToMainThread(Func&& fn, JobCounter* counter = nullptr)
+		{
+			TaskQuest* quest;
+			while (nullptr == (quest = createQuest()))
+			{
+				if (!helpOne())
+					std::this_thread::yield();
+			}
+			if (!bindTask(quest, std::forward<Func>(fn)))
+			{
+				freeQuest(quest);
+				assert(0 && "out of memory");
+				return;
+			}
+			quest->cb = quest->tc;
+			quest->tc = nullptr;
+			quest->flags |= QUEST_MAIN_THREAD_CB;
+			quest->counter = counter;
+			m_pendingNum.fetch_add(1, std::memory_order_relaxed);
+			if (counter)
+				counter->add();
+			postMain(quest);
+		}
+		/* run the mailbox of the main thread until it is empty or budgetNs
+		   is used up, return the number of callbacks run */
+		uint drainMainThread(s64 budgetNs);
+		bool isMainThread() const { return std::this_thread::get_id() == m_mainThreadId; }
+
+		/* push fn() as a quest, return false and leave fn alone if no quest is free */
+		template<typename Func>
+		bool pushTask(Func&& fn, JobCounter* counter = nullptr)
+		{
+			auto quest = createQuest();
+			if (nullptr == quest)
+				return false;
+			if (!bindTask(quest, std::forward<Func>(fn)))
+			{
+				freeQuest(quest);
+				return false;
+			}
+			quest->counter = counter;
+			push(quest);
+			return true;
+		}
+		/* push fn() and return the future of its result,
+		   fn runs in place if no quest is free */
+		template<typename Func>
+		TaskFuture<decltype(std::declval<Func&>()())> submit(Func&& fn)
+		{
+			using Result = decltype(std::declval<Func&>()());
+			auto state = tTaskState<Result>::create(this);
+			assert(state);
+			state->addRef();//one for the task, one for the future
+			auto task = [state, fn = std::forward<Func>(fn)]() mutable {
+				state->run(fn);
+				state->release();
+			};
+			if (!pushTask(std::move(task)))
+				task();
+			return TaskFuture<Result>(state);
+		}
+		/* push task() when prev has run, used by TaskFuture::then() */
+		template<typename Func>
+		void pushAfter(TaskStateBase* prev, Func&& task)
+		{
+			auto quest = createQuest();
+			if (quest && !bindTask(quest, std::forward<Func>(task)))
+			{
+				freeQuest(quest);
+				quest = nullptr;
+			}
+			if (nullptr == quest)
+			{
+				prev->wait();
+				task();
+				return;
+			}
+			if (!prev->setNext(quest))
+				push(quest);
+		}
+
+		/* Call fn(first, last) over [begin, end) in subranges of at most grain
+		   indices, return when the whole range is done.
+		   The calling thread works through the range itself, it splits half
+		   of what is left into a quest only when the quests it split before
+		   were taken by other threads (lazy binary splitting), so the range
+		   spreads as fast as workers are idle and costs about a plain loop
+		   when they are busy. With a single hardware thread it is a plain loop */
+		template<typename Func>
+		void parallelFor(uint begin, uint end, uint grain, const Func& fn)
+		{
+			if (0 == grain)
+				grain = 1;
+			if (end <= begin)
+				return;
+			if (end - begin <= grain || isSerial())
+			{
+				for (uint last; begin != end; begin = last)
+				{
+					last = end - begin > grain ? begin + grain : end;
+					fn(begin, last);
+				}
+				return;
+			}
+			JobCounter counter;
+			ForRange<Func> range = { &fn, grain, &counter };
+			runForRange(range, begin, end);
+			wait(counter);
+		}
+
+		uint getWorkerNum() const { return static_cast<uint>(m_workers.size()); }
+		/* no worker or no other hardware thread to run them */
+		bool isSerial() const { return m_workers.empty() || 1 == m_hwThreadNum; }
+		/* index of the calling worker, getWorkerNum() for other threads */
+		uint getWorkerIndex() const;
+
+		void getWorkerStats(uint workerIdx, WorkerStats& stats) const;
+		void resetStats();
+		/* log utilisation of every worker */
+		void dumpStats(io::Logger::LogLevel level = io::Logger::LOG_INFO) const;
+
+	private:
+		struct alignas(CACHELINESIZE) Worker
+		{
+			tWorkStealingDeque<> deque;
+			IThread thread;
+			s32 cpu; //logical processor the worker is pinned to, -1 if the OS places it
+			u32 rndState;
+			std::atomic<u64> runNum{ 0 };
+			std::atomic<u64> stealNum{ 0 };
+			std::atomic<u64> parkNum{ 0 };
+			std::atomic<u64> busyNs{ 0 };
+		};
+
+		template<typename Func>
+		struct ForRange
+		{
+			const Func* fn;
+			uint grain;
+			JobCounter* counter;
+		};
+		template<typename Func>
+		void runForRange(ForRange<Func>& range, uint begin, uint end)
+		{
+			while (begin != end)
+			{
+				if (end - begin > range.grain && isSplitDemanded())
+				{
+					uint mid = begin + (end - begin) / 2;
+					if (pushTask([this, &range, mid, end]() { runForRange(range, mid, end); },
+						range.counter))
+						end = mid;
+				}
+				uint last = end - begin > range.grain ? begin + range.grain : end;
+				(*range.fn)(begin, last);
+				begin = last;
+			}
+		}
+		/* the quests split by the calling thread before were taken */
+		bool isSplitDemanded() const;
+
+		/* store fn in quest, return false if the pool is out of memory */
+		template<typename Func>
+		static bool bindTask(TaskQuest* quest, Func&& fn)
+		{
+			using Task = typename std::decay<Func>::type;
+			return bindTask<Task>(quest, std::forward<Func>(fn),
+				std::integral_constant<bool, sizeof(Task) <= sizeof(TaskQuest::padding) &&
+				alignof(Task) <= alignof(TaskQuest*)>());
+		}
+		template<typename Task, typename Func>
+		static bool bindTask(TaskQuest* quest, Func&& fn, std::true_type /*inline*/)
+		{
+			::new (quest->padding) Task(std::forward<Func>(fn));
+			quest->tc = [](void* arg) -> ErrNo {
+				auto task = reinterpret_cast<Task*>(arg);
+				(*task)();
+				task->~Task();
+				return TOY_OK;
+			};
+			return true;
+		}
+		template<typename Task, typename Func>
+		static bool bindTask(TaskQuest* quest, Func&& fn, std::false_type /*pooled*/)
+		{
+			static_assert(sizeof(Task) <= SmallObjectAllocator::maxSmallSize,
+				"capture less, the task would go to the heap");
+			static_assert(alignof(Task) <= 16, "over-aligned task");
+			void* buf = alloc(sizeof(Task));
+			if (nullptr == buf)
+				return false;
+			*reinterpret_cast<Task**>(quest->padding) = ::new (buf) Task(std::forward<Func>(fn));
+			quest->tc = [](void* arg) -> ErrNo {
+				auto task = *reinterpret_cast<Task**>(arg);
+				(*task)();
+				task->~Task();
+				free(task, sizeof(Task));
+				return TOY_OK;
+			};
+			return true;
+		}
+		void freeQuest(TaskQuest* quest) { m_quests->freeUnit(quest); }
+		/* queue a quest whose cb is left for the main thread */
+		void postMain(TaskQuest* quest);
+		/* give a quest back once tc and cb have run */
+		void finishQuest(TaskQuest* quest);
+
+		void workerLoop(uint workerIdx);
+		void runQuest(TaskQuest* quest, Worker* worker);
+		TaskQuest* popInjected();
+		TaskQuest* stealFrom(uint thiefIdx, u32& rndState);
+		bool hasWork() const;
+		void wakeWorker();
+
+		std::vector<Worker*> m_workers;
+		std::atomic<bool> m_running{ false };
+		std::atomic<s64> m_pendingNum{ 0 }; //pushed quests not done yet
+
+		tMPMCQueue<TaskQuest*, injectLen> m_injected;
+		tMPMCQueue<TaskQuest*, questNum> m_mainQuests;//never full, there are only questNum quests
+		std::thread::id m_mainThreadId;
+
+		std::mutex m_parkMutex;
+		std::condition_variable m_parkCond;
+		std::atomic<uint> m_sleeperNum{ 0 };
+
+		u8* m_questBuffer = nullptr;
+		tPoolAllocator_LockFree<TaskQuest>* m_quests = nullptr;
+		s64 m_statsBegin = 0; //steady clock ns
+		uint m_hwThreadNum = 0;
+		char m_threadName[16];
+	};
+
+	inline void TaskStateBase::wait() const
+	{
+		m_jobs->wait(m_done);
+	}
+
+	inline void TaskStateBase::finish()
+	{
+		m_done.done();
+		TaskQuest* next = m_next.exchange(getDoneMark(), std::memory_order_acq_rel);
+		if (next)
+			m_jobs->push(next);
+	}
+
+	template<typename T>
+	template<typename Func>
+	TaskFuture<typename tThenResult<T, Func>::type> TaskFuture<T>::then(Func&& fn)
+	{
+		using Result = typename tThenResult<T, Func>::type;
+		assert(m_state);
+		auto jobs = m_state->getJobSystem();
+		auto next = tTaskState<Result>::create(jobs);
+		assert(next);
+		next->addRef();//one for the task, one for the future
+		m_state->addRef();//the task reads the result
+		auto prev = m_state;
+		jobs->pushAfter(prev, [prev, next, fn = std::forward<Func>(fn)]() mutable {
+			next->run([prev, &fn]() { return prev->apply(fn); });
+			next->release();
+			prev->release();
+		});
+		return TaskFuture<Result>(next);
+	}
+
+	/* Dependency graph of the jobs of a frame. Nodes are added with the
+	   dependencies between them, run() pushes every node whose
+	   predecessors are done, the last predecessor to finish pushes its
+	   successors. Nodes flagged NODE_MAIN_THREAD only run on the thread
+	   calling run(), which helps with the other jobs meanwhile.
+	   Every node records when and on which thread it ran, the critical
+	   path is found backwards from the last node to finish through the
+	   predecessor that released each node */
+	class TaskGraph
+	{
+	public:
+		using NodeFunc = void(*)(void* arg, uint index);
+		using NodeId = u16;
+		static constexpr NodeId invalidNode = 0xFFFF;
+		static constexpr uint maxNodeNum = 128;
+		static constexpr uint maxSuccessorNum = 16;
+
+		enum NodeFlag
+		{
+			NODE_ANY_THREAD = 0,
+			NODE_MAIN_THREAD = bit(0),//GL calls, OS messages
+		};
+
+		struct NodeTrace
+		{
+			const char* name;
+			uint thread;//worker index, JobSystem::getWorkerNum() for the main thread
+			s64 beginNs;//from the beginning of run()
+			s64 endNs;
+			NodeId releasedBy;//the predecessor finished last, invalidNode for roots
+		};
+
+		TaskGraph() = default;
+		TaskGraph(const TaskGraph&) = delete;
+
+		/* remove every node, call it before building the graph of a new frame */
+		void clear() { m_nodeNum = 0; }
+		/* return invalidNode if the graph is full, func(arg, index) is called */
+		NodeId addNode(const char* name, NodeFunc func, void* arg,
+			uint index = 0, u32 flags = NODE_ANY_THREAD);
+		/* after runs when before is done */
+		void addDependency(NodeId before, NodeId after);
+
+		/* return when every node is done */
+		void run(JobSystem& jobs);
+
+		uint getNodeNum() const { return m_nodeNum; }
+		const NodeTrace& getTrace(NodeId node) const { assert(node < m_nodeNum); return m_nodes[node].trace; }
+		s64 getRunNs() const { return m_runNs; }
+		/* nodes of the critical path of the last run(), from the first one,
+		   return the node number of the whole path, path is cut at maxNum */
+		uint getCriticalPath(NodeId* path, uint maxNum) const;
+		/* log every node of the last run() ordered by begin time, '*' marks the critical path */
+		void dumpTrace(io::Logger::LogLevel level = io::Logger::LOG_INFO) const;
+
+	private:
+		struct Node
+		{
+			const char* name;
+			NodeFunc func;
+			void* arg;
+			uint index;
+			u32 flags;
+			u32 depNum;
+			u32 succNum;
+			NodeId succs[maxSuccessorNum];
+			std::atomic<u32> waitNum;//predecessors not done yet
+			NodeTrace trace;
+		};
+		void submit(NodeId node);
+		void execute(NodeId node);
+
+		Node m_nodes[maxNodeNum];
+		uint m_nodeNum = 0;
+		JobSystem* m_jobs = nullptr;
+		uint m_mainThread = 0;//worker index of the thread calling run()
+		tMPMCQueue<NodeId, maxNodeNum> m_mainNodes;
+		std::atomic<uint> m_doneNum{ 0 };
+		s64 m_runBegin = 0;
+		s64 m_runNs = 0;
+	};
+}
@@ -1,6 +1,9 @@
 #pragma once
 #include <cassert>
 #include <new>
+#include <utility>
+#include <vector>
+#include <type_traits>
 
 #include "Types.h"
 #include "IThread.h"
@@ -8,13 +11,143 @@
 
 namespace toy
 {
+	/* Usage counters of one allocator, updated by the allocator itself
+	   and reported by AllocatorRegistry. Counters are relaxed atomics,
+	   so a report taken while other threads allocate may be a bit torn */
+	struct AllocatorStats
+	{
+		enum Side
+		{
+			SIDE_L, //left end of a double end stack, or the only one
+			SIDE_R, //right end of a double end stack
+		};
+
+		const char* name = nullptr;
+		const char* kind = nullptr;
+		std::atomic<size_t> capacity{ 0 }; //bytes
+		std::atomic<size_t> committedSize{ 0 }; //bytes backed by memory, capacity unless reserved
+		std::atomic<size_t> usedSize[2] = { { 0 }, { 0 } }; //bytes in use of every side
+		std::atomic<size_t> highWater{ 0 };
+		std::atomic<u64> allocNum{ 0 };
+		std::atomic<u64> freeNum{ 0 };
+		std::atomic<u64> failedNum{ 0 };
+		std::atomic<size_t> budget{ 0 }; //0 means no budget
+		std::atomic<bool> overBudget{ false }; //warned once, reset by setBudget()
+		const IMutex* lock = nullptr; //contention of the allocator lock, nullptr if it has none
+
+		inline void onAlloc(size_t size, Side side = SIDE_L)
+		{
+#if ALLOCATORSTATS
+			allocNum.fetch_add(1, std::memory_order_relaxed);
+			usedSize[side].fetch_add(size, std::memory_order_relaxed);
+			checkUsedSize();
+#endif
+		}
+		inline void onFree(size_t size, Side side = SIDE_L)
+		{
+#if ALLOCATORSTATS
+			freeNum.fetch_add(1, std::memory_order_relaxed);
+			usedSize[side].fetch_sub(size, std::memory_order_relaxed);
+#endif
+		}
+		inline void onFailed()
+		{
+#if ALLOCATORSTATS
+			failedNum.fetch_add(1, std::memory_order_relaxed);
+#endif
+		}
+		/* for allocators which know the used size rather than every block */
+		inline void setUsedSize(size_t size, Side side = SIDE_L)
+		{
+#if ALLOCATORSTATS
+			usedSize[side].store(size, std::memory_order_relaxed);
+			checkUsedSize();
+#endif
+		}
+		inline size_t getUsedSize() const
+		{
+			return usedSize[SIDE_L].load(std::memory_order_relaxed) +
+				usedSize[SIDE_R].load(std::memory_order_relaxed);
+		}
+
+	private:
+		inline void checkUsedSize()
+		{
+			size_t used = getUsedSize();
+			size_t peak = highWater.load(std::memory_order_relaxed);
+			while (used > peak && !highWater.compare_exchange_weak(
+				peak, used, std::memory_order_relaxed));
+			size_t limit = budget.load(std::memory_order_relaxed);
+			if (limit && used > limit)
+				warnOverBudget(used, limit);
+		}
+		void warnOverBudget(size_t used, size_t limit);
+	};
+
+	/* Engine wide list of live allocators. Every allocator adds its
+	   AllocatorStats on construction and removes them on destruction.
+	   Budgets are kept by name, so they also apply to allocators
+	   created after setBudget() */
+	class AllocatorRegistry
+	{
+	public:
+		struct Record
+		{
+			char name[32];
+			const char* kind;
+			size_t capacity;
+			size_t committedSize;
+			size_t usedSizeL;
+			size_t usedSizeR;
+			size_t highWater;
+			size_t budget;
+			u64 allocNum;
+			u64 freeNum;
+			u64 failedNum;
+			u64 lockContendedNum;
+			u64 lockParkNum;
+		};
+
+		void add(AllocatorStats* stats, const char* name, const char* kind, size_t capacity);
+		void remove(AllocatorStats* stats);
+
+		/* budget in bytes of allocators named name, 0 to remove it */
+		void setBudget(const char* name, size_t budget);
+		/* copy at most maxNum records, return the number of live allocators */
+		uint snapshot(Record* out, uint maxNum) const;
+		void dump(io::Logger::LogLevel level = io::Logger::LOG_INFO) const;
+
+	private:
+		struct Budget
+		{
+			char name[32];
+			size_t budget;
+		};
+		size_t findBudget(const char* name) const;
+
+		std::vector<AllocatorStats*> m_allocators;
+		std::vector<Budget> m_budgets;
+		mutable IMutex m_mutex;
+	};
+
+	/* never deleted, allocators may be destroyed during static destruction */
+	AllocatorRegistry& getAllocatorRegistry();
+
+	/* Pool allocator over a caller buffer of getBufferSize(unitNum) bytes.
+	   Units are threaded into the free list lazily, the first time they
+	   are handed out, so construction and clear() are O(1) */
 	template <typename UnitType>
 	class tPoolAllocator
 	{
 	public:
+		static constexpr size_t getBufferSize(size_t unitNum)
+		{
+			return sizeof(PoolUnit) * unitNum + 16; //16 is alignment
+		}
+
 		tPoolAllocator() = delete;
 		tPoolAllocator(void* buffer, size_t unitNum, const char* name = nullptr) :
-			m_poolSize(sizeof(UnitType)*unitNum)
+			m_poolSize(sizeof(PoolUnit)*unitNum), m_unitNum(unitNum)
 		{
 			size_t poolSize = m_poolSize + 16; //16 is alignment
 			size_t rawAddr = reinterpret_cast<size_t>(buffer);
@@ -23,17 +156,15 @@ namespace toy
 			u8* temp = reinterpret_cast<u8*>(m_poolBottom) - 1;
 			*temp = adjustment;
 
-			m_availFstUnit = reinterpret_cast<PoolUnit*>(m_poolBottom);
-			for (size_t i = 0; i != unitNum - 2; ++i)
-			{
-				m_availFstUnit[i].m_next = &m_availFstUnit[i + 1];
-			}
-			m_availFstUnit[unitNum - 1].m_next = nullptr;
+			m_availFstUnit = nullptr;
+			m_touchedNum = 0;
 
 			str::strnCpy(m_name, sizeof(m_name),
 				name ? name : "PoolAllocator", sizeof(m_name) - 1);
 			m_name[sizeof(m_name) - 1] = '\0';
-			io::log(io::LogLevel::LOG_INFO,
+			m_stats.lock = &m_mutex;
+			getAllocatorRegistry().add(&m_stats, m_name, "Pool", m_poolSize);
+			io::Logger::log(io::Logger::LOG_INFO,
 				"%s construct %li bytes buffer for pool\n", m_name, poolSize);
 		}
 		~tPoolAllocator()
@@ -41,39 +172,48 @@ namespace toy
 			//u8* temp = reinterpret_cast<u8*>(m_poolBottom);
 			//u8 adjustment = *(temp - 1);
 			//delete[] (temp - adjustment);
-			io::log(io::LogLevel::LOG_INFO,
+			getAllocatorRegistry().remove(&m_stats);
+			io::Logger::log(io::Logger::LOG_INFO,
 				"%s destruct %li bytes buffer for pool\n", m_name, m_poolSize + 16);
 		}
+		/* return nullptr if the pool is exhausted */
 		void* allocUnit()
 		{
 			m_mutex.lock();
 			PoolUnit* r = m_availFstUnit;
-			m_availFstUnit = m_availFstUnit->m_next;
+			if (r)
+				m_availFstUnit = r->m_next;
+			else if (m_touchedNum != m_unitNum)
+				r = reinterpret_cast<PoolUnit*>(m_poolBottom) + m_touchedNum++;
 			m_mutex.unlock();
+			if (r)
+				m_stats.onAlloc(sizeof(PoolUnit));
+			else
+				m_stats.onFailed();
 			return r;
 		}
 		void freeUnit(void* unitPtr)
 		{
 			assert(((size_t)unitPtr - (size_t)m_poolBottom) % sizeof(PoolUnit) == 0 &&
 				(size_t)unitPtr >= (size_t)m_poolBottom &&
-				(size_t)unitPtr <= (size_t)m_poolBottom + m_poolSize);
-			reinterpret_cast<PoolUnit*>(unitPtr)->m_next = m_availFstUnit;
+				(size_t)unitPtr < (size_t)m_poolBottom + m_poolSize);
 			m_mutex.lock();
+			reinterpret_cast<PoolUnit*>(unitPtr)->m_next = m_availFstUnit;
 			m_availFstUnit = reinterpret_cast<PoolUnit*>(unitPtr);
 			m_mutex.unlock();
+			m_stats.onFree(sizeof(PoolUnit));
 		}
 		void clear()
 		{
-			auto unitNum = m_poolSize / sizeof(PoolUnit);
 			m_mutex.lock();
-			m_availFstUnit = reinterpret_cast<PoolUnit*>(m_poolBottom);
-			for (size_t i = 0; i != unitNum - 1; ++i)
-			{
-				m_availFstUnit[i].m_next = &m_availFstUnit[i + 1];
-			}
-			m_availFstUnit[unitNum - 1].m_next = nullptr;
+			m_availFstUnit = nullptr;
+			m_touchedNum = 0;
 			m_mutex.unlock();
+			m_stats.setUsedSize(0);
 		}
+
+		size_t getCapacity() const { return m_unitNum; }
+		size_t getTouchedNum() const { return m_touchedNum; }
 	private:
 		struct PoolUnit
 		{
@@ -82,63 +222,590 @@ namespace toy
 		};
 		void* m_poolBottom;
 		const size_t m_poolSize;
+		const size_t m_unitNum;
+		size_t m_touchedNum; //units in [0, m_touchedNum) had been handed out
 		PoolUnit* m_availFstUnit;
 
 		IMutex m_mutex;
+		AllocatorStats m_stats;
 		char m_name[32];
 	};
 
-	/* Double end stack allocator */
+	/* Lock-free pool allocator, same buffer contract as tPoolAllocator.
+	   Every thread owns a magazine (a short chain of free units plus a
+	   range of never used units), allocUnit()/freeUnit() only touch it.
+	   Magazines move between threads through the depot, a stack of
+	   magazines whose head is tagged by a counter to avoid ABA.
+	   Stats count whole magazines leaving and entering the shared pool,
+	   so units cached by threads are reported as in use */
+	template <typename UnitType, u32 magSize = 32>
+	class tPoolAllocator_LockFree
+	{
+	public:
+		static constexpr size_t getBufferSize(size_t unitNum)
+		{
+			return sizeof(PoolUnit) * unitNum + 16; //16 is alignment
+		}
+
+		tPoolAllocator_LockFree() = delete;
+		tPoolAllocator_LockFree(void* buffer, size_t unitNum, const char* name = nullptr) :
+			m_unitNum(static_cast<u32>(unitNum)),
+			m_poolSize(sizeof(PoolUnit)*unitNum)
+		{
+			static_assert(magSize > 0, "magSize can't be 0");
+			assert(unitNum < InvalidIdx);
+
+			size_t rawAddr = reinterpret_cast<size_t>(buffer);
+			u8 adjustment = 16 - (rawAddr & 15);
+			m_units = reinterpret_cast<PoolUnit*>(rawAddr + adjustment);
+			u8* temp = reinterpret_cast<u8*>(m_units) - 1;
+			*temp = adjustment;
+
+			clear();
+
+			str::strnCpy(m_name, sizeof(m_name),
+				name ? name : "LockFreePoolAllocator", sizeof(m_name) - 1);
+			m_name[sizeof(m_name) - 1] = '\0';
+			m_stats.lock = &m_sharedLock;
+			getAllocatorRegistry().add(&m_stats, m_name, "LockFreePool", m_poolSize);
+			ThreadSlot::addReleaseHook(onSlotReleased, this);
+			io::Logger::log(io::Logger::LOG_INFO,
+				"%s construct %li bytes buffer for pool\n", m_name, m_poolSize + 16);
+		}
+		~tPoolAllocator_LockFree()
+		{
+			ThreadSlot::removeReleaseHook(this);
+			getAllocatorRegistry().remove(&m_stats);
+			io::Logger::log(io::Logger::LOG_INFO,
+				"%s destruct %li bytes buffer for pool\n", m_name, m_poolSize + 16);
+		}
+		/* return nullptr if the pool is exhausted */
+		void* allocUnit()
+		{
+			auto index = ThreadSlot::getIndex();
+			if (MAXTHREADNUM == index)
+			{
+				m_sharedLock.lock();
+				void* r = allocFrom(m_sharedMag);
+				m_sharedLock.unlock();
+				return r;
+			}
+			return allocFrom(m_mags[index]);
+		}
+		void freeUnit(void* unitPtr)
+		{
+			assert(((size_t)unitPtr - (size_t)m_units) % sizeof(PoolUnit) == 0 &&
+				(size_t)unitPtr >= (size_t)m_units &&
+				(size_t)unitPtr < (size_t)m_units + m_poolSize);
+			auto index = ThreadSlot::getIndex();
+			if (MAXTHREADNUM == index)
+			{
+				m_sharedLock.lock();
+				freeTo(m_sharedMag, unitPtr);
+				m_sharedLock.unlock();
+				return;
+			}
+			freeTo(m_mags[index], unitPtr);
+		}
+		/* Give the free units cached by the calling thread back to the depot,
+		   call it before a thread stops using this pool for a long time */
+		void flushThreadCache()
+		{
+			auto index = ThreadSlot::getIndex();
+			if (MAXTHREADNUM == index)
+				return;
+			flushMagazine(m_mags[index]);
+		}
+		/* NOT thread-safe, no other thread may use the pool meanwhile */
+		void clear()
+		{
+			for (auto& mag : m_mags)
+				mag = Magazine();
+			m_sharedMag = Magazine();
+			m_depot.store(InvalidIdx, std::memory_order_relaxed);
+			m_bumpIdx.store(0, std::memory_order_release);
+			m_stats.setUsedSize(0);
+		}
+
+	private:
+		static constexpr u32 InvalidIdx = 0xFFFFFFFF;
+		struct PoolUnit
+		{
+			alignas(UnitType) u8 m_data[sizeof(UnitType)]; //Reserve the space
+			u32 m_next; //next unit in the same magazine
+			u32 m_batchLen; //unit number of the magazine, valid at the head only
+			std::atomic<u32> m_batchNext; //next magazine in depot, valid at the head only
+		};
+		struct alignas(CACHELINESIZE) Magazine
+		{
+			u32 head = InvalidIdx; //chain of freed units
+			u32 count = 0;
+			u32 bumpCur = 0; //never used units in [bumpCur, bumpEnd)
+			u32 bumpEnd = 0;
+		};
+
+		void flushMagazine(Magazine& mag)
+		{
+			while (mag.bumpCur != mag.bumpEnd)
+				freeTo(mag, &m_units[mag.bumpCur++]);
+			if (InvalidIdx != mag.head)
+				pushBatch(mag.head, mag.count);
+			mag = Magazine();
+		}
+		/* the next thread of the slot starts with an empty magazine */
+		static void onSlotReleased(void* pool, unsigned int index)
+		{
+			auto self = reinterpret_cast<tPoolAllocator_LockFree*>(pool);
+			self->flushMagazine(self->m_mags[index]);
+		}
+
+		inline u32 indexOf(void* unitPtr)
+		{
+			return static_cast<u32>(reinterpret_cast<PoolUnit*>(unitPtr) - m_units);
+		}
+		inline void* allocFrom(Magazine& mag)
+		{
+			if (InvalidIdx != mag.head)
+			{
+				u32 r = mag.head;
+				mag.head = m_units[r].m_next;
+				--mag.count;
+				return &m_units[r];
+			}
+			if (mag.bumpCur != mag.bumpEnd)
+				return &m_units[mag.bumpCur++];
+			return refill(mag) ? allocFrom(mag) : nullptr;
+		}
+		inline void freeTo(Magazine& mag, void* unitPtr)
+		{
+			if (magSize == mag.count)
+			{
+				pushBatch(mag.head, mag.count);
+				mag.head = InvalidIdx;
+				mag.count = 0;
+			}
+			u32 idx = indexOf(unitPtr);
+			m_units[idx].m_next = mag.head;
+			mag.head = idx;
+			++mag.count;
+		}
+		bool refill(Magazine& mag)
+		{
+			/* reuse freed units first, keep the untouched tail cold */
+			u64 head = m_depot.load(std::memory_order_acquire);
+			while (InvalidIdx != static_cast<u32>(head))
+			{
+				u32 idx = static_cast<u32>(head);
+				u64 next = m_units[idx].m_batchNext.load(std::memory_order_relaxed);
+				next |= ((head >> 32) + 1) << 32;
+				if (m_depot.compare_exchange_weak(head, next,
+					std::memory_order_acquire, std::memory_order_acquire))
+				{
+					mag.head = idx;
+					mag.count = m_units[idx].m_batchLen;
+					m_stats.onAlloc(sizeof(PoolUnit) * mag.count);
+					return true;
+				}
+			}
+
+			u32 begin = m_unitNum;
+			if (m_bumpIdx.load(std::memory_order_relaxed) < m_unitNum)
+				begin = m_bumpIdx.fetch_add(magSize, std::memory_order_relaxed);
+			if (begin >= m_unitNum)
+			{
+				m_stats.onFailed();
+				return false;
+			}
+			mag.bumpCur = begin;
+			mag.bumpEnd = m_unitNum - begin > magSize ? begin + magSize : m_unitNum;
+			m_stats.onAlloc(sizeof(PoolUnit) * (mag.bumpEnd - begin));
+			return true;
+		}
+		void pushBatch(u32 first, u32 count)
+		{
+			auto& unit = m_units[first];
+			unit.m_batchLen = count;
+			u64 head = m_depot.load(std::memory_order_relaxed);
+			u64 newHead;
+			do
+			{
+				unit.m_batchNext.store(static_cast<u32>(head), std::memory_order_relaxed);
+				newHead = (((head >> 32) + 1) << 32) | first;
+			} while (!m_depot.compare_exchange_weak(head, newHead,
+				std::memory_order_release, std::memory_order_relaxed));
+			m_stats.onFree(sizeof(PoolUnit) * count);
+		}
+
+		Magazine m_mags[MAXTHREADNUM];
+		Magazine m_sharedMag; //for threads without a slot
+		IMutex m_sharedLock;
+
+		alignas(CACHELINESIZE) std::atomic<u64> m_depot{ InvalidIdx }; //tag << 32 | unit index
+		alignas(CACHELINESIZE) std::atomic<u32> m_bumpIdx{ 0 };
+
+		PoolUnit* m_units;
+		const u32 m_unitNum;
+		const size_t m_poolSize;
+		AllocatorStats m_stats;
+		char m_name[32];
+	};
+
+	/* How a chunked pool grows when all its units are in use */
+	struct PoolGrowPolicy
+	{
+		enum GrowMode
+		{
+			GROW_NONE,		//never add a chunk after the first one
+			GROW_LINEAR,	//every new chunk has chunkUnitNum units
+			GROW_DOUBLE,	//every new chunk doubles the capacity
+		};
+		GrowMode mode = GROW_DOUBLE;
+		size_t chunkUnitNum = 256; //units of the first chunk
+		size_t maxUnitNum = 0; //capacity limit, 0 means no limit
+		bool throwOnExhausted = false; //throw std::bad_alloc instead of returning nullptr
+	};
+
+	/* Pool allocator made of a chain of chunks (slabs), chunks are newed
+	   when the pool runs out of units. Units of a chunk are threaded into
+	   the free list lazily, the first time they are handed out.
+	   unitSize and unitAlign are given at runtime, see tChunkedPoolAllocator
+	   for the typed version */
+	class ChunkedPoolAllocator
+	{
+	public:
+		ChunkedPoolAllocator() = delete;
+		ChunkedPoolAllocator(const ChunkedPoolAllocator&) = delete;
+		ChunkedPoolAllocator(
+			size_t unitSize, size_t unitAlign,
+			const PoolGrowPolicy& policy = PoolGrowPolicy(),
+			const char* name = nullptr);
+		~ChunkedPoolAllocator();
+
+		/* return nullptr (or throw, see PoolGrowPolicy) if the pool can't grow */
+		void* allocUnit();
+		void freeUnit(void* unitPtr);
+		/* all units become free, chunks are deleted if releaseChunks is true */
+		void clear(bool releaseChunks = false);
+
+		size_t getUnitSize() const { return m_unitStride; }
+		size_t getCapacity() const;
+		size_t getUsedNum() const;
+		size_t getChunkNum() const;
+		const char* getName() const { return m_name; }
+
+	private:
+		struct Chunk
+		{
+			Chunk* next;
+			u8* units;
+			size_t unitNum;
+			size_t touchedNum; //units in [0, touchedNum) had been handed out
+		};
+		struct FreeUnit
+		{
+			FreeUnit* next;
+		};
+		Chunk* newChunk(size_t unitNum);
+		bool grow();
+		bool owns(void* unitPtr) const;
+
+		const size_t m_unitStride;
+		const size_t m_unitAlign;
+		const PoolGrowPolicy m_policy;
+
+		Chunk* m_fstChunk = nullptr;
+		Chunk* m_lastChunk = nullptr;
+		Chunk* m_curChunk = nullptr; //chunk which still has untouched units
+		FreeUnit* m_freeList = nullptr;
+		size_t m_capacity = 0;
+		size_t m_usedNum = 0;
+		size_t m_chunkNum = 0;
+
+		mutable IMutex m_mutex;
+		AllocatorStats m_stats;
+		char m_name[32];
+	};
+
+	template <typename UnitType>
+	class tChunkedPoolAllocator : public ChunkedPoolAllocator
+	{
+	public:
+		tChunkedPoolAllocator(
+			const PoolGrowPolicy& policy = PoolGrowPolicy(),
+			const char* name = nullptr) :
+			ChunkedPoolAllocator(sizeof(UnitType), alignof(UnitType), policy, name)
+		{}
+
+		template<typename... Args>
+		UnitType* newUnit(Args&&... args)
+		{
+			void* unit = allocUnit();
+			return unit ? ::new (unit) UnitType(std::forward<Args>(args)...) : nullptr;
+		}
+		void deleteUnit(UnitType* unit)
+		{
+			if (unit)
+			{
+				unit->~UnitType();
+				freeUnit(unit);
+			}
+		}
+	};
+
+	/* Segregated size-class allocator for small objects,
+	   every class owns a chain of slabs (a ChunkedPoolAllocator),
+	   so objects of the same size stay adjacent in memory.
+	   Blocks bigger than maxSmallSize go to the general heap */
+	class SmallObjectAllocator
+	{
+	public:
+		static constexpr size_t maxSmallSize = 1024;
+		static constexpr size_t slabSize = 64 * 1024;
+		static constexpr uint classNum = 12;
+
+		SmallObjectAllocator(const char* name = nullptr);
+		SmallObjectAllocator(const SmallObjectAllocator&) = delete;
+		~SmallObjectAllocator();
+
+		/* blocks are 16 bytes aligned, size MUST be given back to free() */
+		void* alloc(size_t size);
+		void free(void* ptr, size_t size);
+
+		/* return classNum for sizes served by the general heap */
+		static uint getSizeClass(size_t size)
+		{
+			return size <= maxSmallSize ? sm_classOfSize[(size + 15) >> 4] : classNum;
+		}
+		static size_t getClassSize(uint classIdx) { return sm_classSizes[classIdx]; }
+		const ChunkedPoolAllocator* getClassPool(uint classIdx) const
+		{
+			return m_pools[classIdx];
+		}
+
+	private:
+		static const size_t sm_classSizes[classNum];
+		static const u8 sm_classOfSize[maxSmallSize / 16 + 1];
+		ChunkedPoolAllocator* m_pools[classNum];
+		AllocatorStats m_bigStats; //blocks served by the general heap
+		char m_bigName[32];
+	};
+
+	/* Engine wide front door of SmallObjectAllocator, thread-safe.
+	   Subsystems opt into it instead of new/delete for small objects */
+	SmallObjectAllocator& getSmallObjectAllocator();
+	inline void* alloc(size_t size) { return getSmallObjectAllocator().alloc(size); }
+	inline void free(void* ptr, size_t size) { getSmallObjectAllocator().free(ptr, size); }
+
+	template<typename T, typename... Args>
+	inline T* newObject(Args&&... args)
+	{
+		static_assert(alignof(T) <= 16, "Use new for over-aligned types");
+		void* ptr = alloc(sizeof(T));
+		return ptr ? ::new (ptr) T(std::forward<Args>(args)...) : nullptr;
+	}
+	/* obj MUST be a T, not an object derived from it,
+	   as its size class is told by sizeof(T) */
+	template<typename T>
+	inline void deleteObject(T* obj)
+	{
+		static_assert(!std::has_virtual_destructor<T>::value || std::is_final<T>::value,
+			"deleteObject() can't tell the size of an object deleted through a base");
+		if (obj)
+		{
+			obj->~T();
+			free(obj, sizeof(T));
+		}
+	}
+
+	/* Virtual memory of the OS, sizes and addresses are page aligned */
+	namespace vm
+	{
+		size_t getPageSize();
+		/* reserve address space only, return nullptr on failure */
+		void* reserve(size_t size);
+		bool commit(void* addr, size_t size);
+		void decommit(void* addr, size_t size);
+		void release(void* addr, size_t size);
+
+		/* committed memory on huge pages from the reserved pool of the OS
+		   (MAP_HUGETLB, MEM_LARGE_PAGES), return nullptr if it can't be had */
+		void* reserveHuge(size_t size);
+		/* ask for transparent huge pages, return false if not supported */
+		bool adviseHuge(void* addr, size_t size);
+		/* bytes of [addr, addr + size) the OS backs with huge pages now */
+		size_t getHugePageBytes(void* addr, size_t size);
+	}
+
+	/* Where a stack allocator which owns its space gets it from */
+	enum StackBacking
+	{
+		STACK_HEAP,		//new u8[], committed up front
+		STACK_VIRTUAL,	//reserved address range, pages committed as the tops grow
+		STACK_HUGEPAGE,	//as STACK_VIRTUAL, on 2MB pages when the OS gives them
+	};
+
+	/* Commit bookkeeping of a double end stack in reserved memory.
+	   Pages in [holeBegin, holeEnd) are reserved only, the ones below
+	   are committed for the left end and the ones above for the right end.
+	   A heap stack sets an empty range whose checks never fire */
+	class VirtualRange
+	{
+	public:
+		static constexpr size_t commitGranularity = 64 * 1024;
+		static constexpr size_t hugePageSize = 2 * 1024 * 1024;
+		static constexpr size_t trimSlack = 1024 * 1024; //committed bytes kept beyond a top
+		static constexpr size_t maxPinnedSize = 256 * 1024 * 1024; //largest range put on the huge page pool
+
+		/* return the bottom of the range, nullptr on failure.
+		   With hugePages it tries the huge page pool first, which commits and
+		   pins the whole range, so only ranges up to maxPinnedSize go there.
+		   Then 2MB aligned transparent huge pages committed in 2MB steps */
+		void* reserve(size_t size, AllocatorStats* stats, bool hugePages = false);
+		void release();
+		void setCommitted(void* bottom, size_t size)
+		{
+			m_holeBegin = reinterpret_cast<u8*>(bottom) + size;
+			m_holeEnd = reinterpret_cast<u8*>(bottom);
+		}
+
+		/* false once the hole is closed, every page is committed then */
+		inline bool needCommitL(void* newTopL) const
+		{
+			return m_holeBegin < m_holeEnd && reinterpret_cast<u8*>(newTopL) > m_holeBegin;
+		}
+		inline bool needCommitR(void* newTopR) const
+		{
+			return m_holeBegin < m_holeEnd && reinterpret_cast<u8*>(newTopR) < m_holeEnd;
+		}
+		bool commitL(void* newTopL);
+		bool commitR(void* newTopR);
+		/* left tops up to it and right tops down to it are committed */
+		void* getCommittedEndL() const
+		{
+			return m_holeBegin < m_holeEnd || !m_base ? m_holeBegin : m_base + m_reservedSize;
+		}
+		void* getCommittedBeginR() const
+		{
+			return m_holeBegin < m_holeEnd || !m_base ? m_holeEnd : m_base;
+		}
+		/* give back pages beyond a top, only when more than 2 x slack are unused */
+		void trimL(void* topL, void* topR, size_t slack = trimSlack);
+		void trimR(void* topL, void* topR, size_t slack = trimSlack);
+
+		bool isReserved() const { return nullptr != m_base; }
+		size_t getCommittedSize() const;
+		/* NOT cheap, may read the memory map of the process */
+		size_t getHugePageBytes() const;
+
+	private:
+		void onCommitChanged();
+
+		void* m_mapBase = nullptr; //what the OS returned, m_base may be aligned up
+		size_t m_mapSize = 0;
+		u8* m_base = nullptr;
+		size_t m_reservedSize = 0;
+		size_t m_granularity = commitGranularity;
+		bool m_pinned = false; //on huge page pool, never committed nor decommitted
+		u8* m_holeBegin = nullptr;
+		u8* m_holeEnd = nullptr;
+		AllocatorStats* m_stats = nullptr;
+	};
+
+	/* Double end stack allocator, may be shared by threads.
+	   The tops are offsets packed in one 64 bits word, left in the low
+	   32 bits and right in the high 32 bits, so the size check and the bump
+	   of an allocation are one CAS. Frees, clears and trims, and allocations
+	   that need pages committed, take m_mutex.
+	   Stacks are 4GB at most. */
 	class DE_Allocator
 	{
 	public:
 		using StackPtr = void*;
+		static constexpr size_t maxStackSize = 0xffffffffu;
+
 		DE_Allocator() = delete;
 		DE_Allocator(void* stackBuffer, size_t size, const char* name = nullptr) :
-			m_stackSize(size), m_isNewStack(false), m_availSize(size)
+			m_stackSize(size < maxStackSize ? size : maxStackSize), m_isNewStack(false)
 		{
-			m_availBottomL = m_stackBottom = stackBuffer;
-			m_availBottomR = (void*)((size_t)m_stackBottom + m_stackSize);
+			m_stackBottom = stackBuffer;
+			m_vm.setCommitted(m_stackBottom, m_stackSize);
 
 			str::strnCpy(m_name, sizeof(m_name),
 				name ? name : "StackAllocator", sizeof(m_name) - 1);
 			m_name[sizeof(m_name) - 1] = '\0';
+			m_stats.lock = &m_mutex;
+			getAllocatorRegistry().add(&m_stats, m_name, "Stack", m_stackSize);
+			if (m_stackSize != size)
+				LOGWARNING("%s uses %zu bytes of its %zu bytes buffer\n", m_name, m_stackSize, size);
+			m_tops.store(packTops(0, static_cast<u32>(m_stackSize)), std::memory_order_relaxed);
+			publishCommitted();
 			//io::log(io::LogLevel::LOG_INFO,
 			//	"%s construct %li bytes buffer for stack\n", m_name, m_stackSize);
 		}
-		DE_Allocator(size_t size, const char* name = nullptr) :
-			m_stackSize(size), m_isNewStack(true), m_availSize(size)
+		DE_Allocator(size_t size, const char* name = nullptr, StackBacking backing = STACK_HEAP) :
+			m_stackSize(size < maxStackSize ? size : maxStackSize), m_isNewStack(true)
 		{
-			m_availBottomL = m_stackBottom = new u8[size];
-			m_availBottomR = (void*)((size_t)m_stackBottom + m_stackSize);
-
 			str::strnCpy(m_name, sizeof(m_name),
 				name ? name : "StackAllocator", sizeof(m_name) - 1);
 			m_name[sizeof(m_name) - 1] = '\0';
-			io::Logger::log(io::Logger::LOG_INFO,
-				"%s new and construct %li bytes buffer for stack\n", m_name, m_stackSize);
+			m_stats.lock = &m_mutex;
+			getAllocatorRegistry().add(&m_stats, m_name, "Stack", m_stackSize);
+			if (m_stackSize != size)
+				LOGWARNING("%s is cut to %zu bytes\n", m_name, m_stackSize);
+
+			m_stackBottom = STACK_HEAP != backing ?
+				m_vm.reserve(m_stackSize, &m_stats, STACK_HUGEPAGE == backing) : nullptr;
+			if (m_stackBottom)
+			{
+				io::Logger::log(io::Logger::LOG_INFO,
+					"%s reserve %li bytes address space for stack\n", m_name, m_stackSize);
+			}
+			else
+			{
+				if (STACK_HEAP != backing)
+					LOGWARNING("%s can't reserve address space, fall back to heap\n", m_name);
+				m_stackBottom = new u8[m_stackSize];
+				m_vm.setCommitted(m_stackBottom, m_stackSize);
+				io::Logger::log(io::Logger::LOG_INFO,
+					"%s new and construct %li bytes buffer for stack\n", m_name, m_stackSize);
+			}
+			m_tops.store(packTops(0, static_cast<u32>(m_stackSize)), std::memory_order_relaxed);
+			publishCommitted();
 		}
 		~DE_Allocator()
 		{
-			if (m_isNewStack)
-				delete []m_stackBottom;
+			if (m_vm.isReserved())
+				m_vm.release();
+			else if (m_isNewStack)
+				delete[] reinterpret_cast<u8*>(m_stackBottom);
+			getAllocatorRegistry().remove(&m_stats);
 			io::Logger::log(io::Logger::LOG_INFO,
 				"%s destruct %ld bytes buffer for stack\n", m_name, m_stackSize);
 		}
 		void* allocL(size_t size)
 		{
-			m_mutex.lock();
-			if (size > m_availSize)
+			u64 tops = m_tops.load(std::memory_order_relaxed);
+			for (;;)
 			{
-				m_mutex.unlock();
-				return nullptr;
+				u32 l = getL(tops), r = getR(tops);
+				if (size > r - l)
+				{
+					m_stats.onFailed();
+					return nullptr;
+				}
+				u32 newL = l + static_cast<u32>(size);
+				if (newL > m_commitL.load(std::memory_order_acquire))
+					return allocL_Locked(size);
+				if (m_tops.compare_exchange_weak(tops, packTops(newL, r),
+					std::memory_order_seq_cst, std::memory_order_relaxed))
+				{
+					/* a trim lowered the limit before the CAS, see trimLocked() */
+					if (newL > m_commitL.load(std::memory_order_seq_cst) && !commitAfterL(l, newL))
+						return nullptr;
+					m_stats.onAlloc(size, AllocatorStats::SIDE_L);
+					return toPtr(l);
+				}
 			}
-
-			void* r = m_availBottomL;
-			m_availBottomL = reinterpret_cast<void*>((size_t)m_availBottomL + size);
-			m_availSize -= size;
-			m_mutex.unlock();
-			return r;
 		}
 		template<typename T>
 		inline T* allocL(int unitNum)
@@ -147,13 +814,45 @@ namespace toy
 		}
 		void freeL(StackPtr mark)
 		{
-			assert((size_t)mark <= (size_t)m_availBottomL &&
-				(size_t)mark >= (size_t)m_stackBottom);
+			assert((size_t)mark >= (size_t)m_stackBottom &&
+				(size_t)mark <= (size_t)m_stackBottom + m_stackSize);
+			u32 markL = toOffset(mark);
 
 			m_mutex.lock();
-			m_availSize += (size_t)m_availBottomL - (size_t)mark;
-			m_availBottomL = mark;
+			u64 tops = m_tops.load(std::memory_order_relaxed);
+			do
+			{
+				assert(markL <= getL(tops));
+			} while (!m_tops.compare_exchange_weak(tops, packTops(markL, getR(tops)),
+				std::memory_order_seq_cst, std::memory_order_relaxed));
+			if (m_vm.isReserved())
+				trimLocked(VirtualRange::trimSlack);
+			m_mutex.unlock();
+			m_stats.onFree(getL(tops) - markL, AllocatorStats::SIDE_L);
+		}
+		/* free [mark, end) only if end is the left top, return false otherwise */
+		bool rewindL(StackPtr mark, StackPtr end)
+		{
+			assert((size_t)mark <= (size_t)end && (size_t)mark >= (size_t)m_stackBottom);
+			u32 markL = toOffset(mark), endL = toOffset(end);
+			m_mutex.lock();
+			u64 tops = m_tops.load(std::memory_order_relaxed);
+			do
+			{
+				if (endL != getL(tops))
+				{
+					m_mutex.unlock();
+					return false;
+				}
+			} while (!m_tops.compare_exchange_weak(tops, packTops(markL, getR(tops)),
+				std::memory_order_seq_cst, std::memory_order_relaxed));
 			m_mutex.unlock();
+			m_stats.onFree(endL - markL, AllocatorStats::SIDE_L);
+			return true;
+		}
+		StackPtr getTopL() const
+		{
+			return toPtr(getL(m_tops.load(std::memory_order_acquire)));
 		}
 		void* allocAlignedL(size_t size, u8 alignment)
 		{
@@ -184,23 +883,45 @@ namespace toy
 		}
 		void* allocR(size_t size)
 		{
-			m_mutex.lock();
-			if (size + sizeof(size_t) + sizeof(bool) > m_availSize)
+			/* store the size before the block,
+			store a mark for multi-threaded free */
+			size_t total = size + headerSize;
+			/* counted before the CAS, freeR() does not walk into blocks whose
+			   header may not be written yet */
+			m_allocRNum.fetch_add(1, std::memory_order_seq_cst);
+			u64 tops = m_tops.load(std::memory_order_relaxed);
+			u32 newR;
+			for (;;)
+			{
+				u32 l = getL(tops), r = getR(tops);
+				if (total > r - l)
+				{
+					leaveAllocR();
+					m_stats.onFailed();
+					return nullptr;
+				}
+				newR = r - static_cast<u32>(total);
+				if (newR < m_commitR.load(std::memory_order_acquire))
+				{
+					leaveAllocR();
+					return allocR_Locked(size);
+				}
+				if (m_tops.compare_exchange_weak(tops, packTops(l, newR),
+					std::memory_order_seq_cst, std::memory_order_relaxed))
+					break;
+			}
+			/* a trim lowered the limit before the CAS, see trimLocked() */
+			if (newR < m_commitR.load(std::memory_order_seq_cst) && !commitAfterR(newR, getR(tops)))
 			{
-				m_mutex.unlock();
+				leaveAllocR();
 				return nullptr;
 			}
-
-			/* store the size before the block,
-			store a mark for multi-threaded free */
-			void* r = reinterpret_cast<void*>((size_t)m_availBottomR - size);
-			m_availBottomR = reinterpret_cast<void*>((size_t)r - sizeof(size_t) - sizeof(bool));
-			*reinterpret_cast<bool*>(m_availBottomR) = false;
-			*reinterpret_cast<size_t*>((size_t)m_availBottomR + sizeof(bool)) = size;
-			m_availSize -= size + sizeof(size_t) + sizeof(bool);
-			m_mutex.unlock();
-
-			return r;
+			void* header = toPtr(newR);
+			*reinterpret_cast<bool*>(header) = false;
+			*reinterpret_cast<size_t*>((size_t)header + sizeof(bool)) = size;
+			leaveAllocR();
+			m_stats.onAlloc(total, AllocatorStats::SIDE_R);
+			return reinterpret_cast<void*>((size_t)header + headerSize);
 		}
 		template<typename T>
 		inline T* allocR(int unitNum)
@@ -209,29 +930,49 @@ namespace toy
 		}
 		void freeR(StackPtr mark)
 		{
-			assert((size_t)mark > (size_t)m_availBottomR &&
+			assert((size_t)mark >= (size_t)m_stackBottom + headerSize &&
 				(size_t)mark <= (size_t)m_stackBottom + m_stackSize);
+			u32 markR = toOffset(mark) - static_cast<u32>(headerSize);
+			size_t size = 0;
 			m_mutex.lock();
-			if ((size_t)mark == (size_t)m_availBottomR + sizeof(size_t) + sizeof(bool))
+			u64 tops = m_tops.load(std::memory_order_acquire);
+			if (markR == getR(tops))
 			{
+				/* release the block and the ones above it freed out of order,
+				   but not into blocks of allocR() still writing their header */
+				bool walk = 0 == m_allocRNum.load(std::memory_order_seq_cst);
+				u32 newR = markR;
 				do
 				{
 					/* fetch the size */
-					size_t size = *reinterpret_cast<size_t*>((size_t)mark - sizeof(size_t));
+					size_t blockSize = *reinterpret_cast<size_t*>((size_t)toPtr(newR) + sizeof(bool));
 					/* Detect if the size had been overwritten */
-					assert(size <= m_stackSize - m_availSize);
-
-					m_availBottomR = reinterpret_cast<void*>((size_t)mark + size);
-
-					m_availSize += size + sizeof(size_t) + sizeof(bool);
-				} while ((size_t)m_availBottomR != (size_t)m_stackBottom + m_stackSize
-					&& *(bool*)m_availBottomR);
-			}
-			else
-			{
-				*reinterpret_cast<bool*>((size_t)mark - sizeof(size_t) - sizeof(bool)) = true;
+					assert(blockSize <= m_stackSize - newR - headerSize);
+					newR += static_cast<u32>(blockSize + headerSize);
+					/* step to the next block, it is released too if it was freed out of order */
+				} while (walk && newR != m_stackSize && *reinterpret_cast<bool*>(toPtr(newR)));
+				/* fails if allocR() moved the right top, the block is not the top any more */
+				while (getR(tops) == markR && !m_tops.compare_exchange_weak(tops,
+					packTops(getL(tops), newR), std::memory_order_seq_cst, std::memory_order_relaxed))
+					;
+				if (getR(tops) == markR)
+				{
+					size = newR - markR;
+					/* the blocks above are left to the last allocR() in flight */
+					if (!walk)
+						m_collapseR.store(true, std::memory_order_seq_cst);
+				}
 			}
+			if (0 == size)
+				*reinterpret_cast<bool*>(mark2Header(mark)) = true;
+			else if (m_vm.isReserved())
+				trimLocked(VirtualRange::trimSlack);
 			m_mutex.unlock();
+			m_stats.onFree(size, AllocatorStats::SIDE_R); //blocks freed out of order count later
+			/* or done here if they all left meanwhile, see leaveAllocR() */
+			if (0 != size && m_collapseR.load(std::memory_order_seq_cst) &&
+				0 == m_allocRNum.load(std::memory_order_seq_cst))
+				collapseR();
 		}
 		void* allocAlignedR(size_t size, u8 alignment)
 		{
@@ -263,10 +1004,12 @@ namespace toy
 		void clear()
 		{
 			m_mutex.lock();
-			m_availBottomL = m_stackBottom;
-			m_availBottomR = (void*)((size_t)m_stackBottom + m_stackSize);
-			m_availSize = m_stackSize;
+			m_tops.store(packTops(0, static_cast<u32>(m_stackSize)), std::memory_order_seq_cst);
+			if (m_vm.isReserved())
+				trimLocked(VirtualRange::trimSlack);
 			m_mutex.unlock();
+			m_stats.setUsedSize(0, AllocatorStats::SIDE_L);
+			m_stats.setUsedSize(0, AllocatorStats::SIDE_R);
 		}
 		void clearL()
 		{
@@ -275,29 +1018,211 @@ namespace toy
 		void clearR()
 		{
 			m_mutex.lock();
-			m_availBottomR = (void*)((size_t)m_stackBottom + m_stackSize);
-			m_availSize = (size_t)m_availBottomR - (size_t)m_availBottomL;
+			u64 tops = m_tops.load(std::memory_order_relaxed);
+			while (!m_tops.compare_exchange_weak(tops, packTops(getL(tops), static_cast<u32>(m_stackSize)),
+				std::memory_order_seq_cst, std::memory_order_relaxed))
+				;
+			if (m_vm.isReserved())
+				trimLocked(VirtualRange::trimSlack);
 			m_mutex.unlock();
+			m_stats.setUsedSize(0, AllocatorStats::SIDE_R);
 		}
 
-		const size_t getAvailSize() const
+		/* bytes on huge pages, see STACK_HUGEPAGE, NOT cheap */
+		size_t getHugePageBytes() const
+		{
+			return m_vm.isReserved() ? m_vm.getHugePageBytes() : 0;
+		}
+		/* give back every page beyond the tops, e.g. when a level finished loading */
+		void trim()
 		{
 			m_mutex.lock();
-			auto ret = m_availSize;
+			if (m_vm.isReserved())
+				trimLocked(0);
 			m_mutex.unlock();
-			return ret;
+		}
+
+		const size_t getAvailSize() const
+		{
+			u64 tops = m_tops.load(std::memory_order_acquire);
+			return getR(tops) - getL(tops);
 		}
 
 	private:
+		static constexpr size_t headerSize = sizeof(size_t) + sizeof(bool);
+
+		static u64 packTops(u32 l, u32 r) { return (u64)r << 32 | l; }
+		static u32 getL(u64 tops) { return static_cast<u32>(tops); }
+		static u32 getR(u64 tops) { return static_cast<u32>(tops >> 32); }
+		u8* toPtr(u32 offset) const { return reinterpret_cast<u8*>(m_stackBottom) + offset; }
+		u32 toOffset(const void* ptr) const
+		{
+			return static_cast<u32>((size_t)ptr - (size_t)m_stackBottom);
+		}
+		static void* mark2Header(StackPtr mark)
+		{
+			return reinterpret_cast<void*>((size_t)mark - headerSize);
+		}
+
+		/* the committed ranges of m_vm as offsets, under m_mutex */
+		void publishCommitted()
+		{
+			size_t endL = m_vm.isReserved() ? (size_t)m_vm.getCommittedEndL() - (size_t)m_stackBottom : m_stackSize;
+			size_t beginR = m_vm.isReserved() ? (size_t)m_vm.getCommittedBeginR() - (size_t)m_stackBottom : 0;
+			m_commitL.store(static_cast<u32>(endL < m_stackSize ? endL : m_stackSize), std::memory_order_seq_cst);
+			m_commitR.store(static_cast<u32>(beginR < m_stackSize ? beginR : m_stackSize), std::memory_order_seq_cst);
+		}
+		/* Under m_mutex. The limits drop to the tops first, so an allocation
+		   moving a top from now on takes m_mutex, then the tops are read again,
+		   an allocation that moved them before is seen and its pages are kept */
+		void trimLocked(size_t slack)
+		{
+			u64 tops = m_tops.load(std::memory_order_seq_cst);
+			m_commitL.store(getL(tops), std::memory_order_seq_cst);
+			m_commitR.store(getR(tops), std::memory_order_seq_cst);
+			tops = m_tops.load(std::memory_order_seq_cst);
+			m_vm.trimL(toPtr(getL(tops)), toPtr(getR(tops)), slack);
+			m_vm.trimR(toPtr(getL(tops)), toPtr(getR(tops)), slack);
+			publishCommitted();
+		}
+
+		/* allocations whose pages need a commit */
+		void* allocL_Locked(size_t size)
+		{
+			std::lock_guard<IMutex> lock(m_mutex);
+			u64 tops = m_tops.load(std::memory_order_relaxed);
+			for (;;)
+			{
+				u32 l = getL(tops), r = getR(tops);
+				if (size > r - l)
+					break;
+				u32 newL = l + static_cast<u32>(size);
+				if (m_vm.needCommitL(toPtr(newL)))
+				{
+					if (!m_vm.commitL(toPtr(newL)))
+						break;
+					publishCommitted();
+				}
+				if (m_tops.compare_exchange_weak(tops, packTops(newL, r),
+					std::memory_order_seq_cst, std::memory_order_relaxed))
+				{
+					m_stats.onAlloc(size, AllocatorStats::SIDE_L);
+					return toPtr(l);
+				}
+			}
+			m_stats.onFailed();
+			return nullptr;
+		}
+		void* allocR_Locked(size_t size)
+		{
+			size_t total = size + headerSize;
+			/* not counted in m_allocRNum, blocks are walked under m_mutex only */
+			std::lock_guard<IMutex> lock(m_mutex);
+			u64 tops = m_tops.load(std::memory_order_relaxed);
+			for (;;)
+			{
+				u32 l = getL(tops), r = getR(tops);
+				if (total > r - l)
+					break;
+				u32 newR = r - static_cast<u32>(total);
+				if (m_vm.needCommitR(toPtr(newR)))
+				{
+					if (!m_vm.commitR(toPtr(newR)))
+						break;
+					publishCommitted();
+				}
+				if (m_tops.compare_exchange_weak(tops, packTops(l, newR),
+					std::memory_order_seq_cst, std::memory_order_relaxed))
+				{
+					void* header = toPtr(newR);
+					*reinterpret_cast<bool*>(header) = false;
+					*reinterpret_cast<size_t*>((size_t)header + sizeof(bool)) = size;
+					m_stats.onAlloc(total, AllocatorStats::SIDE_R);
+					return reinterpret_cast<void*>((size_t)header + headerSize);
+				}
+			}
+			m_stats.onFailed();
+			return nullptr;
+		}
+		/* The last allocR() in flight releases the blocks freed out of order
+		   that freeR() could not walk. freeR() sets m_collapseR before it reads
+		   m_allocRNum again, one of them sees the other */
+		void leaveAllocR()
+		{
+			if (1 == m_allocRNum.fetch_sub(1, std::memory_order_seq_cst) &&
+				m_collapseR.load(std::memory_order_seq_cst))
+				collapseR();
+		}
+		void collapseR()
+		{
+			size_t size = 0;
+			m_mutex.lock();
+			u64 tops = m_tops.load(std::memory_order_seq_cst);
+			/* tops first, an allocR() that moved them is still counted or done */
+			if (0 == m_allocRNum.load(std::memory_order_seq_cst))
+			{
+				m_collapseR.store(false, std::memory_order_relaxed);
+				u32 r = getR(tops), newR = r;
+				while (newR != m_stackSize && *reinterpret_cast<bool*>(toPtr(newR)))
+					newR += static_cast<u32>(*reinterpret_cast<size_t*>((size_t)toPtr(newR) + sizeof(bool)) + headerSize);
+				/* fails if allocR() moved the right top, freeing that block walks them */
+				while (newR != r && getR(tops) == r && !m_tops.compare_exchange_weak(tops,
+					packTops(getL(tops), newR), std::memory_order_seq_cst, std::memory_order_relaxed))
+					;
+				if (getR(tops) == r)
+					size = newR - r;
+				if (0 != size && m_vm.isReserved())
+					trimLocked(VirtualRange::trimSlack);
+			}
+			m_mutex.unlock();
+			m_stats.onFree(size, AllocatorStats::SIDE_R);
+		}
+		/* [l, newL) was bumped while a trim ran, commit it or give it back */
+		bool commitAfterL(u32 l, u32 newL)
+		{
+			std::lock_guard<IMutex> lock(m_mutex);
+			if (!m_vm.needCommitL(toPtr(newL)) || m_vm.commitL(toPtr(newL)))
+			{
+				publishCommitted();
+				return true;
+			}
+			/* only if nothing was allocated after it, lost until freeL() otherwise */
+			u64 tops = m_tops.load(std::memory_order_relaxed);
+			while (getL(tops) == newL && !m_tops.compare_exchange_weak(tops, packTops(l, getR(tops)),
+				std::memory_order_seq_cst, std::memory_order_relaxed))
+				;
+			m_stats.onFailed();
+			return false;
+		}
+		bool commitAfterR(u32 newR, u32 r)
+		{
+			std::lock_guard<IMutex> lock(m_mutex);
+			if (!m_vm.needCommitR(toPtr(newR)) || m_vm.commitR(toPtr(newR)))
+			{
+				publishCommitted();
+				return true;
+			}
+			u64 tops = m_tops.load(std::memory_order_relaxed);
+			while (getR(tops) == newR && !m_tops.compare_exchange_weak(tops, packTops(getL(tops), r),
+				std::memory_order_seq_cst, std::memory_order_relaxed))
+				;
+			m_stats.onFailed();
+			return false;
+		}
+
 		const size_t m_stackSize;
 		const bool m_isNewStack;
 		void* m_stackBottom;
 
-		void* m_availBottomL;
-		void* m_availBottomR;
-		size_t m_availSize;
+		alignas(CACHELINESIZE) std::atomic<u64> m_tops{ 0 };//see packTops()
+		std::atomic<u32> m_commitL{ 0 };//left tops up to it need no commit
+		std::atomic<u32> m_commitR{ 0 };//right tops down to it need no commit
+		std::atomic<u32> m_allocRNum{ 0 };//allocR() between its CAS and its header
+		std::atomic<bool> m_collapseR{ false };//freeR() left blocks freed out of order on the right top
+		VirtualRange m_vm;
 
 		mutable IMutex m_mutex;
+		AllocatorStats m_stats;
 		char m_name[32];
 	};
 
@@ -311,36 +1236,66 @@ namespace toy
 		{
 			m_availBottomL = m_stackBottom = stackBuffer;
 			m_availBottomR = (void*)((size_t)m_stackBottom + m_stackSize);
+			m_vm.setCommitted(m_stackBottom, m_stackSize);
 
 			str::strnCpy(m_name, sizeof(m_name),
 				name ? name : "StackAllocator", sizeof(m_name) - 1);
 			m_name[sizeof(m_name) - 1] = '\0';
+			getAllocatorRegistry().add(&m_stats, m_name, "Stack_NoLock", m_stackSize);
 		}
-		DE_Allocator_NoLock(size_t size, const char* name = nullptr) :
+		DE_Allocator_NoLock(size_t size, const char* name = nullptr, StackBacking backing = STACK_HEAP) :
 			m_stackSize(size), m_isNewStack(true), m_availSize(size)
 		{
-			m_availBottomL = m_stackBottom = new u8[size];
-			m_availBottomR = (void*)((size_t)m_stackBottom + m_stackSize);
-
 			str::strnCpy(m_name, sizeof(m_name),
 				name ? name : "StackAllocator", sizeof(m_name)-1);
 			m_name[sizeof(m_name) - 1] = '\0';
-			io::Logger::log(io::Logger::LOG_INFO,
-				"%s new and construct %li bytes buffer for stack\n", m_name, m_stackSize);
+			getAllocatorRegistry().add(&m_stats, m_name, "Stack_NoLock", m_stackSize);
+
+			m_stackBottom = STACK_HEAP != backing ?
+				m_vm.reserve(size, &m_stats, STACK_HUGEPAGE == backing) : nullptr;
+			if (m_stackBottom)
+			{
+				io::Logger::log(io::Logger::LOG_INFO,
+					"%s reserve %li bytes address space for stack\n", m_name, m_stackSize);
+			}
+			else
+			{
+				if (STACK_HEAP != backing)
+					LOGWARNING("%s can't reserve address space, fall back to heap\n", m_name);
+				m_stackBottom = new u8[size];
+				m_vm.setCommitted(m_stackBottom, m_stackSize);
+				io::Logger::log(io::Logger::LOG_INFO,
+					"%s new and construct %li bytes buffer for stack\n", m_name, m_stackSize);
+			}
+			m_availBottomL = m_stackBottom;
+			m_availBottomR = (void*)((size_t)m_stackBottom + m_stackSize);
 		}
 		~DE_Allocator_NoLock()
 		{
-			if (m_isNewStack)
-				delete []m_stackBottom;
+			if (m_vm.isReserved())
+				m_vm.release();
+			else if (m_isNewStack)
+				delete[] reinterpret_cast<u8*>(m_stackBottom);
+			getAllocatorRegistry().remove(&m_stats);
 		}
 		void* allocL(size_t size)
 		{
 			if (size > m_availSize)
+			{
+				m_stats.onFailed();
 				throw std::bad_alloc();
+			}
 
 			void* r = m_availBottomL;
-			m_availBottomL = reinterpret_cast<void*>((size_t)m_availBottomL + size);
+			void* newTop = reinterpret_cast<void*>((size_t)m_availBottomL + size);
+			if (m_vm.needCommitL(newTop) && !m_vm.commitL(newTop))
+			{
+				m_stats.onFailed();
+				throw std::bad_alloc();
+			}
+			m_availBottomL = newTop;
 			m_availSize -= size;
+			m_stats.onAlloc(size, AllocatorStats::SIDE_L);
 			return r;
 		}
 		template<typename T>
@@ -353,9 +1308,22 @@ namespace toy
 			assert((size_t)mark <= (size_t)m_availBottomL &&
 				(size_t)mark >= (size_t)m_stackBottom);
 
-			m_availSize += (size_t)m_availBottomL - (size_t)mark;
+			size_t size = (size_t)m_availBottomL - (size_t)mark;
+			m_availSize += size;
 			m_availBottomL = mark;
+			if (m_vm.isReserved())
+				m_vm.trimL(m_availBottomL, m_availBottomR);
+			m_stats.onFree(size, AllocatorStats::SIDE_L);
+		}
+		/* free [mark, end) only if end is the left top, return false otherwise */
+		bool rewindL(StackPtr mark, StackPtr end)
+		{
+			if (end != m_availBottomL)
+				return false;
+			freeL(mark);
+			return true;
 		}
+		StackPtr getTopL() const { return m_availBottomL; }
 		void* allocAlignedL(size_t size, u8 alignment)
 		{
 			assert(alignment && (alignment % 2 == 0));
@@ -386,15 +1354,25 @@ namespace toy
 		void* allocR(size_t size)
 		{
 			if (size + sizeof(size_t) + sizeof(bool) > m_availSize)
+			{
+				m_stats.onFailed();
 				throw std::bad_alloc();
+			}
 
 			/* store the size before the block,
 			store a mark for multi-threaded free */
 			void* r = reinterpret_cast<void*>((size_t)m_availBottomR - size);
+			void* newTop = reinterpret_cast<void*>((size_t)r - sizeof(size_t) - sizeof(bool));
+			if (m_vm.needCommitR(newTop) && !m_vm.commitR(newTop))
+			{
+				m_stats.onFailed();
+				throw std::bad_alloc();
+			}
 			m_availBottomR = reinterpret_cast<void*>((size_t)r - sizeof(size_t) - sizeof(bool));
 			*reinterpret_cast<bool*>(m_availBottomR) = false;
 			*reinterpret_cast<size_t*>((size_t)m_availBottomR + sizeof(bool)) = size;
 			m_availSize -= size + sizeof(size_t) + sizeof(bool);
+			m_stats.onAlloc(size + sizeof(size_t) + sizeof(bool), AllocatorStats::SIDE_R);
 
 			return r;
 		}
@@ -415,7 +1393,24 @@ namespace toy
 			
 			m_availBottomR = reinterpret_cast<void*>((size_t)mark + size);
 
-			m_availSize += size + sizeof(size_t);
+			m_availSize += size + sizeof(size_t) + sizeof(bool);
+			if (m_vm.isReserved())
+				m_vm.trimR(m_availBottomL, m_availBottomR);
+			m_stats.onFree(size + sizeof(size_t) + sizeof(bool), AllocatorStats::SIDE_R);
+		}
+		StackPtr getTopR() const { return m_availBottomR; }
+		/* free every right block below top, top is a getTopR() of before */
+		void freeToR(StackPtr top)
+		{
+			assert((size_t)top >= (size_t)m_availBottomR &&
+				(size_t)top <= (size_t)m_stackBottom + m_stackSize);
+
+			size_t size = (size_t)top - (size_t)m_availBottomR;
+			m_availSize += size;
+			m_availBottomR = top;
+			if (m_vm.isReserved())
+				m_vm.trimR(m_availBottomL, m_availBottomR);
+			m_stats.onFree(size, AllocatorStats::SIDE_R);
 		}
 		void* allocAlignedR(size_t size, u8 alignment)
 		{
@@ -449,6 +1444,13 @@ namespace toy
 			m_availBottomL = m_stackBottom;
 			m_availBottomR = (void*)((size_t)m_stackBottom + m_stackSize);
 			m_availSize = m_stackSize;
+			if (m_vm.isReserved())
+			{
+				m_vm.trimL(m_availBottomL, m_availBottomR);
+				m_vm.trimR(m_availBottomL, m_availBottomR);
+			}
+			m_stats.setUsedSize(0, AllocatorStats::SIDE_L);
+			m_stats.setUsedSize(0, AllocatorStats::SIDE_R);
 		}
 		void clearL()
 		{
@@ -458,9 +1460,28 @@ namespace toy
 		{
 			m_availBottomR = (void*)((size_t)m_stackBottom + m_stackSize);
 			m_availSize = (size_t)m_availBottomR - (size_t)m_availBottomL;
+			if (m_vm.isReserved())
+				m_vm.trimR(m_availBottomL, m_availBottomR);
+			m_stats.setUsedSize(0, AllocatorStats::SIDE_R);
+		}
+
+		/* bytes on huge pages, see STACK_HUGEPAGE, NOT cheap */
+		size_t getHugePageBytes() const
+		{
+			return m_vm.isReserved() ? m_vm.getHugePageBytes() : 0;
+		}
+		/* give back every page beyond the tops, e.g. when a level finished loading */
+		void trim()
+		{
+			if (m_vm.isReserved())
+			{
+				m_vm.trimL(m_availBottomL, m_availBottomR, 0);
+				m_vm.trimR(m_availBottomL, m_availBottomR, 0);
+			}
 		}
 
 		const size_t getAvailSize() const { return m_availSize; }
+		size_t getUsedSize() const { return m_stackSize - m_availSize; }
 
 	private:
 		const size_t m_stackSize;
@@ -470,7 +1491,326 @@ namespace toy
 		void* m_availBottomL;
 		void* m_availBottomR;
 		size_t m_availSize;
+		VirtualRange m_vm;
+
+		AllocatorStats m_stats;
+		char m_name[32];
+	};
+
+	/* Scratch stack of the calling thread, SCRATCHSTACKSIZE bytes of
+	   address space reserved on first use and committed as it grows.
+	   Temporary import and decode buffers go there instead of shared
+	   allocators or the heap, open a ScratchScope to use it.
+	   Data on it MUST NOT outlive the scope or move to another thread */
+	DE_Allocator_NoLock& getScratchStack();
+
+	/* Both tops of the scratch stack of the thread are rewound when the scope
+	   is left, scopes nest, blocks freed inside one are simply rewound again */
+	class ScratchScope
+	{
+	public:
+		ScratchScope() : m_stack(getScratchStack()),
+			m_topL(m_stack.getTopL()), m_topR(m_stack.getTopR()) {}
+		ScratchScope(const ScratchScope&) = delete;
+		~ScratchScope()
+		{
+			m_stack.freeL(m_topL);
+			m_stack.freeToR(m_topR);
+		}
+
+		DE_Allocator_NoLock& get() { return m_stack; }
+		DE_Allocator_NoLock* operator->() { return &m_stack; }
+
+	private:
+		DE_Allocator_NoLock& m_stack;
+		void* const m_topL;
+		void* const m_topR;
+	};
+
+	/* Heap of movable blocks reached through handles. Blocks are bumped on
+	   the top, a freed block leaves a hole until compact() slides the live
+	   blocks above it down, a few of them per call. The owner of a moved
+	   block is told through its relocate callback.
+	   Blocks are blockAlign aligned, NOT thread-safe */
+	class HandleHeap
+	{
+	public:
+		using Handle = u32;
+		static constexpr Handle invalidHandle = 0;
+		static constexpr size_t blockAlign = 16;
+		/* called after the block moved, oldPtr is only an address
+		   (the bytes may be overwritten), pointers into the block MUST be patched */
+		typedef void(*RelocateFunc)(void* user, void* oldPtr, void* newPtr);
+
+		HandleHeap() = delete;
+		HandleHeap(const HandleHeap&) = delete;
+		HandleHeap(size_t capacity, const char* name = nullptr, StackBacking backing = STACK_VIRTUAL);
+		~HandleHeap();
+
+		/* return invalidHandle if the heap is full even after a full compaction */
+		Handle alloc(size_t size, RelocateFunc relocate = nullptr, void* user = nullptr);
+		void free(Handle handle);
+		/* the address is valid until the next compact() or alloc() */
+		inline void* get(Handle handle) const
+		{
+			assert(handle < m_entries.size() && m_entries[handle].block);
+			return m_entries[handle].block + sizeof(BlockHeader);
+		}
+		/* move live blocks down until about maxBytes were moved,
+		   return true if no hole is left */
+		bool compact(size_t maxBytes);
+		void compactAll() { while (!compact((size_t)-1)); }
+		/* free every block, no callback is called */
+		void clear();
+		/* give back the pages beyond the top */
+		void trim();
+
+		size_t getUsedSize() const { return m_usedSize; }
+		/* freed bytes not given back by compaction yet */
+		size_t getHoleSize() const
+		{
+			return (m_top - m_base) - m_usedSize - (m_scan ? m_scan - m_dst : 0);
+		}
+		/* freed bytes below the top, the garbage of a pass in progress included */
+		size_t getFreedSize() const { return (m_top - m_base) - m_usedSize; }
+		const char* getName() const { return m_name; }
+
+	private:
+		struct BlockHeader
+		{
+			Handle handle; //invalidHandle once freed
+			u32 pad;
+			size_t size; //header included
+		};
+		struct Entry
+		{
+			u8* block; //nullptr if the entry is free
+			RelocateFunc relocate;
+			void* user;
+			Handle nextFree;
+		};
+		static_assert(sizeof(BlockHeader) % blockAlign == 0, "blocks must stay aligned");
+
+		const size_t m_capacity;
+		u8* m_buffer = nullptr; //newed when the address space can't be reserved
+		u8* m_base = nullptr;
+		u8* m_top = nullptr;
+		/* a compaction pass moves the blocks at m_scan to m_dst,
+		   [m_dst, m_scan) is garbage, m_scan is nullptr between passes */
+		u8* m_scan = nullptr;
+		u8* m_dst = nullptr;
+		u8* m_firstHole = nullptr; //lowest hole not in a pass, nullptr if none
+		size_t m_usedSize = 0;
+		std::vector<Entry> m_entries; //[0] is never used
+		Handle m_freeEntry = invalidHandle;
+		VirtualRange m_vm;
+
+		AllocatorStats m_stats;
+		char m_name[32];
+	};
+
+	/* Linear allocator for per-frame transient data, made of regionNum
+	   regions used in turn. endFrame() moves to the next region and resets
+	   it, so data of a frame stays valid while that frame is submitted.
+	   alloc() is lock-free and nothing is freed one by one */
+	class FrameAllocator
+	{
+	public:
+		FrameAllocator() = delete;
+		FrameAllocator(const FrameAllocator&) = delete;
+		FrameAllocator(size_t regionSize, uint regionNum = 2, const char* name = nullptr) :
+			m_regionSize(regionSize), m_regionNum(regionNum)
+		{
+			assert(regionNum >= 2 && "a region is reset while the previous one is in use");
+			m_regionBottom = m_buffer = new u8[regionSize * regionNum];
+
+			str::strnCpy(m_name, sizeof(m_name),
+				name ? name : "FrameAllocator", sizeof(m_name) - 1);
+			m_name[sizeof(m_name) - 1] = '\0';
+			getAllocatorRegistry().add(&m_stats, m_name, "Frame", regionSize * regionNum);
+			io::Logger::log(io::Logger::LOG_INFO,
+				"%s new and construct %d x %li bytes buffer for frames\n",
+				m_name, m_regionNum, m_regionSize);
+		}
+		~FrameAllocator()
+		{
+			delete[] m_buffer;
+			getAllocatorRegistry().remove(&m_stats);
+			io::Logger::log(io::Logger::LOG_INFO,
+				"%s destruct %d x %li bytes buffer for frames\n",
+				m_name, m_regionNum, m_regionSize);
+		}
+
+		/* return nullptr if the region of this frame is used up */
+		void* alloc(size_t size, size_t alignment = 16)
+		{
+			assert(alignment && 0 == (alignment & (alignment - 1)));
+			size_t offset = m_top.fetch_add(size + alignment - 1, std::memory_order_relaxed);
+			size_t base = reinterpret_cast<size_t>(m_regionBottom);
+			size_t addr = (base + offset + alignment - 1) & ~(alignment - 1);
+			if (addr + size > base + m_regionSize)
+			{
+				if (!m_overflowed.exchange(true, std::memory_order_relaxed))
+					LOGWARNING("%s out of space, %li bytes per frame\n", m_name, m_regionSize);
+				m_stats.onFailed();
+				return nullptr;
+			}
+			return reinterpret_cast<void*>(addr);
+		}
+		template<typename T>
+		inline T* alloc(size_t unitNum)
+		{
+			return reinterpret_cast<T*>(alloc(sizeof(T) * unitNum, alignof(T)));
+		}
+
+		/* NOT thread-safe, call it once at the end of every frame */
+		void endFrame()
+		{
+			size_t used = m_top.load(std::memory_order_relaxed);
+			m_lastFrameUsed = used < m_regionSize ? used : m_regionSize;
+			m_stats.setUsedSize(m_lastFrameUsed); //only whole frames are counted
+			m_curRegion = (m_curRegion + 1) % m_regionNum;
+			m_regionBottom = m_buffer + m_regionSize * m_curRegion;
+			m_top.store(0, std::memory_order_relaxed);
+			m_overflowed.store(false, std::memory_order_relaxed);
+			++m_frameIndex;
+		}
+
+		size_t getRegionSize() const { return m_regionSize; }
+		size_t getLastFrameUsedSize() const { return m_lastFrameUsed; }
+		u64 getFrameIndex() const { return m_frameIndex; }
+
+	private:
+		u8* m_buffer;
+		u8* m_regionBottom;
+		const size_t m_regionSize;
+		const uint m_regionNum;
+		uint m_curRegion = 0;
+		u64 m_frameIndex = 0;
+		size_t m_lastFrameUsed = 0;
+		AllocatorStats m_stats;
+
+		alignas(CACHELINESIZE) std::atomic<size_t> m_top{ 0 };
+		std::atomic<bool> m_overflowed{ false };
 
 		char m_name[32];
 	};
+
+	/* Hooks of tStlAllocator for every kind of arena, overload them to add one.
+	   Stacks hand out blocks from the left end with allocAlignedL(), the
+	   adjustment byte before a block tells where it starts when it is freed */
+	inline u8 arenaStackAlignment(size_t alignment)
+	{
+		assert(alignment <= 128 && "stacks keep the adjustment in a byte");
+		return static_cast<u8>(alignment < 2 ? 2 : alignment);
+	}
+	inline void* arenaAlloc(DE_Allocator_NoLock& arena, size_t size, size_t alignment)
+	{
+		return arena.allocAlignedL(size, arenaStackAlignment(alignment));
+	}
+	inline void arenaFree(DE_Allocator_NoLock& arena, void* ptr, size_t size, size_t alignment)
+	{
+		u8* mark = reinterpret_cast<u8*>(ptr) - *(reinterpret_cast<u8*>(ptr) - 1);
+		arena.rewindL(mark, mark + size + arenaStackAlignment(alignment));
+	}
+	inline void* arenaAlloc(DE_Allocator& arena, size_t size, size_t alignment)
+	{
+		return arena.allocAlignedL(size, arenaStackAlignment(alignment));
+	}
+	inline void arenaFree(DE_Allocator& arena, void* ptr, size_t size, size_t alignment)
+	{
+		u8* mark = reinterpret_cast<u8*>(ptr) - *(reinterpret_cast<u8*>(ptr) - 1);
+		arena.rewindL(mark, mark + size + arenaStackAlignment(alignment));
+	}
+	inline void* arenaAlloc(ChunkedPoolAllocator& arena, size_t size, size_t)
+	{
+		assert(size <= arena.getUnitSize() && "pools serve node based containers only");
+		return size <= arena.getUnitSize() ? arena.allocUnit() : nullptr;
+	}
+	inline void arenaFree(ChunkedPoolAllocator& arena, void* ptr, size_t, size_t)
+	{
+		arena.freeUnit(ptr);
+	}
+	template<typename UnitType>
+	inline void* arenaAlloc(tPoolAllocator<UnitType>& arena, size_t size, size_t)
+	{
+		assert(size <= sizeof(UnitType) && "pools serve node based containers only");
+		return size <= sizeof(UnitType) ? arena.allocUnit() : nullptr;
+	}
+	template<typename UnitType>
+	inline void arenaFree(tPoolAllocator<UnitType>& arena, void* ptr, size_t, size_t)
+	{
+		arena.freeUnit(ptr);
+	}
+	template<typename UnitType, u32 magSize>
+	inline void* arenaAlloc(tPoolAllocator_LockFree<UnitType, magSize>& arena,
+		size_t size, size_t)
+	{
+		assert(size <= sizeof(UnitType) && "pools serve node based containers only");
+		return size <= sizeof(UnitType) ? arena.allocUnit() : nullptr;
+	}
+	template<typename UnitType, u32 magSize>
+	inline void arenaFree(tPoolAllocator_LockFree<UnitType, magSize>& arena,
+		void* ptr, size_t, size_t)
+	{
+		arena.freeUnit(ptr);
+	}
+	inline void* arenaAlloc(SmallObjectAllocator& arena, size_t size, size_t alignment)
+	{
+		return alignment <= 16 ? arena.alloc(size) : nullptr;
+	}
+	inline void arenaFree(SmallObjectAllocator& arena, void* ptr, size_t size, size_t)
+	{
+		arena.free(ptr, size);
+	}
+
+	/* Standard allocator over an engine arena, so containers can be put in
+	   the arena of their owner and go away with it. A stack only takes a
+	   block back when it is at the top, e.g. the last buffer a container
+	   grew to, other blocks stay until the stack is cleared. Pools give
+	   one unit a time, so they suit node based containers only */
+	template<typename T, typename Arena>
+	class tStlAllocator
+	{
+	public:
+		using value_type = T;
+		using propagate_on_container_copy_assignment = std::true_type;
+		using propagate_on_container_move_assignment = std::true_type;
+		using propagate_on_container_swap = std::true_type;
+
+		explicit tStlAllocator(Arena* arena) noexcept : m_arena(arena) {}
+		template<typename U>
+		tStlAllocator(const tStlAllocator<U, Arena>& other) noexcept :
+			m_arena(other.getArena())
+		{}
+
+		T* allocate(size_t unitNum)
+		{
+			if (unitNum > static_cast<size_t>(-1) / sizeof(T))
+				throw std::bad_alloc();
+			void* r = arenaAlloc(*m_arena, sizeof(T) * unitNum, alignof(T));
+			if (nullptr == r)
+				throw std::bad_alloc();
+			return reinterpret_cast<T*>(r);
+		}
+		void deallocate(T* ptr, size_t unitNum) noexcept
+		{
+			arenaFree(*m_arena, ptr, sizeof(T) * unitNum, alignof(T));
+		}
+
+		Arena* getArena() const noexcept { return m_arena; }
+
+	private:
+		Arena* m_arena;
+	};
+	template<typename T, typename U, typename Arena>
+	inline bool operator==(const tStlAllocator<T, Arena>& a, const tStlAllocator<U, Arena>& b) noexcept
+	{
+		return a.getArena() == b.getArena();
+	}
+	template<typename T, typename U, typename Arena>
+	inline bool operator!=(const tStlAllocator<T, Arena>& a, const tStlAllocator<U, Arena>& b) noexcept
+	{
+		return a.getArena() != b.getArena();
+	}
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include "Memory.h"
 #include "IRenderDriver.h"
 #include "AssetImporter.h"
+#include "JobSystem.h"
 #include <vector>
 
 namespace toy
@@ -27,7 +28,7 @@ namespace toy
 		};
 		SceneObjectProperty(SceneObjFlag flag = SOF_DEFAULT) : m_flag(flag) {}
 
-		bool getProperty(SceneObjFlag prop) { return m_flag & prop; }
+		bool getProperty(SceneObjFlag prop) const { return m_flag & prop; }
 		void setProperty(SceneObjFlag prop) { m_flag |= prop; }
 		void clearProperty(SceneObjFlag prop) { m_flag &= ~prop; }
 		void reverseProperty(SceneObjFlag prop) { m_flag ^= prop; }
@@ -71,6 +72,8 @@ namespace toy
 		float m_zoom;
 	};
 	
+	/* skel, skelAnims and rMeshes point into the data block in the scene heap,
+	   they are patched when the block moves */
 	class ScenePrefab
 	{
 	public:
@@ -78,20 +81,89 @@ namespace toy
 		AssetModel::SkeletalAnimation *skelAnims;
 		rd::RenderMesh *rMeshes;
 		uint meshNum;
+		uint animNum;
 		IShaderProgram* prog;
+		HandleHeap::Handle data;
+		fmat4* freeBones;//bone matrices of removed instances, linked through their first matrix
 	};
 
-	struct ScenePrefabInstance
+	/* Slot map of the instances of prefabs, stored as columns, row i of
+	   every column is one instance, so the per-frame loops stream the
+	   columns they need. Rows stay packed, remove() moves the last row
+	   into the hole. An instance is reached through a handle made of its
+	   slot and the generation of the slot, the generation changes when the
+	   instance is removed, so a handle kept after that is seen as invalid.
+	   Columns live in the scene arena */
+	class SceneInstanceTable
 	{
-		fmat4 mmat;//model matrix
-		ScenePrefab* prefab;
-		fmat4 *amats;//skeletal animation matrices
-		SceneObjectProperty flag;
+	public:
+		using Handle = u32;
+		static constexpr Handle invalidHandle = 0xffffffff;
+		static constexpr u32 slotBits = 20;
+		static constexpr u32 maxSlotNum = (1u << slotBits) - 1;//the last slot would make invalidHandle
+
+		explicit SceneInstanceTable(DE_Allocator_NoLock* allocator);
+		SceneInstanceTable(const SceneInstanceTable&) = delete;
+
+		/* append num rows of prefab, model matrices are mmats or identities,
+		   bones is nullptr or the boneNum matrices of every row, owned by the
+		   caller. Handles go to handles if it is not nullptr, return the first
+		   one, invalidHandle if the slots are used up */
+		Handle add(ScenePrefab* prefab, SceneObjectProperty flag, uint num,
+			const fmat4* mmats, fmat4* const* bones, u32 boneNum, Handle* handles = nullptr);
+		/* O(1), the last row takes the place of the removed one */
+		bool remove(Handle ins);
+		/* remove every instance of prefab */
+		void removePrefab(const ScenePrefab* prefab);
+		/* room for num instances, so adding them does not grow the columns one by one */
+		void reserve(uint num);
+		/* drop every instance and give the columns back to the arena */
+		void release();
+
+		uint getNum() const { return static_cast<uint>(m_prefabs.size()); }
+		bool isValid(Handle ins) const
+		{
+			u32 slot = ins & maxSlotNum;
+			return slot < m_slotRows.size() && invalidRow != m_slotRows[slot] &&
+				m_slotGens[slot] == ins >> slotBits;
+		}
+		uint getRow(Handle ins) const { assert(isValid(ins)); return m_slotRows[ins & maxSlotNum]; }
+
+		/* getNum() rows, valid until instances are added or removed */
+		fmat4* getModelMatrices() { return m_mmats.data(); }
+		const fmat4* getModelMatrices() const { return m_mmats.data(); }
+		SceneObjectProperty* getFlags() { return m_flags.data(); }
+		ScenePrefab* const* getPrefabs() const { return m_prefabs.data(); }
+		fmat4* const* getBoneMatrices() const { return m_bones.data(); }
+		const u32* getBoneNums() const { return m_boneNums.data(); }
+
+	private:
+		static constexpr u32 invalidRow = 0xffffffff;
+		static constexpr u32 genMask = (1u << (32 - slotBits)) - 1;
+		template<typename T>
+		using Column = std::vector<T, tStlAllocator<T, DE_Allocator_NoLock>>;
+
+		Handle makeHandle(u32 slot) const { return static_cast<u32>(m_slotGens[slot]) << slotBits | slot; }
+		void moveRow(uint dst, uint src);
+		void popRow(uint row);
+
+		Column<fmat4> m_mmats;//model matrices
+		Column<SceneObjectProperty> m_flags;
+		Column<ScenePrefab*> m_prefabs;
+		Column<fmat4*> m_bones;//skeletal animation matrices, nullptr if not animated
+		Column<u32> m_boneNums;
+		Column<u32> m_rowSlots;//slot of every row
+		Column<u32> m_slotRows;//row of every slot, invalidRow if it is free
+		Column<u16> m_slotGens;//generation of every slot, part of its handles
+		Column<u32> m_freeSlots;
 	};
 	
 	class Scene
 	{
 	public:
+		static constexpr uint maxCameraNum = 8;
+		static constexpr uint animateBatchNum = 16;//animated instances a job samples
+
 		struct SceneTex
 		{
 			u64 hash;
@@ -101,15 +173,38 @@ namespace toy
 
 		Scene(const char* name,
 			DE_Allocator_NoLock* allocator,
+			size_t heapSize,
 			IRenderDriver* rdr,
 			AssetImporter* imp);
+		~Scene();
 		
 		void freeScene();
 
-		DE_Allocator_NoLock::StackPtr getTopL() { return m_allocator->allocL(0); }
+		DE_Allocator_NoLock::StackPtr getTopL() { return m_allocator->getTopL(); }
+		/* give the pages not used by the scene back to the OS */
+		void trimMemory() { m_allocator->trim(); m_heap.trim(); }
+		void reportMemory();
+		/* move at most about maxBytes of prefab data to close the holes of freed prefabs */
+		void compactMemory(size_t maxBytes) { m_heap.compact(maxBytes); }
 
-		ScenePrefabInstance* newPrefabInstances(
-			ScenePrefab* prefab, uint instNum, SceneObjectProperty flag);
+		using InstanceHandle = SceneInstanceTable::Handle;
+		/* instNum instances of prefab with model matrices mmats, or identities
+		   if it is nullptr, bone matrices of removed instances of prefab are
+		   reused and the ones still needed are one block.
+		   Handles go to handles if it is not nullptr, return the first one */
+		InstanceHandle newPrefabInstances(ScenePrefab* prefab, uint instNum,
+			SceneObjectProperty flag, const fmat4* mmats = nullptr, InstanceHandle* handles = nullptr);
+		uint getInstanceNum() const { return m_insts.getNum(); }
+		void reserveInstances(uint num) { m_insts.reserve(num); }
+		/* references are valid until instances are added or removed */
+		fmat4& getModelMatrix(InstanceHandle ins) { return m_insts.getModelMatrices()[m_insts.getRow(ins)]; }
+		/* handles of removed instances are not valid any more */
+		bool isInstanceValid(InstanceHandle ins) const { return m_insts.isValid(ins); }
+		/* return false if ins is not valid, its bone matrices are kept for the
+		   next instances of its prefab. NOT while the scene is updated */
+		bool removeInstance(InstanceHandle ins);
+		SceneObjectProperty& getInstanceFlag(InstanceHandle ins) { return m_insts.getFlags()[m_insts.getRow(ins)]; }
+		ScenePrefab* getInstancePrefab(InstanceHandle ins) { return m_insts.getPrefabs()[m_insts.getRow(ins)]; }
 
 		SceneTex* loadTexture(const char* path, u64 hash = 0, uint slen = 0);
 		SceneTex* loadTexture(AssetPath* path)
@@ -120,28 +215,81 @@ namespace toy
 		SceneTex* loadTextures(const char* const *filepath, uint texNum);
 		void loadModelMaterials(ScenePrefab* prefab, const char* modelPath);
 		ScenePrefab* loadModel(const char* filepath, bool loadMats = true);
+#if TOY_COROUTINES
+		/* loadModel() as a coroutine, the file is read and decoded on workers
+		   and the prefab made on the main thread, start several to load them
+		   at the same time, filepath must live until the task is done */
+		CoTask<ScenePrefab*> loadModelAsync(
+			JobSystem& jobs, const char* filepath, bool loadMats = true);
+#endif
+		/* unload a prefab and its instances, bone matrices of the instances
+		   and materials stay in the scene stack until the scene is freed */
+		void freePrefab(ScenePrefab* prefab);
 
 		void sort();
 
-		void update(Camera* cam, double time);
-		void drawAll(Camera* cam);
+		/* A frame is updated in stages, animate(), then prepareDraw(),
+		   updateCamera() of every camera may run alongside them.
+		   Everything goes to frame memory, drawAll() uses it on the render thread */
+		/* sample the skeletal animation of every animated instance,
+		   in parallelFor() batches of animateBatchNum if jobs is not nullptr */
+		void animate(double time, JobSystem* jobs = nullptr);
+		/* per-instance draw data of this frame */
+		void prepareDraw();
+		/* matrices of camera camIdx for this frame */
+		void updateCamera(uint camIdx, const Camera* cam);
+		void drawAll(uint camIdx);
 
 		const char* getSceneName() { return m_name; }
 
 	private:
-		std::vector<ScenePrefab*> m_pPrefs;
-		std::vector<ScenePrefabInstance*> m_objs;
-		std::vector<SceneTex*> m_texs;
+		/* containers live in the scene arena too, see releaseContainers() */
+		using ArenaAllocator = tStlAllocator<void*, DE_Allocator_NoLock>;
+		template<typename T>
+		using ArenaVector = std::vector<T, tStlAllocator<T, DE_Allocator_NoLock>>;
+		void releaseContainers();
+
+		void animateInstances(uint first, uint num, double time, fmat4* nodemats);
+
+		/* texture paths and materials of the model open in the importer */
+		struct ModelMaterials
+		{
+			uint pathNum;
+			AssetPath* paths;
+			uint matNum;
+			AssetMaterial* mats;
+			u8* matIndices;//material of every mesh
+		};
+		bool readModelMaterials(uint meshNum, ModelMaterials& out, DE_Allocator_NoLock* mem);
+		void applyModelMaterials(ScenePrefab* prefab, const char* modelPath,
+			const ModelMaterials& mats, DE_Allocator_NoLock* mem);
+		/* upload the meshes of model and keep [begin, end) in the heap as a new prefab,
+		   the block holds rMeshes and the skeletal data of model */
+		ScenePrefab* keepModel(const AssetModel& model, rd::RenderMesh* rMeshes,
+			void* begin, void* end, const char* filepath);
+
+		ArenaVector<ScenePrefab*> m_pPrefs;
+		SceneInstanceTable m_insts;
+		ArenaVector<SceneTex*> m_texs;
 		DE_Allocator_NoLock *m_allocator;
+		HandleHeap m_heap;//prefab data, see ScenePrefab
+		tChunkedPoolAllocator<ScenePrefab> m_prefabPool;
 		AssetImporter* m_imp;
 		IRenderDriver *m_rdr;
 		const char* m_name;
+		void* m_drawData = nullptr;//per-instance draw data in frame memory, from prepareDraw() to drawAll()
+		u64 m_drawFrame = 0;
+		void* m_camData[maxCameraNum] = {};//camera matrices in frame memory
+		u64 m_camFrame[maxCameraNum] = {};
 	};
 	
 	class SceneManager
 	{
 	public:
-		void init(size_t spaceSize, IRenderDriver *rdr);
+		/* spaceSize is the address space reserved for every scene,
+		   assets are loaded on jobs if it is not nullptr */
+		void init(size_t spaceSize, IRenderDriver *rdr, StackBacking backing = STACK_VIRTUAL,
+			JobSystem* jobs = nullptr);
 		void destroy();
 		
 		Scene* getSharedScene() { return m_sharedScene; }
@@ -151,20 +299,35 @@ namespace toy
 		Scene* getSceneNowLoading() { return m_loadingScene; }
 		void endLoadScene(Scene* scene);
 
+		/* update the current scene on the calling thread */
 		void update(double time);
+		/* add the update of the current scene to graph, it starts after node after,
+		   cameras and the scene are updated in parallel, animation is sampled
+		   by jobs, return the node done when the whole update is done */
+		TaskGraph::NodeId addUpdateNodes(
+			TaskGraph& graph, JobSystem* jobs, double time, TaskGraph::NodeId after);
 		void drawAll();
 		
 		Scene* getCurrentScene() { return m_curScene; }
 		void switchScene(Scene* scene);
 	private:
-		Scene* m_sharedScene;
+		static void compactNode(void* arg, uint);
+		static void animateNode(void* arg, uint);
+		static void drawDataNode(void* arg, uint);
+		static void cameraNode(void* arg, uint camIdx);
+
+		Scene* m_sharedScene = nullptr;
 		Scene* m_prevScene = nullptr;
 		Scene* m_curScene = nullptr;
 		Scene* m_loadingScene = nullptr;
 		Scene* (m_scenes)[8] = { nullptr };
 		std::vector<Camera> m_cams;
 		DE_Allocator *m_allocator = nullptr;
+		size_t m_sceneSpaceSize = 0;
+		StackBacking m_sceneBacking = STACK_VIRTUAL;
 		IRenderDriver *m_rdr = nullptr;
 		AssetImporter m_imp;
+		JobSystem* m_updateJobs = nullptr;//for the nodes of addUpdateNodes()
+		double m_updateTime = 0.0;
 	};
 }
\ No newline at end of file
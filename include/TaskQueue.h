@@ -5,83 +5,262 @@
 namespace toy
 {
 	using TaskCall = ErrNo(*) (void* arg);
-	
+
+	/* Number of quests not done yet, a quest pushed with a counter
+	   adds one to it and takes it back after tc and cb have run,
+	   whoever depends on the quests waits until it drops to 0 */
+	class JobCounter
+	{
+	public:
+		JobCounter() = default;
+		JobCounter(const JobCounter&) = delete;
+
+		void add(u32 num = 1) { m_num.fetch_add(num, std::memory_order_relaxed); }
+		void done() { m_num.fetch_sub(1, std::memory_order_acq_rel); }
+		u32 get() const { return m_num.load(std::memory_order_acquire); }
+		bool isDone() const { return 0 == get(); }
+
+	private:
+		std::atomic<u32> m_num{ 0 };
+	};
+
+	enum TaskQuestFlag
+	{
+		QUEST_NONE = 0,
+		QUEST_MAIN_THREAD_CB = bit(0), //JobSystem runs cb on its main thread, see JobSystem::drainMainThread()
+	};
+
 	struct alignas(CACHELINESIZE) TaskQuest
 	{
 		TaskCall tc; //task call function
 		TaskCall cb; //callback function
-		u8 padding[CACHELINESIZE - 2 * sizeof(TaskCall)/sizeof(u8)];
+		JobCounter* counter; //nullptr or counted down when the quest is done
+		u32 flags; //TaskQuestFlag
+		alignas(void*) u8 padding[CACHELINESIZE - 4 * sizeof(void*)];
 	};
+	static_assert(sizeof(TaskQuest) == CACHELINESIZE, "TaskQuest is a cache line");
 
-	/* Multi-producer-single-consumer lock-free task queue,
-	   it will have mistakes when the queue is full.
-	!! qlen MUST be power of 2, DO NOT set mask */
-	template<int qlen = 4096, int mask = qlen - 1>
-	class tTaskQueue
+	/* Bounded multi-producer-multi-consumer ring (Dmitry Vyukov's),
+	   every slot carries a sequence number telling whether it is ready
+	   for the next push or the next pop, so producers and consumers
+	   only race on their own position counter.
+	!! qlen MUST be power of 2 */
+	template<typename T, int qlen = 4096>
+	class tMPMCQueue
 	{
 	public:
-		void init() { assert(2 == ATOMIC_INT_LOCK_FREE); }
+		static_assert(qlen > 1 && 0 == (qlen & (qlen - 1)), "qlen MUST be power of 2");
 
-		TaskQuest* createQuest()
+		tMPMCQueue()
 		{
-			m_inCount.fetch_add(1, std::memory_order_relaxed);
-			int in = m_dqi.fetch_add(1, std::memory_order_relaxed) & mask;
-			m_dqi.fetch_and(mask, std::memory_order_relaxed);
-			return &m_dq[in];
+			for (int i = 0; i != qlen; ++i)
+				m_slots[i].seq.store(i, std::memory_order_relaxed);
 		}
+		tMPMCQueue(const tMPMCQueue&) = delete;
 
-		void push(TaskQuest* quest)
+		/* return false if the queue is full */
+		bool tryPush(const T& value)
+		{
+			if (push_NoCount(value))
+				return true;
+			m_fullCount.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		/* spin, then yield, until there is room */
+		void pushWait(const T& value)
+		{
+			if (push_NoCount(value))
+				return;
+			m_fullCount.fetch_add(1, std::memory_order_relaxed);
+			for (uint spin = 0; !push_NoCount(value); ++spin)
+			{
+				if (spin < 64)
+					cpuRelax();
+				else
+					std::this_thread::yield();
+			}
+		}
+		/* return false if the queue is empty */
+		bool tryPop(T& value)
+		{
+			size_t pos = m_popPos.load(std::memory_order_relaxed);
+			Slot* slot;
+			for (;;)
+			{
+				slot = &m_slots[pos & (qlen - 1)];
+				size_t seq = slot->seq.load(std::memory_order_acquire);
+				intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+				if (0 == dif)
+				{
+					if (m_popPos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+						break;
+				}
+				else if (dif < 0)
+					return false;
+				else
+					pos = m_popPos.load(std::memory_order_relaxed);
+			}
+			value = slot->value;
+			slot->seq.store(pos + qlen, std::memory_order_release);
+			return true;
+		}
+
+		/* only a hint while other threads push or pop */
+		size_t getSize() const
+		{
+			size_t pushPos = m_pushPos.load(std::memory_order_relaxed);
+			size_t popPos = m_popPos.load(std::memory_order_relaxed);
+			return pushPos > popPos ? pushPos - popPos : 0;
+		}
+		bool empty() const { return 0 == getSize(); }
+		static constexpr int getCapacity() { return qlen; }
+
+		/* times a push found the queue full */
+		u64 getFullCount() const { return m_fullCount.load(std::memory_order_relaxed); }
+		void resetFullCount() { m_fullCount.store(0, std::memory_order_relaxed); }
+
+	private:
+		struct Slot
 		{
-			int dqOffset = static_cast<int>(quest - m_dq);
-			int iqOffset = m_iqwi.fetch_add(1, std::memory_order_relaxed) & mask;
-			m_iqwi.fetch_and(mask, std::memory_order_relaxed);
-			m_iq[iqOffset] = dqOffset;
+			std::atomic<size_t> seq;
+			T value;
+		};
+		bool push_NoCount(const T& value)
+		{
+			size_t pos = m_pushPos.load(std::memory_order_relaxed);
+			Slot* slot;
+			for (;;)
+			{
+				slot = &m_slots[pos & (qlen - 1)];
+				size_t seq = slot->seq.load(std::memory_order_acquire);
+				intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+				if (0 == dif)
+				{
+					if (m_pushPos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+						break;
+				}
+				else if (dif < 0)
+					return false;
+				else
+					pos = m_pushPos.load(std::memory_order_relaxed);
+			}
+			slot->value = value;
+			slot->seq.store(pos + 1, std::memory_order_release);
+			return true;
+		}
 
-			atomic_thread_fence(std::memory_order_relaxed);
+		Slot m_slots[qlen];
+		alignas(CACHELINESIZE) std::atomic<size_t> m_pushPos{ 0 };
+		alignas(CACHELINESIZE) std::atomic<size_t> m_popPos{ 0 };
+		alignas(CACHELINESIZE) std::atomic<u64> m_fullCount{ 0 };
+	};
 
-			int iqo = iqOffset;
-			while (!m_iqri.compare_exchange_strong(iqo, (iqOffset + 1) & mask,
-					std::memory_order_acq_rel))
-				iqo = iqOffset;
+	/* Bounded multi-producer-multi-consumer task queue of qlen quests.
+	   Free quests and pushed quests are indices in two tMPMCQueue,
+	   createQuest() returns nullptr when every quest is in flight,
+	   so a burst of requests waits or retries instead of overwriting
+	   live quests.
+	!! qlen MUST be power of 2 */
+	template<int qlen = 4096>
+	class tTaskQueue
+	{
+	public:
+		tTaskQueue()
+		{
+			for (int i = 0; i != qlen; ++i)
+				m_free.tryPush(i);
 		}
+		void init() { assert(2 == ATOMIC_INT_LOCK_FREE); }
 
-		void run()
+		/* return nullptr if all quests are in flight */
+		TaskQuest* createQuest()
 		{
-			int ri = m_iqri.load(std::memory_order_relaxed);
-			while (m_iqo != ri)
+			int index;
+			if (!m_free.tryPop(index))
 			{
-				auto &quest = m_dq[m_iq[m_iqo]];
-				if (quest.tc)
+				m_fullCount.fetch_add(1, std::memory_order_relaxed);
+				return nullptr;
+			}
+			m_inCount.fetch_add(1, std::memory_order_relaxed);
+			m_dq[index].counter = nullptr;
+			m_dq[index].flags = QUEST_NONE;
+			return &m_dq[index];
+		}
+		/* wait until a quest is given back by a consumer */
+		TaskQuest* createQuestWait()
+		{
+			TaskQuest* quest = createQuest();
+			for (uint spin = 0; nullptr == quest; ++spin)
+			{
+				if (spin < 64)
+					cpuRelax();
+				else
+					std::this_thread::yield();
+				int index;
+				if (m_free.tryPop(index))
 				{
-					if (TOY_OK == quest.tc(quest.padding) && quest.cb)
-						quest.cb(quest.padding);
+					m_inCount.fetch_add(1, std::memory_order_relaxed);
+					quest = &m_dq[index];
+					quest->counter = nullptr;
+					quest->flags = QUEST_NONE;
 				}
-				_Compiler_barrier();
-				m_iqo = (m_iqo + 1) & mask;
+			}
+			return quest;
+		}
+
+		void push(TaskQuest* quest)
+		{
+			assert(quest >= m_dq && quest < m_dq + qlen);
+			if (quest->counter)
+				quest->counter->add();
+			/* never full, there are only qlen quests */
+			bool pushed = m_ready.tryPush(static_cast<int>(quest - m_dq));
+			assert(pushed);
+			(void)pushed;
+		}
 
-				++m_runCount;
+		/* run one pushed quest, return false if there was none */
+		bool runOne()
+		{
+			int index;
+			if (!m_ready.tryPop(index))
+				return false;
+			auto &quest = m_dq[index];
+			if (quest.tc)
+			{
+				if (TOY_OK == quest.tc(quest.padding) && quest.cb)
+					quest.cb(quest.padding);
 			}
+			auto counter = quest.counter;
+			m_free.tryPush(index);
+			if (counter)
+				counter->done();
+			m_runCount.fetch_add(1, std::memory_order_relaxed);
+			return true;
+		}
+		/* run until no quest is pushed, may be called by several threads */
+		void run()
+		{
+			while (runOne())
+				;
 		}
 
 		/* functions help to manage the number of task */
-		void resetRunCount() { m_runCount = 0; }
-		int getRunCount() { return m_runCount; }
+		void resetRunCount() { m_runCount.store(0, std::memory_order_relaxed); }
+		int getRunCount() { return m_runCount.load(std::memory_order_relaxed); }
 		void resetInputCount() { m_inCount.store(0, std::memory_order_relaxed); }
 		int getInputCount() { return m_inCount.load(std::memory_order_relaxed); }
+		/* times createQuest() found every quest in flight */
+		void resetFullCount() { m_fullCount.store(0, std::memory_order_relaxed); }
+		u64 getFullCount() { return m_fullCount.load(std::memory_order_relaxed); }
 
 	private:
 		TaskQuest m_dq[qlen]; //Data queue
+		tMPMCQueue<int, qlen> m_free;
+		tMPMCQueue<int, qlen> m_ready;
 
-		std::atomic_int m_dqi = 0;
-		std::atomic_int m_inCount = 0;
-		u8 padding1[CACHELINESIZE - 2 * sizeof(std::atomic_int) / sizeof(u8)];
-
-		std::atomic_int m_iqwi = 0;
-		std::atomic_int m_iqri = 0;
-		u8 padding2[CACHELINESIZE - 2 * sizeof(std::atomic_int) / sizeof(u8)];
-		int m_iq[qlen] = { 0 }; //Index queue
-		
-		int m_iqo = 0;
-		int m_runCount = 0;
+		alignas(CACHELINESIZE) std::atomic_int m_inCount{ 0 };
+		std::atomic_int m_runCount{ 0 };
+		std::atomic<u64> m_fullCount{ 0 };
 	};
-}
\ No newline at end of file
+}
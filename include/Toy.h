@@ -5,7 +5,7 @@
 #include "IWindow.h"
 #include "LuaInterpreter.h"
 #include "Timer.h"
-//#include "TaskQueue.h"
+#include "JobSystem.h"
 #include "SceneManager.h"
 
 namespace toy
@@ -28,8 +28,18 @@ namespace toy
 		io::Logger* getLogger() { return &m_logger; }
 		SceneManager* getSceneManager() { return &m_smgr; }
 		Timer* getMainTimer() { return &m_mainTimer; }
+		FrameAllocator* getFrameAllocator() { return m_frameAllocator; }
+		JobSystem* getJobSystem() { return &m_jobs; }
 
+		/* f runs on the main thread before the scene is updated,
+		   it may move cameras and instances but not load or free anything */
 		void setHIDReflection(HIDReflectionFunc f) { m_hidFun = f; }
+		/* log allocator stats every frameNum frames, 0 to stop */
+		void setMemoryDumpInterval(uint frameNum) { m_memDumpInterval = frameNum; }
+		/* log the frame task graph with its critical path every frameNum frames, 0 to stop */
+		void setFrameTraceInterval(uint frameNum) { m_traceDumpInterval = frameNum; }
+		/* time every frame gives to the main thread mailbox of the job system */
+		void setMainThreadBudget(s64 budgetNs) { m_mainBudgetNs = budgetNs; }
 		int mainLoop();
 	private:
 		HIDAdapter m_hid;
@@ -39,5 +49,12 @@ namespace toy
 		SceneManager m_smgr;
 		HIDReflectionFunc m_hidFun;
 		Timer m_mainTimer;
+		FrameAllocator* m_frameAllocator = nullptr;
+		JobSystem m_jobs;
+		TaskGraph m_frameGraph;
+		s64 m_frameTime = 0;
+		s64 m_mainBudgetNs = MAINTHREADBUDGETUS * 1000;
+		uint m_memDumpInterval = 0;
+		uint m_traceDumpInterval = 0;
 	};
 }
\ No newline at end of file
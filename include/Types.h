@@ -168,7 +168,7 @@ namespace toy
 #define POINTOFFSET(base, ptr) ((size_t)(ptr) - (size_t)(base))
 
 #ifdef TOY_COMPILER_VC
-#elif TOY_COMPILER_GCC
+#elif defined(TOY_COMPILER_GCC)
 #else
 #endif
 }
\ No newline at end of file
@@ -51,33 +51,46 @@ void reflectHID(toy::ToyEngine* eng, toy::s64 ftime)
 	}
 }
 
-void loadScene(toy::SceneManager* smgr)
+void loadScene(toy::SceneManager* smgr, toy::JobSystem* jobs)
 {
 	auto scene = smgr->newScene("TestScene");
 
 	toy::io::setCWD("D:/Projects/Models/");
+#if TOY_COROUTINES
+	/* both models are read and decoded on workers at the same time */
+	auto bikiniLoad = scene->loadModelAsync(*jobs, "Bikini_girl\\bikini.fbx", true);
+	auto neptuneLoad = scene->loadModelAsync(*jobs, "Neptune\\Neptune.FBX", true);
+	bikiniLoad.start();
+	neptuneLoad.start();
+	bikiniLoad.wait(*jobs);
+	neptuneLoad.wait(*jobs);
+	auto bikini = bikiniLoad.get();
+	auto neptune = neptuneLoad.get();
+#else
 	auto bikini = scene->loadModel("Bikini_girl\\bikini.fbx", true);
-	bikini->prog = aprog;
-
 	auto neptune = scene->loadModel("Neptune\\Neptune.FBX", true);
+#endif
+	bikini->prog = aprog;
 	neptune->prog = prog;
 
-	auto bikiniIns = scene->newPrefabInstances(
-		bikini, 1, toy::SceneObjectProperty::SOF_ANIMATED);
+	toy::fmat4 bikiniMat;
 	toy::sqtMat(
 		toy::fvec3(0.02f),
 		toy::fquat(0.0f, toy::fvec3(1.0f, 0.0f, 0.0f)),
 		toy::fvec3(-1.0f),
-		bikiniIns->mmat);
+		bikiniMat);
+	scene->newPrefabInstances(
+		bikini, 1, toy::SceneObjectProperty::SOF_ANIMATED, &bikiniMat);
 
-	auto neptuneIns = scene->newPrefabInstances(
-		neptune, 1, toy::SceneObjectProperty::SOF_VISIBLE);
+	toy::fmat4 neptuneMat;
 	toy::fquat q = toy::fquat(-half_pi, X_Axis) * toy::fquat(pi, Z_Axis);
 	toy::sqtMat(
 		toy::fvec3(1.0f),
 		q,
 		toy::fvec3(1.0f),
-		neptuneIns->mmat);
+		neptuneMat);
+	scene->newPrefabInstances(
+		neptune, 1, toy::SceneObjectProperty::SOF_VISIBLE, &neptuneMat);
 
 	scene->sort();
 
@@ -111,7 +124,7 @@ int main(int argc, char* argv[])
 	cam = smgr->newCamera();
 	cam->moveUp(1.0f);
 	
-	loadScene(smgr);
+	loadScene(smgr, eng.getJobSystem());
 
 	eng.setHIDReflection(reflectHID);
 	eng.mainLoop();
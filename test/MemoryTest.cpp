@@ -0,0 +1,198 @@
+/* Allocator correctness tests, build it as a console program together
+   with Memory.cpp, IThread.cpp and IO.cpp, build with _DEBUG for asserts.
+   usage: MemoryTest
+   Every test prints its name and ok or FAILED, the exit code is the
+   number of failed tests */
+#include "../include/Memory.h"
+
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace
+{
+	using namespace toy;
+
+	int failedNum = 0;
+
+	void report(const char* name, bool ok)
+	{
+		printf("%-40s %s\n", name, ok ? "ok" : "FAILED");
+		if (!ok)
+			++failedNum;
+	}
+
+	/* fill size bytes with a pattern of seed, check() tells if it is intact */
+	void fill(void* ptr, size_t size, u8 seed)
+	{
+		u8* p = reinterpret_cast<u8*>(ptr);
+		for (size_t i = 0; i != size; ++i)
+			p[i] = static_cast<u8>(seed + i * 31);
+	}
+	bool check(const void* ptr, size_t size, u8 seed)
+	{
+		const u8* p = reinterpret_cast<const u8*>(ptr);
+		for (size_t i = 0; i != size; ++i)
+		{
+			if (p[i] != static_cast<u8>(seed + i * 31))
+				return false;
+		}
+		return true;
+	}
+
+	/* Every stack is reserved right after a committed block of another
+	   size, the two usually sit next to each other in the address space.
+	   Stacks are used up to both of their ends and trimmed, a stack that
+	   reaches past its reservation breaks the block next to it */
+	void testVirtualStackTop()
+	{
+		constexpr int stackNum = 16;
+		constexpr size_t stackSize = 1024 * 1024;
+		constexpr size_t blockSize = 4096;
+		const size_t pageSize = vm::getPageSize();
+		bool ok = true;
+		void* neighbours[stackNum];
+		size_t neighbourSizes[stackNum];
+		std::unique_ptr<DE_Allocator> stacks[stackNum];
+		std::vector<void*> blocks[stackNum];
+		for (int i = 0; i != stackNum; ++i)
+		{
+			neighbourSizes[i] = pageSize * (i + 1);
+			neighbours[i] = vm::reserve(neighbourSizes[i]);
+			ok = ok && neighbours[i] && vm::commit(neighbours[i], neighbourSizes[i]);
+			if (!ok)
+				break;
+			fill(neighbours[i], neighbourSizes[i], static_cast<u8>(~i));
+
+			stacks[i].reset(new DE_Allocator(stackSize, "TestVirtualStack", STACK_VIRTUAL));
+			/* right end first, then the left end takes what is left */
+			while (void* block = stacks[i]->allocR(blockSize))
+			{
+				fill(block, blockSize, static_cast<u8>(i));
+				blocks[i].push_back(block);
+			}
+			size_t rest = stacks[i]->getAvailSize();
+			void* last = stacks[i]->allocL(rest);
+			ok = ok && last && 0 == stacks[i]->getAvailSize();
+			if (last)
+				fill(last, rest, static_cast<u8>(i));
+			/* trims decommit pages, they must be pages of the stack itself */
+			stacks[i]->clearL();
+			stacks[i]->trim();
+		}
+		for (int i = 0; ok && i != stackNum; ++i)
+		{
+			ok = check(neighbours[i], neighbourSizes[i], static_cast<u8>(~i));
+			for (size_t j = 0; ok && j != blocks[i].size(); ++j)
+				ok = check(blocks[i][j], blockSize, static_cast<u8>(i));
+		}
+		for (int i = 0; i != stackNum; ++i)
+		{
+			stacks[i].reset();
+			if (neighbours[i])
+				vm::release(neighbours[i], neighbourSizes[i]);
+		}
+		report("virtual stack up to its top", ok);
+	}
+
+	/* Threads share the right end of one stack, every thread frees its
+	   blocks in a shuffled order, so most frees are out of order and
+	   other threads allocate while blocks are collapsed.
+	   Blocks must keep their bytes until freed and the whole stack must
+	   be available once every block is freed */
+	void testSharedStackR()
+	{
+		constexpr int threadNum = 8;
+		constexpr int roundNum = 500;
+		constexpr int holdNum = 32;
+		constexpr size_t stackSize = 16 * 1024 * 1024;
+		DE_Allocator stack(stackSize, "TestSharedStack", STACK_VIRTUAL);
+		std::atomic<int> corrupted{ 0 };
+		std::atomic<int> failed{ 0 };
+		std::vector<std::thread> threads;
+		for (int t = 0; t != threadNum; ++t)
+		{
+			threads.emplace_back([&, t]()
+			{
+				u32 rnd = 0x9E3779B9u * (t + 1);
+				auto next = [&rnd]() { rnd ^= rnd << 13; rnd ^= rnd >> 17; rnd ^= rnd << 5; return rnd; };
+				void* blocks[holdNum];
+				size_t sizes[holdNum];
+				u8 seeds[holdNum];
+				for (int round = 0; round != roundNum; ++round)
+				{
+					int num = 0;
+					for (; num != holdNum; ++num)
+					{
+						sizes[num] = 1 + next() % 2048;
+						blocks[num] = stack.allocR(sizes[num]);
+						if (nullptr == blocks[num])
+						{
+							++failed;
+							break;
+						}
+						seeds[num] = static_cast<u8>(t * holdNum + num);
+						fill(blocks[num], sizes[num], seeds[num]);
+					}
+					for (int i = num - 1; i > 0; --i)
+					{
+						int j = next() % (i + 1);
+						std::swap(blocks[i], blocks[j]);
+						std::swap(sizes[i], sizes[j]);
+						std::swap(seeds[i], seeds[j]);
+					}
+					for (int i = 0; i != num; ++i)
+					{
+						if (!check(blocks[i], sizes[i], seeds[i]))
+							++corrupted;
+						stack.freeR(blocks[i]);
+					}
+				}
+			});
+		}
+		for (auto& thread : threads)
+			thread.join();
+		/* a full stack is fine while the threads overlap, it must come back
+		   without another allocR() or freeR() to release the blocks left */
+		bool ok = 0 == corrupted && stackSize == stack.getAvailSize();
+		if (!ok)
+			printf("  corrupted %d, failed %d, %zu of %zu bytes available\n",
+				corrupted.load(), failed.load(), stack.getAvailSize(), stackSize);
+		report("shared stack allocR/freeR", ok);
+	}
+
+	/* A full heap whose only freed bytes are the garbage of a compaction
+	   pass in progress, alloc() must finish the pass instead of failing */
+	void testHandleHeapPassInProgress()
+	{
+		constexpr size_t blockSize = 1024;
+		constexpr size_t size = blockSize - 16; //BlockHeader
+		HandleHeap heap(3 * blockSize, "TestHandleHeap", STACK_HEAP);
+		HandleHeap::Handle a = heap.alloc(size);
+		HandleHeap::Handle b = heap.alloc(size);
+		HandleHeap::Handle c = heap.alloc(size);
+		bool ok = a && b && c;
+		if (ok)
+		{
+			fill(heap.get(b), size, 0xb);
+			fill(heap.get(c), size, 0xc);
+			heap.free(a);
+			/* moves b down, stops at c */
+			ok = !heap.compact(blockSize) && 0 == heap.getHoleSize();
+			HandleHeap::Handle d = heap.alloc(size);
+			ok = ok && d && check(heap.get(b), size, 0xb) && check(heap.get(c), size, 0xc);
+		}
+		report("handle heap alloc in a compaction pass", ok);
+	}
+}
+
+int main()
+{
+	testVirtualStackTop();
+	testSharedStackR();
+	testHandleHeapPassInProgress();
+	return failedNum;
+}